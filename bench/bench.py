@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+"""Benchmarks of ftpfs against the local FTP server of ftpd.py.
+
+A fixture tree is created under --work, ftpd.py serves it on 127.0.0.1, and
+every workload runs on a fresh mount, so that it starts with cold caches.
+Results are written as JSON, and compared with an earlier run given by
+--baseline. Mounting needs root and the module built (make).
+
+    sudo python3 bench/bench.py --out results.json [--baseline old.json]
+"""
+
+import argparse
+import json
+import os
+import platform
+import random
+import socket
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+MiB = 1 << 20
+
+
+class Bench:
+    def __init__(self, args):
+        self.args = args
+        self.root = os.path.join(args.work, "root")
+        self.mnt = os.path.join(args.work, "mnt")
+        self.server = None
+
+    # fixtures
+
+    def fixtures(self):
+        """Create the served tree once, reused by later runs."""
+        a = self.args
+        os.makedirs(self.mnt, exist_ok=True)
+        stamp = os.path.join(a.work, "fixtures-%d-%d-%d-%d-%d-%d" % (
+            a.size, a.dir_max, a.readers, a.depth, a.small, a.small_size))
+        if os.path.exists(stamp):
+            return
+        rnd = random.Random(1)
+        os.makedirs(self.root, exist_ok=True)
+        for i in range(a.readers):
+            with open(os.path.join(self.root, "big%d" % i), "wb") as f:
+                for _ in range(a.size // MiB):
+                    f.write(rnd.randbytes(MiB))
+        for n in (10, 1000, 100000):
+            if n > a.dir_max:
+                continue
+            d = os.path.join(self.root, "dir%d" % n)
+            os.makedirs(d, exist_ok=True)
+            for i in range(n):
+                open(os.path.join(d, "file%06d" % i), "wb").close()
+        deep = self.root
+        for i in range(a.depth):
+            deep = os.path.join(deep, "d%02d" % i)
+        os.makedirs(deep, exist_ok=True)
+        open(os.path.join(deep, "leaf"), "wb").close()
+        small = os.path.join(self.root, "small")
+        os.makedirs(small, exist_ok=True)
+        for i in range(a.small):
+            with open(os.path.join(small, "s%04d" % i), "wb") as f:
+                f.write(rnd.randbytes(a.small_size))
+        open(stamp, "w").close()
+
+    # server and mount
+
+    def start_server(self):
+        cmd = [sys.executable, os.path.join(HERE, "ftpd.py"), "--root", self.root,
+               "--port", str(self.args.port), "--latency", str(self.args.latency)]
+        if self.args.no_feat:
+            cmd.append("--no-feat")
+        self.server = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+        for _ in range(100):
+            try:
+                socket.create_connection(("127.0.0.1", self.args.port), 1).close()
+                return
+            except OSError:
+                time.sleep(0.05)
+        raise RuntimeError("ftpd.py did not start")
+
+    def stop_server(self):
+        if self.server is not None:
+            self.server.terminate()
+            self.server.wait()
+
+    def check_module(self):
+        with open("/proc/filesystems") as f:
+            if not any(line.split()[-1] == "ftpfs" for line in f if line.strip()):
+                raise RuntimeError("ftpfs is not registered, load ftpfs.ko first (make bench)")
+
+    def mount(self):
+        opts = "server=127.0.0.1:%d,user=bench,pass=bench" % self.args.port
+        if self.args.options:
+            opts += "," + self.args.options
+        subprocess.check_call(["mount", "-t", "ftpfs", "-o", opts, "none", self.mnt])
+        # a mount that does not show the served tree would time nothing
+        if not os.path.ismount(self.mnt) or "small" not in os.listdir(self.mnt):
+            self.umount()
+            raise RuntimeError("%s does not show the tree served on port %d" % (self.mnt, self.args.port))
+
+    def umount(self):
+        subprocess.call(["umount", self.mnt])
+
+    # workloads, each returning (bytes, operations)
+
+    def seq_read(self):
+        with open(os.path.join(self.mnt, "big0"), "rb", buffering=0) as f:
+            total = 0
+            while True:
+                n = len(f.read(MiB))
+                if n == 0:
+                    return total, total // MiB
+                total += n
+
+    def seq_write(self):
+        buf = random.Random(2).randbytes(MiB)
+        with open(os.path.join(self.mnt, "written"), "wb", buffering=0) as f:
+            for _ in range(self.args.size // MiB):
+                f.write(buf)
+            os.fsync(f.fileno())
+        return self.args.size, self.args.size // MiB
+
+    def rand_read(self):
+        rnd = random.Random(3)
+        n = self.args.random_ops
+        with open(os.path.join(self.mnt, "big0"), "rb", buffering=0) as f:
+            for _ in range(n):
+                f.seek(rnd.randrange(self.args.size // 4096) * 4096)
+                f.read(4096)
+        return n * 4096, n
+
+    def ls_l(self, n):
+        d = os.path.join(self.mnt, "dir%d" % n)
+        count = 0
+        for entry in os.scandir(d):
+            entry.stat(follow_symlinks=False)
+            count += 1
+        return 0, count
+
+    def deep_walk(self):
+        parts = ["d%02d" % i for i in range(self.args.depth)]
+        count = 0
+        # the first walk looks every component up, the others hit the dcache
+        for _ in range(100):
+            os.stat(os.path.join(self.mnt, *parts, "leaf"))
+            count += 1
+        return 0, count
+
+    def small_read(self):
+        d = os.path.join(self.mnt, "small")
+        total = 0
+        for name in sorted(os.listdir(d)):
+            with open(os.path.join(d, name), "rb") as f:
+                total += len(f.read())
+        return total, self.args.small
+
+    def small_write(self):
+        d = os.path.join(self.mnt, "small_out")
+        os.makedirs(d, exist_ok=True)
+        buf = random.Random(4).randbytes(self.args.small_size)
+        for i in range(self.args.small):
+            with open(os.path.join(d, "s%04d" % i), "wb") as f:
+                f.write(buf)
+        return self.args.small * self.args.small_size, self.args.small
+
+    def multi_read(self):
+        totals = [0] * self.args.readers
+
+        def reader(i):
+            with open(os.path.join(self.mnt, "big%d" % i), "rb", buffering=0) as f:
+                while True:
+                    n = len(f.read(MiB))
+                    if n == 0:
+                        return
+                    totals[i] += n
+
+        threads = [threading.Thread(target=reader, args=(i,)) for i in range(self.args.readers)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        return sum(totals), sum(totals) // MiB
+
+    def workloads(self):
+        w = [("seq_read", self.seq_read), ("seq_write", self.seq_write),
+             ("rand_read", self.rand_read)]
+        for n in (10, 1000, 100000):
+            if n <= self.args.dir_max:
+                w.append(("ls_l_%d" % n, lambda n=n: self.ls_l(n)))
+        w += [("deep_walk", self.deep_walk), ("small_read", self.small_read),
+              ("small_write", self.small_write), ("multi_read", self.multi_read)]
+        return [x for x in w if not self.args.only or x[0] in self.args.only]
+
+    def cleanup(self):
+        for path in (os.path.join(self.root, "written"), os.path.join(self.root, "small_out")):
+            if os.path.isdir(path):
+                for name in os.listdir(path):
+                    os.unlink(os.path.join(path, name))
+                os.rmdir(path)
+            elif os.path.exists(path):
+                os.unlink(path)
+
+    def run(self):
+        results = []
+        for name, fn in self.workloads():
+            runs = []
+            for _ in range(self.args.repeat):
+                self.cleanup()
+                self.mount()
+                try:
+                    start = time.perf_counter()
+                    nbytes, ops = fn()
+                    runs.append(time.perf_counter() - start)
+                finally:
+                    self.umount()
+            secs = statistics.median(runs)
+            result = {"name": name, "seconds": secs, "runs": runs, "bytes": nbytes, "ops": ops,
+                      "mib_per_s": nbytes / MiB / secs if nbytes else None,
+                      "ops_per_s": ops / secs}
+            print("%-14s %10.4f s %10s MiB/s %12.1f ops/s" % (
+                name, secs, "%.1f" % result["mib_per_s"] if nbytes else "-", result["ops_per_s"]),
+                file=sys.stderr)
+            results.append(result)
+        return results
+
+
+def git_rev():
+    try:
+        return subprocess.check_output(["git", "-C", HERE, "rev-parse", "--short", "HEAD"],
+                                       stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def compare(results, meta, baseline):
+    """Print the change of the median time of each workload from <baseline>."""
+    # times of another kernel or other workload sizes are not comparable
+    for key in ("kernel", "args"):
+        if baseline["meta"].get(key) != meta[key]:
+            print("warning: baseline %s differs: %s" % (key, baseline["meta"].get(key)), file=sys.stderr)
+    old = {r["name"]: r for r in baseline["results"]}
+    print("\n%-14s %10s %10s %8s" % ("workload", "baseline", "now", "change"), file=sys.stderr)
+    for r in results:
+        if r["name"] in old:
+            before = old[r["name"]]["seconds"]
+            print("%-14s %10.4f %10.4f %+7.1f%%" % (
+                r["name"], before, r["seconds"], (r["seconds"] / before - 1) * 100), file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--work", default="/tmp/ftpfs-bench", help="fixture and mount directory")
+    parser.add_argument("--port", type=int, default=2121)
+    parser.add_argument("--latency", type=float, default=0,
+                        help="seconds the server waits before each reply")
+    parser.add_argument("--no-feat", action="store_true", help="serve without MLSD and EPSV")
+    parser.add_argument("--options", default="", help="extra mount options")
+    parser.add_argument("--size", type=int, default=256, help="size of large files in MiB")
+    parser.add_argument("--dir-max", type=int, default=100000,
+                        help="largest directory listed (10, 1000 or 100000)")
+    parser.add_argument("--depth", type=int, default=32, help="depth of the path walked")
+    parser.add_argument("--small", type=int, default=1000, help="number of small files")
+    parser.add_argument("--small-size", type=int, default=4096)
+    parser.add_argument("--random-ops", type=int, default=2000)
+    parser.add_argument("--readers", type=int, default=4, help="concurrent readers")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--only", nargs="*", help="workloads to run")
+    parser.add_argument("--out", help="JSON output file, stdout if not given")
+    parser.add_argument("--baseline", help="JSON output of an earlier run to compare with")
+    args = parser.parse_args()
+    args.size *= MiB
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    bench = Bench(args)
+    bench.check_module()
+    bench.fixtures()
+    bench.start_server()
+    try:
+        results = bench.run()
+    finally:
+        bench.stop_server()
+
+    doc = {"meta": {"kernel": platform.release(), "revision": git_rev(),
+                    "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+                    "args": {k: v for k, v in vars(args).items() if k not in ("out", "baseline")}},
+           "results": results}
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(doc, f, indent=2)
+    else:
+        json.dump(doc, sys.stdout, indent=2)
+        print()
+    if baseline is not None:
+        compare(results, doc["meta"], baseline)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
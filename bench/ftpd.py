@@ -0,0 +1,353 @@
+#!/usr/bin/env python3
+"""Minimal FTP server for benchmarking ftpfs on the loopback interface.
+
+It serves a directory with the commands ftpfs uses: passive data connections
+(EPSV and PASV), REST, RETR, STOR, APPE, ABOR, LIST, MLSD, MLST, SIZE, MDTM
+and the directory operations. Commands are read while a transfer runs, so ABOR
+and pipelined commands behave as on a real server. Only the Python standard
+library is needed.
+
+    python3 ftpd.py --root /srv/ftp --port 2121 [--latency 0.005] [--no-feat]
+"""
+
+import argparse
+import os
+import socket
+import socketserver
+import stat
+import sys
+import threading
+import time
+
+CHUNK = 1 << 20
+
+
+def mlst_facts(path, st):
+    kind = "dir" if stat.S_ISDIR(st.st_mode) else "file"
+    modify = time.strftime("%Y%m%d%H%M%S", time.gmtime(st.st_mtime))
+    return "type=%s;size=%d;modify=%s;unique=%xg%x;" % (
+        kind, st.st_size, modify, st.st_dev, st.st_ino)
+
+
+def list_line(name, st):
+    mode = stat.filemode(st.st_mode)
+    if time.time() - st.st_mtime < 180 * 86400:
+        when = time.strftime("%b %d %H:%M", time.gmtime(st.st_mtime))
+    else:
+        when = time.strftime("%b %d  %Y", time.gmtime(st.st_mtime))
+    return "%s %3d ftp ftp %12d %s %s" % (mode, st.st_nlink, st.st_size, when, name)
+
+
+class Session(socketserver.StreamRequestHandler):
+    """One control connection."""
+
+    def setup(self):
+        super().setup()
+        self.lock = threading.Lock()
+        self.passive = None
+        self.rest = 0
+        self.rnfr = None
+        self.data = None
+        self.transfer = None
+        self.aborted = False
+
+    def reply(self, text):
+        if self.server.latency:
+            time.sleep(self.server.latency)
+        with self.lock:
+            self.wfile.write((text + "\r\n").encode("utf-8", "surrogateescape"))
+            self.wfile.flush()
+
+    def path(self, arg):
+        """Map a path of the client into the root, which it cannot leave."""
+        rel = os.path.normpath("/" + (arg or ".")).lstrip("/")
+        return os.path.join(self.server.root, rel)
+
+    def handle(self):
+        self.reply("220 ftpfs bench server ready")
+        for raw in self.rfile:
+            line = raw.decode("utf-8", "surrogateescape").rstrip("\r\n")
+            cmd, _, arg = line.partition(" ")
+            handler = getattr(self, "do_" + cmd.upper(), None)
+            if handler is None:
+                self.reply("502 Command not implemented")
+                continue
+            try:
+                if handler(arg) is False:
+                    break
+            except OSError as e:
+                self.reply("550 %s" % e.strerror)
+        self.close_data()
+
+    # session
+
+    def do_USER(self, arg):
+        self.reply("331 Password required")
+
+    def do_PASS(self, arg):
+        self.reply("230 Logged in")
+
+    def do_TYPE(self, arg):
+        self.reply("200 Type set")
+
+    def do_SYST(self, arg):
+        self.reply("215 UNIX Type: L8")
+
+    def do_NOOP(self, arg):
+        self.reply("200 OK")
+
+    def do_QUIT(self, arg):
+        self.reply("221 Bye")
+        return False
+
+    def do_FEAT(self, arg):
+        if self.server.no_feat:
+            self.reply("502 Command not implemented")
+            return
+        self.reply("211-Features:\r\n MLST type*;size*;modify*;unique*;\r\n"
+                   " SIZE\r\n MDTM\r\n EPSV\r\n REST STREAM\r\n211 End")
+
+    def do_PWD(self, arg):
+        self.reply('257 "/"')
+
+    def do_CWD(self, arg):
+        if os.path.isdir(self.path(arg)):
+            self.reply("250 OK")
+        else:
+            self.reply("550 No such directory")
+
+    # data connections
+
+    def listen(self):
+        self.close_data()
+        self.passive = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.passive.bind((self.server.server_address[0], 0))
+        self.passive.listen(1)
+        return self.passive.getsockname()[1]
+
+    def do_EPSV(self, arg):
+        if self.server.no_feat:
+            self.reply("502 Command not implemented")
+            return
+        self.reply("229 Entering Extended Passive Mode (|||%d|)" % self.listen())
+
+    def do_PASV(self, arg):
+        port = self.listen()
+        host = self.server.server_address[0].replace(".", ",")
+        self.reply("227 Entering Passive Mode (%s,%d,%d)" % (host, port >> 8, port & 255))
+
+    def accept(self):
+        if self.passive is None:
+            self.reply("425 Use EPSV or PASV first")
+            return None
+        self.passive.settimeout(30)
+        try:
+            conn, _ = self.passive.accept()
+        except OSError:
+            self.reply("425 Cannot open data connection")
+            return None
+        finally:
+            self.passive.close()
+            self.passive = None
+        return conn
+
+    def close_data(self):
+        if self.passive is not None:
+            self.passive.close()
+            self.passive = None
+        data = self.data
+        if data is not None:
+            try:
+                data.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+        if self.transfer is not None:
+            self.transfer.join()
+            self.transfer = None
+
+    def start(self, work, conn):
+        """Run the transfer <work> on the data connection <conn> in background,
+        so that ABOR is read meanwhile. It sends the final reply."""
+        self.data = conn
+        self.aborted = False
+
+        def run():
+            try:
+                work(conn)
+                ok = not self.aborted
+            except OSError:
+                ok = False
+            finally:
+                conn.close()
+            self.data = None
+            self.reply("226 Transfer complete" if ok else "426 Transfer aborted")
+
+        self.transfer = threading.Thread(target=run, daemon=True)
+        self.transfer.start()
+
+    def do_ABOR(self, arg):
+        active = self.transfer is not None and self.transfer.is_alive()
+        self.aborted = True
+        self.close_data()
+        self.reply("226 Abort successful" if active else "225 No transfer to abort")
+
+    def do_REST(self, arg):
+        self.rest = int(arg)
+        self.reply("350 Restarting at %d" % self.rest)
+
+    def do_RETR(self, arg):
+        offset, self.rest = self.rest, 0
+        f = open(self.path(arg), "rb")
+        conn = self.accept()
+        if conn is None:
+            f.close()
+            return
+        self.reply("150 Opening data connection")
+
+        def send(conn):
+            with f:
+                conn.sendfile(f, offset)
+
+        self.start(send, conn)
+
+    def do_STOR(self, arg):
+        offset, self.rest = self.rest, 0
+        path = self.path(arg)
+        f = open(path, "r+b" if offset and os.path.exists(path) else "wb")
+        f.truncate(offset)
+        f.seek(offset)
+        self.store(f)
+
+    def do_APPE(self, arg):
+        self.rest = 0
+        self.store(open(self.path(arg), "ab"))
+
+    def store(self, f):
+        conn = self.accept()
+        if conn is None:
+            f.close()
+            return
+        self.reply("150 Opening data connection")
+
+        def recv(conn):
+            buf = bytearray(CHUNK)
+            view = memoryview(buf)
+            with f:
+                while True:
+                    n = conn.recv_into(buf)
+                    if n == 0:
+                        break
+                    f.write(view[:n])
+
+        self.start(recv, conn)
+
+    def listing(self, arg, fmt):
+        # "LIST -al path"
+        args = [a for a in arg.split(" ") if a and not a.startswith("-")]
+        path = self.path(args[0] if args else ".")
+        names = os.listdir(path)
+        conn = self.accept()
+        if conn is None:
+            return
+        self.reply("150 Here comes the listing")
+
+        def send(conn):
+            out = []
+            for name in [".", ".."] + names:
+                try:
+                    st = os.lstat(os.path.join(path, name))
+                except OSError:
+                    continue
+                out.append(fmt(name, st))
+                if len(out) >= 1024:
+                    conn.sendall("".join(out).encode("utf-8", "surrogateescape"))
+                    out = []
+            conn.sendall("".join(out).encode("utf-8", "surrogateescape"))
+
+        self.start(send, conn)
+
+    def do_LIST(self, arg):
+        self.listing(arg, lambda name, st: list_line(name, st) + "\r\n")
+
+    def do_MLSD(self, arg):
+        def fmt(name, st):
+            facts = mlst_facts(name, st)
+            if name in (".", ".."):
+                facts = facts.replace("type=dir", "type=cdir" if name == "." else "type=pdir")
+            return "%s %s\r\n" % (facts, name)
+        self.listing(arg, fmt)
+
+    # metadata
+
+    def do_MLST(self, arg):
+        path = self.path(arg)
+        st = os.lstat(path)
+        self.reply("250-Listing %s\r\n %s %s\r\n250 End" % (arg, mlst_facts(path, st), arg))
+
+    def do_SIZE(self, arg):
+        st = os.stat(self.path(arg))
+        if stat.S_ISDIR(st.st_mode):
+            self.reply("550 Not a regular file")
+        else:
+            self.reply("213 %d" % st.st_size)
+
+    def do_MDTM(self, arg):
+        st = os.stat(self.path(arg))
+        self.reply("213 " + time.strftime("%Y%m%d%H%M%S", time.gmtime(st.st_mtime)))
+
+    def do_DELE(self, arg):
+        os.unlink(self.path(arg))
+        self.reply("250 Deleted")
+
+    def do_MKD(self, arg):
+        os.mkdir(self.path(arg))
+        self.reply('257 "%s" created' % arg)
+
+    def do_RMD(self, arg):
+        os.rmdir(self.path(arg))
+        self.reply("250 Removed")
+
+    def do_RNFR(self, arg):
+        os.lstat(self.path(arg))
+        self.rnfr = self.path(arg)
+        self.reply("350 Ready for RNTO")
+
+    def do_RNTO(self, arg):
+        if self.rnfr is None:
+            self.reply("503 RNFR first")
+            return
+        os.replace(self.rnfr, self.path(arg))
+        self.rnfr = None
+        self.reply("250 Renamed")
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--root", required=True, help="directory served")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=2121)
+    parser.add_argument("--latency", type=float, default=0,
+                        help="seconds added before each reply, to emulate a WAN")
+    parser.add_argument("--no-feat", action="store_true",
+                        help="refuse FEAT and EPSV like an old server, forcing LIST and PASV")
+    args = parser.parse_args()
+
+    server = Server((args.host, args.port), Session)
+    server.root = os.path.abspath(args.root)
+    server.latency = args.latency
+    server.no_feat = args.no_feat
+    print("serving %s on %s:%d" % (server.root, args.host, server.server_address[1]), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
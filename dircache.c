@@ -0,0 +1,207 @@
+#include "dircache.h"
+#include "ftp.h"
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/jiffies.h>
+#include <linux/dcache.h>
+#include <linux/hash.h>
+
+char* ftp_names_add(struct ftp_names **names, const char *name, int len) {
+    struct ftp_names *chunk = *names;
+    char *ret;
+    if (chunk == NULL || chunk->size - chunk->used < len + 1) {
+        unsigned int size = max_t(unsigned int, FTP_NAMES_CHUNK - sizeof(struct ftp_names), len + 1);
+        chunk = (struct ftp_names*)kmalloc(sizeof(struct ftp_names) + size, GFP_KERNEL);
+        if (chunk == NULL)
+            return NULL;
+        chunk->used = 0;
+        chunk->size = size;
+        chunk->next = *names;
+        *names = chunk;
+    }
+    ret = chunk->buf + chunk->used;
+    memcpy(ret, name, len);
+    ret[len] = 0;
+    chunk->used += len + 1;
+    return ret;
+}
+
+void ftp_names_free(struct ftp_names *names) {
+    struct ftp_names *next;
+    for (; names != NULL; names = next) {
+        next = names->next;
+        kfree(names);
+    }
+}
+
+/* Bucket of a name of <len> bytes in the index of <dir> */
+static inline unsigned int ftp_dir_bucket(struct ftp_dir_info *dir, const char *name, unsigned int len) {
+    return hash_32(full_name_hash((const unsigned char*)name, len), dir->bits);
+}
+
+/* Index the names of the files of <dir>, with at least as many buckets as
+ * files. Return 0 or -ENOMEM. */
+static int ftp_dir_index(struct ftp_dir_info *dir) {
+    unsigned int *next, bucket;
+    unsigned long i;
+    dir->bits = 4;
+    while ((1UL << dir->bits) < dir->len)
+        dir->bits++;
+    dir->index = (unsigned int*)kzalloc(((1 << dir->bits) + dir->len) * sizeof(unsigned int), GFP_KERNEL);
+    if (dir->index == NULL)
+        return -ENOMEM;
+    next = dir->index + (1 << dir->bits);
+    for (i = 0; i < dir->len; i++) {
+        bucket = ftp_dir_bucket(dir, dir->files[i].name, strlen(dir->files[i].name));
+        next[i] = dir->index[bucket];
+        dir->index[bucket] = i + 1;
+    }
+    return 0;
+}
+
+struct ftp_file_info* ftp_dir_find(struct ftp_dir_info *dir, const char *name, unsigned int len) {
+    unsigned int *next = dir->index + (1 << dir->bits), i;
+    for (i = dir->index[ftp_dir_bucket(dir, name, len)]; i != 0; i = next[i - 1])
+        if (strncmp(dir->files[i - 1].name, name, len) == 0 && dir->files[i - 1].name[len] == 0)
+            return &dir->files[i - 1];
+    return NULL;
+}
+
+struct ftp_dir_info* ftp_dir_alloc(const char *path, unsigned long len, struct ftp_file_info *files, struct ftp_names *names) {
+    struct ftp_dir_info *dir = (struct ftp_dir_info*)kmalloc(sizeof(struct ftp_dir_info), GFP_KERNEL);
+    if (dir == NULL)
+        return NULL;
+    dir->path = (char*)kmalloc(strlen(path) + 1, GFP_KERNEL);
+    if (dir->path == NULL) {
+        kfree(dir);
+        return NULL;
+    }
+    strcpy(dir->path, path);
+    dir->len = len;
+    dir->files = files;
+    if (ftp_dir_index(dir) < 0) {
+        kfree(dir->path);
+        kfree(dir);
+        return NULL;
+    }
+    dir->names = names;
+    dir->expire = 0;
+    kref_init(&dir->ref);
+    INIT_HLIST_NODE(&dir->node);
+    INIT_LIST_HEAD(&dir->lru);
+    return dir;
+}
+
+static void ftp_dir_release(struct kref *ref) {
+    struct ftp_dir_info *dir = container_of(ref, struct ftp_dir_info, ref);
+    kfree(dir->files);
+    kfree(dir->index);
+    ftp_names_free(dir->names);
+    kfree(dir->path);
+    kfree(dir);
+}
+
+void ftp_dir_put(struct ftp_dir_info *dir) {
+    kref_put(&dir->ref, ftp_dir_release);
+}
+
+void dir_cache_init(struct ftp_dir_cache *cache, unsigned long ttl) {
+    int i;
+    spin_lock_init(&cache->lock);
+    for (i = 0; i < (1 << DIR_CACHE_BITS); i++)
+        INIT_HLIST_HEAD(&cache->table[i]);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->count = 0;
+    cache->ttl = ttl;
+    cache->gen = 0;
+}
+
+/* Remove a listing from the cache, with the lock held. */
+static void dir_cache_remove(struct ftp_dir_cache *cache, struct ftp_dir_info *dir) {
+    hlist_del_init(&dir->node);
+    list_del_init(&dir->lru);
+    cache->count--;
+    ftp_dir_put(dir);
+}
+
+/* Find the listing of the first <len> characters of <path>, with the lock
+ * held. */
+static struct ftp_dir_info* dir_cache_find(struct ftp_dir_cache *cache, const char *path, unsigned int len) {
+    struct ftp_dir_info *dir;
+    unsigned int hash = full_name_hash((const unsigned char*)path, len) & ((1 << DIR_CACHE_BITS) - 1);
+    hlist_for_each_entry(dir, &cache->table[hash], node)
+        if (strncmp(dir->path, path, len) == 0 && dir->path[len] == 0)
+            return dir;
+    return NULL;
+}
+
+void dir_cache_clear(struct ftp_dir_cache *cache) {
+    struct ftp_dir_info *dir, *tmp;
+    spin_lock(&cache->lock);
+    cache->gen++;
+    list_for_each_entry_safe(dir, tmp, &cache->lru, lru)
+        dir_cache_remove(cache, dir);
+    spin_unlock(&cache->lock);
+}
+
+struct ftp_dir_info* dir_cache_get(struct ftp_dir_cache *cache, const char *path) {
+    struct ftp_dir_info *dir;
+    spin_lock(&cache->lock);
+    dir = dir_cache_find(cache, path, strlen(path));
+    if (dir != NULL) {
+        if (time_before(jiffies, dir->expire)) {
+            kref_get(&dir->ref);
+            list_move(&dir->lru, &cache->lru);
+        } else {
+            dir_cache_remove(cache, dir);
+            dir = NULL;
+        }
+    }
+    spin_unlock(&cache->lock);
+    return dir;
+}
+
+void dir_cache_add(struct ftp_dir_cache *cache, struct ftp_dir_info *dir, unsigned long gen) {
+    struct ftp_dir_info *old;
+    unsigned int len = strlen(dir->path);
+    if (cache->ttl == 0)
+        return;
+    spin_lock(&cache->lock);
+    /* the directory may have changed while it was listed */
+    if (cache->gen != gen)
+        goto out;
+    if ((old = dir_cache_find(cache, dir->path, len)) != NULL)
+        dir_cache_remove(cache, old);
+    /* evict the least recently used listing */
+    if (cache->count >= DIR_CACHE_MAX)
+        dir_cache_remove(cache, list_last_entry(&cache->lru, struct ftp_dir_info, lru));
+    dir->expire = jiffies + cache->ttl;
+    kref_get(&dir->ref);
+    hlist_add_head(&dir->node, &cache->table[full_name_hash((const unsigned char*)dir->path, len) & ((1 << DIR_CACHE_BITS) - 1)]);
+    list_add(&dir->lru, &cache->lru);
+    cache->count++;
+out:
+    spin_unlock(&cache->lock);
+}
+
+/* Drop the listing of the first <len> characters of <path>. */
+static void dir_cache_invalidate_len(struct ftp_dir_cache *cache, const char *path, unsigned int len) {
+    struct ftp_dir_info *dir;
+    spin_lock(&cache->lock);
+    cache->gen++;
+    if ((dir = dir_cache_find(cache, path, len)) != NULL)
+        dir_cache_remove(cache, dir);
+    spin_unlock(&cache->lock);
+}
+
+void dir_cache_invalidate(struct ftp_dir_cache *cache, const char *path) {
+    dir_cache_invalidate_len(cache, path, strlen(path));
+}
+
+void dir_cache_invalidate_parent(struct ftp_dir_cache *cache, const char *path) {
+    const char *slash = strrchr(path, '/');
+    /* paths are absolute, the parent of "/a" is "/" */
+    if (slash == NULL)
+        return;
+    dir_cache_invalidate_len(cache, path, slash == path ? 1 : slash - path);
+}
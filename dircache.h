@@ -0,0 +1,95 @@
+/*
+ * Cache of directory listings on FTP side, keyed by directory path.
+ * Listings expire after a TTL and are invalidated when a directory is
+ * changed through this mount.
+ */
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+/* Number of hash buckets (in bits) and maximum number of cached listings */
+#define DIR_CACHE_BITS 6
+#define DIR_CACHE_MAX 256
+/* Maximum number of files of a listing cached when it is streamed to readdir,
+ * larger listings are only streamed */
+#define DIR_CACHE_FILES 8192
+
+struct ftp_file_info;
+
+/* Names of the files of a listing, packed in chunks instead of allocated one
+ * by one, the newest chunk first */
+struct ftp_names {
+    struct ftp_names *next;
+    unsigned int used, size;
+    char buf[];
+};
+
+/* Bytes allocated for a chunk of names, longer names get a chunk of their own */
+#define FTP_NAMES_CHUNK 16384
+
+/* A directory listing returned by ftp_read_dir(), shared between its readers
+ * and the cache, and freed by ftp_dir_put(). */
+struct ftp_dir_info {
+    /* Number of files and the array of them */
+    unsigned long len;
+    struct ftp_file_info *files;
+    /* Names of the files */
+    struct ftp_names *names;
+    /* Hash index of the names, see ftp_dir_find(): 1 << bits buckets holding
+     * the index plus one of their first file or 0, then for each file the
+     * index plus one of the next file of its bucket or 0 */
+    unsigned int bits;
+    unsigned int *index;
+    struct kref ref;
+    /* Path of the directory and expiring time (in jiffies) */
+    char *path;
+    unsigned long expire;
+    /* Links in the hash table and in the LRU list of the cache */
+    struct hlist_node node;
+    struct list_head lru;
+};
+
+struct ftp_dir_cache {
+    /* Lock for all fields below */
+    spinlock_t lock;
+    struct hlist_head table[1 << DIR_CACHE_BITS];
+    /* Cached listings, the most recently used first */
+    struct list_head lru;
+    unsigned long count;
+    /* Time to live (in jiffies) of listings, 0 for no caching */
+    unsigned long ttl;
+    /* Counter increased on each invalidation */
+    unsigned long gen;
+};
+
+/* Copy the name <name> of <len> bytes into the chunks <names>, adding a chunk
+ * if needed. Return the copy terminated by '\0', or NULL if out of memory. */
+char* ftp_names_add(struct ftp_names **names, const char *name, int len);
+/* Free all chunks of names. */
+void ftp_names_free(struct ftp_names *names);
+
+/* Allocate a listing of <len> files of directory <path> with one reference.
+ * The listing takes over the array <files> and the chunks <names> of their
+ * names. */
+struct ftp_dir_info* ftp_dir_alloc(const char *path, unsigned long len, struct ftp_file_info *files, struct ftp_names *names);
+/* Find the file named <name> of <len> bytes in <dir> in constant time.
+ * Return the file or NULL if <dir> has none of that name. */
+struct ftp_file_info* ftp_dir_find(struct ftp_dir_info *dir, const char *name, unsigned int len);
+/* Drop a reference to a listing. */
+void ftp_dir_put(struct ftp_dir_info *dir);
+
+void dir_cache_init(struct ftp_dir_cache *cache, unsigned long ttl);
+/* Drop all listings. */
+void dir_cache_clear(struct ftp_dir_cache *cache);
+/* Return the unexpired listing of <path> with a new reference, or NULL. */
+struct ftp_dir_info* dir_cache_get(struct ftp_dir_cache *cache, const char *path);
+/* Insert <dir>, unless the cache was invalidated since <gen> was read. */
+void dir_cache_add(struct ftp_dir_cache *cache, struct ftp_dir_info *dir, unsigned long gen);
+/* Drop the listing of <path>. */
+void dir_cache_invalidate(struct ftp_dir_cache *cache, const char *path);
+/* Drop the listing of the directory containing <path>. */
+void dir_cache_invalidate_parent(struct ftp_dir_cache *cache, const char *path);
+
+#endif
@@ -2,206 +2,770 @@
 #include "file.h"
 #include "ftp.h"
 #include "inode.h"
+#include "trace.h"
 
 #include <linux/ctype.h>
 #include <linux/fs.h>
 #include <linux/dcache.h>
+#include <linux/pagevec.h>
+#include <linux/vmalloc.h>
 
 const struct file_operations ftp_fs_file_operations = {
-    .read = ftp_fs_read,
-    .write = ftp_fs_write,
+    .llseek = generic_file_llseek,
+    .read = new_sync_read,
+    .read_iter = ftp_fs_read_iter,
+    .write = new_sync_write,
+    .write_iter = generic_file_write_iter,
+    .mmap = generic_file_mmap,
+    .open = ftp_fs_open,
+    .flush = ftp_fs_flush,
     .release = ftp_fs_close,
+    .fsync = ftp_fs_fsync,
+    .splice_read = ftp_fs_splice_read,
+    .splice_write = iter_file_splice_write,
 };
 
 const struct file_operations ftp_fs_dir_operations = {
-    .open = ftp_fs_dir_open,
-    .release = dcache_dir_close,
+    .llseek = generic_file_llseek,
     .read = generic_read_dir,
     .iterate = ftp_fs_iterate,
 };
 
-ssize_t ftp_fs_read(struct file* f, char __user *buf, size_t count, loff_t *offset) {
-    ssize_t content_size = -1;
-    struct dentry *dentry = f->f_dentry;
+const struct address_space_operations ftp_fs_aops = {
+    .readpage = ftp_fs_readpage,
+    .readpages = ftp_fs_readpages,
+    .writepages = ftp_fs_writepages,
+    .write_begin = ftp_fs_write_begin,
+    .write_end = simple_write_end,
+    .set_page_dirty = __set_page_dirty_nobuffers,
+    .direct_IO = ftp_fs_direct_IO,
+};
 
-    /* allocate the buffer to store the full path */
-    pr_debug("begin to read\n");
-    char *path_buf = (char*) kmalloc(MAX_PATH_LEN, GFP_KERNEL);
-    if (path_buf == NULL)
-        goto error0;
-    char *full_path = dentry_path_raw(dentry, path_buf, MAX_PATH_LEN);
+/* Read-ahead state of an open regular file, kept in file->private_data. */
+struct ftp_fs_readahead {
+    /* Offset at which a sequential read would continue */
+    loff_t next;
+    /* Number of bytes prefetched after each read */
+    unsigned long window;
+};
 
-    /* read the file */
-    pr_debug("file name is: %s\n", full_path);
-    pr_debug("try to connect ftp server\n");
-    content_size = ftp_read_file((struct ftp_info*) f->f_inode->i_sb->s_fs_info, full_path, *offset, buf, count);
+/* Data needed by ftp_fs_fill_page() for filling pages of one file. */
+struct ftp_fs_fill_data {
+    struct ftp_info *info;
+    struct ftp_fs_path *path;
+    loff_t size;
+    /* Prefetch window passed to ftp_read_file() */
+    unsigned long ra;
+};
 
-    pr_debug("recieved content size: %lu\n", content_size);
-    if (content_size != -1) *offset += content_size;
+/* Return the prefetch window to use for an open file, which is NULL if the
+ * page is read for writeback. */
+static unsigned long ftp_fs_ra_window(struct file *f) {
+    struct ftp_fs_readahead *ra = f ? f->private_data : NULL;
+    return ra ? ra->window : 0;
+}
 
-    kfree(path_buf);
-error0:
-    return content_size;
+/* Get the full path of <inode>, found through any of its dentries. Release it
+ * with ftp_fs_path_put(). */
+static struct ftp_fs_path* ftp_fs_inode_path(struct inode *inode) {
+    struct dentry *dentry = d_find_alias(inode);
+    struct ftp_fs_path *path;
+    if (dentry == NULL)
+        return ERR_PTR(-ENOENT);
+    path = ftp_fs_path_get(dentry);
+    dput(dentry);
+    return path;
 }
 
-ssize_t ftp_fs_write(struct file* f, const char __user *buf, size_t count, loff_t* offset) {
-    ssize_t content_size = -1;
-    struct dentry *dentry = f->f_dentry;
+int ftp_fs_open(struct inode *inode, struct file *f) {
+    struct ftp_info *info = (struct ftp_info*) inode->i_sb->s_fs_info;
+    struct ftp_fs_readahead *ra = (struct ftp_fs_readahead*) kmalloc(sizeof(struct ftp_fs_readahead), GFP_KERNEL);
+    struct ftp_options opts;
+    if (ra == NULL)
+        return -ENOMEM;
+    ftp_info_options(info, &opts);
+    ra->next = 0;
+    ra->window = opts.ra_min;
+    f->private_data = ra;
+    return 0;
+}
 
-    /* allocate the buffer to store the full path */
-    pr_debug("begin to write\n");
-    char *path_buf = (char*) kmalloc(MAX_PATH_LEN, GFP_KERNEL);
-    if (path_buf == NULL)
-        goto error0;
-    char *full_path = dentry_path_raw(dentry, path_buf, MAX_PATH_LEN);
+/* Adapt the read-ahead window of <f> to a read at <pos>: a read continuing
+ * the previous one doubles the window, any other access shrinks it back. */
+static void ftp_fs_ra_update(struct file *f, loff_t pos) {
+    struct ftp_fs_readahead *ra = f->private_data;
+    struct ftp_info *info = (struct ftp_info*) f->f_inode->i_sb->s_fs_info;
+    struct ftp_options opts;
+
+    /* the bounds are taken together, a remount may change them */
+    ftp_info_options(info, &opts);
+    if (pos == ra->next)
+        ra->window = min_t(unsigned long, ra->window * 2, opts.ra_max);
+    else
+        ra->window = opts.ra_min;
+    /* let the kernel read ahead as far as the FTP side prefetches */
+    f->f_ra.ra_pages = ra->window >> PAGE_CACHE_SHIFT;
+}
 
-    /* write the file */
-    pr_debug("file name is: %s\n", full_path);
-    pr_debug("try to connect ftp server\n");
-    content_size = ftp_write_file((struct ftp_info*) f->f_inode->i_sb->s_fs_info, full_path, *offset, buf, count);
+ssize_t ftp_fs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct file *f = iocb->ki_filp;
+    struct ftp_fs_readahead *ra = f->private_data;
+    ssize_t ret;
+
+    trace_ftpfs_vfs_enter("read_iter", f->f_inode->i_ino, iocb->ki_pos, iov_iter_count(to));
+    ftp_fs_ra_update(f, iocb->ki_pos);
+    ret = generic_file_read_iter(iocb, to);
+    ra->next = iocb->ki_pos;
+    trace_ftpfs_vfs_exit("read_iter", f->f_inode->i_ino, ret);
+    return ret;
+}
 
-    pr_debug("recieved content size: %lu\n", content_size);
-    if (content_size != -1) *offset += content_size;
+ssize_t ftp_fs_splice_read(struct file *f, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+    struct ftp_fs_readahead *ra = f->private_data;
+    ssize_t ret;
+
+    /* the page cache pages themselves are moved into the pipe */
+    trace_ftpfs_vfs_enter("splice_read", f->f_inode->i_ino, *ppos, len);
+    ftp_fs_ra_update(f, *ppos);
+    ret = generic_file_splice_read(f, ppos, pipe, len, flags);
+    ra->next = *ppos;
+    trace_ftpfs_vfs_exit("splice_read", f->f_inode->i_ino, ret);
+    return ret;
+}
 
-    kfree(path_buf);
-error0:
-    return content_size;
+/* Fill a locked page with the remote content at its offset, mark it up to
+ * date and unlock it. Used as the filler of read_cache_pages(). */
+static int ftp_fs_fill_page(void *data, struct page *page) {
+    struct ftp_fs_fill_data *fill = data;
+    loff_t offset = page_offset(page);
+    unsigned long want = 0, len = 0;
+    int ret = 0;
+    char *buf = kmap(page);
+
+    /* never read past the size known from the listing */
+    if (offset < fill->size)
+        want = min_t(loff_t, PAGE_CACHE_SIZE, fill->size - offset);
+    while (len < want) {
+        ret = ftp_read_file(fill->info, fill->path->name, offset + len, buf + len, want - len, fill->ra);
+        if (ret <= 0)
+            break;
+        len += ret;
+    }
+    if (ret >= 0) {
+        memset(buf + len, 0, PAGE_CACHE_SIZE - len);
+        flush_dcache_page(page);
+        SetPageUptodate(page);
+        ret = 0;
+    } else {
+        pr_debug("fill page %lu failed: %d\n", page->index, ret);
+        SetPageError(page);
+    }
+    kunmap(page);
+    unlock_page(page);
+    return ret;
 }
 
-struct fake_dentry_list {
-    struct dentry* dentry;
-    struct fake_dentry_list* next;
+/* A run of pages with consecutive indexes read in background, see
+ * ftp_fs_readpages(). */
+struct ftp_fs_read_run {
+    struct ftp_request req;
+    /* The <n> pages, mapped at req.buf */
+    struct page **pages;
+    unsigned n;
+    /* Path of the file, referenced until the run is done */
+    struct ftp_fs_path *path;
 };
 
-inline unsigned char _dt_type(struct inode* inode) {
-    return (inode->i_mode >> 12) & 15;
+/* Completion of a run: mark the pages up to date if the read succeeded, and
+ * unlock them. */
+static void ftp_fs_read_done(struct ftp_request *req) {
+    struct ftp_fs_read_run *run = container_of(req, struct ftp_fs_read_run, req);
+    unsigned i;
+
+    trace_ftpfs_vfs_exit("read_run", run->pages[0]->mapping->host->i_ino, req->ret);
+    if (req->ret >= 0)
+        memset(req->buf + req->ret, 0, (run->n << PAGE_CACHE_SHIFT) - req->ret);
+    vunmap(req->buf);
+    for (i = 0; i < run->n; i++) {
+        if (req->ret >= 0) {
+            flush_dcache_page(run->pages[i]);
+            SetPageUptodate(run->pages[i]);
+        } else
+            SetPageError(run->pages[i]);
+        unlock_page(run->pages[i]);
+    }
+    ftp_fs_path_put(run->path);
+    kfree(run->pages);
+    kfree(run);
 }
 
-inline int simple_positive(struct dentry *dentry) {
-    return dentry->d_inode && !d_unhashed(dentry);
+/* Start reading a run of <n> locked pages with consecutive indexes, which are
+ * unlocked when the read is done. Long runs of large files are fetched in
+ * stripes over several sessions. */
+static void ftp_fs_read_run(struct ftp_fs_fill_data *fill, struct page **pages, unsigned n) {
+    struct ftp_fs_read_run *run;
+    struct ftp_options opts;
+    loff_t offset = page_offset(pages[0]);
+    unsigned long want = 0;
+    unsigned i;
+    int stripes = 1;
+    char *buf = NULL;
+
+    run = (struct ftp_fs_read_run*) kmalloc(sizeof(struct ftp_fs_read_run), GFP_KERNEL);
+    if (run == NULL)
+        goto sync;
+    run->pages = (struct page**) kmalloc(n * sizeof(struct page*), GFP_KERNEL);
+    run->path = fill->path;
+    kref_get(&run->path->ref);
+    buf = vmap(pages, n, VM_MAP, PAGE_KERNEL);
+    if (run->pages == NULL || buf == NULL)
+        goto error;
+    memcpy(run->pages, pages, n * sizeof(struct page*));
+    run->n = n;
+
+    if (offset < fill->size)
+        want = min_t(loff_t, (loff_t) n << PAGE_CACHE_SHIFT, fill->size - offset);
+    if (fill->size >= STRIPE_THRESHOLD && (n << PAGE_CACHE_SHIFT) >= 2 * STRIPE_MIN) {
+        ftp_info_options(fill->info, &opts);
+        stripes = opts.stripes;
+    }
+    ftp_request_read(&run->req, run->path->name, offset, buf, want, stripes, fill->ra);
+    trace_ftpfs_vfs_enter("read_run", pages[0]->mapping->host->i_ino, offset, want);
+    ftp_submit(fill->info, &run->req, ftp_fs_read_done);
+    return;
+
+error:
+    if (buf != NULL)
+        vunmap(buf);
+    ftp_fs_path_put(run->path);
+    kfree(run->pages);
+    kfree(run);
+sync:
+    for (i = 0; i < n; i++)
+        ftp_fs_fill_page(fill, pages[i]);
 }
 
-int ftp_fs_iterate(struct file* f, struct dir_context* ctx) {
-    pr_debug("begin to iterate\n");
-    if (!dir_emit_dots(f, ctx)) {
-        pr_debug("emit dot failed\n");
-        return 0;
+int ftp_fs_readpage(struct file* f, struct page *page) {
+    struct ftp_fs_fill_data fill;
+    /* the page may leave the mapping once unlocked */
+    unsigned long ino = page->mapping->host->i_ino;
+    int ret;
+
+    trace_ftpfs_vfs_enter("readpage", ino, page_offset(page), PAGE_CACHE_SIZE);
+    fill.path = ftp_fs_inode_path(page->mapping->host);
+    if (IS_ERR(fill.path)) {
+        ret = PTR_ERR(fill.path);
+        goto error0;
     }
+    fill.info = (struct ftp_info*) page->mapping->host->i_sb->s_fs_info;
+    fill.size = i_size_read(page->mapping->host);
+    fill.ra = ftp_fs_ra_window(f);
 
-    int result = -1;
-    struct dentry *dentry = f->f_dentry;
+    ret = ftp_fs_fill_page(&fill, page);
+    ftp_fs_path_put(fill.path);
+    trace_ftpfs_vfs_exit("readpage", ino, ret);
+    return ret;
 
-    /* get the full path for the file */
-    char *path_buf = (char*) kmalloc(MAX_PATH_LEN, GFP_KERNEL);
-    if (path_buf == NULL)
+error0:
+    trace_ftpfs_vfs_exit("readpage", ino, ret);
+    unlock_page(page);
+    return ret;
+}
+
+int ftp_fs_readpages(struct file* f, struct address_space *mapping, struct list_head *pages, unsigned nr_pages) {
+    struct ftp_fs_fill_data fill;
+    struct page **run, *page;
+    unsigned n;
+    int ret;
+
+    /* the pages are inserted in the page cache in runs of consecutive
+     * indexes, and each run is read in background while the caller goes on,
+     * whose pages stay locked until then */
+    trace_ftpfs_vfs_enter("readpages", mapping->host->i_ino,
+            (loff_t) list_entry(pages->prev, struct page, lru)->index << PAGE_CACHE_SHIFT,
+            (size_t) nr_pages << PAGE_CACHE_SHIFT);
+    fill.path = ftp_fs_inode_path(mapping->host);
+    if (IS_ERR(fill.path)) {
+        ret = PTR_ERR(fill.path);
         goto error0;
-    char *full_path = dentry_path_raw(dentry, path_buf, MAX_PATH_LEN);
-
-    pr_debug("file name is: %s\n", full_path);
-
-    unsigned long file_num;
-    struct ftp_file_info *files;
-    pr_debug("try to connect ftp server\n");
-    if ((result = ftp_read_dir((struct ftp_info*) f->f_inode->i_sb->s_fs_info, full_path, &file_num, &files)) == 0) {
-        pr_debug("got %lu files under the dir\n", file_num);
-
-        struct fake_dentry_list *fake_dentry_head = NULL, *fake_dentry_last = NULL;
-        /* allocate fake inodes */
-        int i;
-        for (i = 2 /* omit the . and .. */ ; i < file_num; i++) {
-            pr_debug("the fake dentry name is %s\n", files[i].name);
-
-            struct dentry *fake_dentry;
-            struct qstr q;
-            q.name = files[i].name;
-            q.len = strlen(files[i].name);
-            q.hash = full_name_hash(q.name, q.len);
-            
-            /* if the fake dentry exists, just skip it */
-            if ((fake_dentry = d_lookup(dentry, &q)) != NULL) {
-                dput(fake_dentry);
-                continue;
-            }
-            
-            /* allocate a fake dentry corresponding a remote file */
-            fake_dentry= d_alloc_name(dentry, files[i].name);
-
-            d_set_d_op(dentry, &simple_dentry_operations);
-            /* add the fake dentry into hash table */
-            d_add(fake_dentry, NULL);
-
-            if (fake_dentry == NULL) {
-                pr_debug("can not allocate a fake dentry for ls\n");
-                result = -1;
-                goto out;
+    }
+    fill.info = (struct ftp_info*) mapping->host->i_sb->s_fs_info;
+    fill.size = i_size_read(mapping->host);
+    fill.ra = ftp_fs_ra_window(f);
+
+    run = (struct page**) kmalloc(nr_pages * sizeof(struct page*), GFP_KERNEL);
+    if (run == NULL) {
+        ret = read_cache_pages(mapping, pages, ftp_fs_fill_page, &fill);
+        goto error1;
+    }
+    while (!list_empty(pages)) {
+        /* the page of lowest index is at the tail of the list */
+        for (n = 0; !list_empty(pages); ) {
+            page = list_entry(pages->prev, struct page, lru);
+            if (n > 0 && page->index != run[n - 1]->index + 1)
+                break;
+            list_del(&page->lru);
+            if (add_to_page_cache_lru(page, mapping, page->index, GFP_KERNEL)) {
+                /* already cached, which ends the run */
+                page_cache_release(page);
+                break;
             }
+            /* the page cache holds a reference to the locked page */
+            page_cache_release(page);
+            run[n++] = page;
+        }
+        if (n > 0)
+            ftp_fs_read_run(&fill, run, n);
+    }
+    kfree(run);
+    ret = 0;
 
-            /* allocate a fake inode corresponding a remote file */
-            if (ftp_fs_mknod(dentry->d_inode, fake_dentry, files[i].mode, 0) != 0) {
-                pr_debug("can not allocate a inode for fake dentry\n");
-                result = -1;
-                goto out;
-            }
+error1:
+    ftp_fs_path_put(fill.path);
+error0:
+    /* pages not consumed are released by the caller */
+    trace_ftpfs_vfs_exit("readpages", mapping->host->i_ino, ret);
+    return ret;
+}
+
+int ftp_fs_write_begin(struct file *f, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata) {
+    unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+    struct page *page;
+    int ret;
+
+    page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT, flags);
+    if (page == NULL)
+        return -ENOMEM;
+    *pagep = page;
+    if (PageUptodate(page) || len == PAGE_CACHE_SIZE)
+        return 0;
+    /* nothing to keep beyond the end of file */
+    if (page_offset(page) >= i_size_read(mapping->host)) {
+        zero_user_segments(page, 0, from, from + len, PAGE_CACHE_SIZE);
+        return 0;
+    }
+    /* a partial write needs the rest of the page from the server */
+    ret = ftp_fs_readpage(f, page);
+    lock_page(page);
+    if (ret == 0 && !PageUptodate(page))
+        ret = -EIO;
+    if (ret < 0) {
+        unlock_page(page);
+        page_cache_release(page);
+    }
+    return ret;
+}
 
-            /* fill the information to inode (missing time format converting) */
-            /* fake_dentry->d_inode->i_mtime = files[i].mtime; */
-            fake_dentry->d_inode->i_size = files[i].size;
+/* Unlock the <n> pages of <mapping> from <index>, which were locked by
+ * ftp_fs_lock_pages(). */
+static void ftp_fs_unlock_pages(struct address_space *mapping, pgoff_t index, long n) {
+    struct page *page;
+    for (; n > 0; n--, index++) {
+        page = find_get_page(mapping, index);
+        unlock_page(page);
+        page_cache_release(page);
+    }
+}
 
-            /* update the list */
-            struct fake_dentry_list* tmp = (struct fake_dentry_list*) kmalloc(sizeof(struct fake_dentry_list), GFP_KERNEL);
-            if (tmp == NULL) {
-                pr_debug("allocate fake_dentry_list node failed\n");
-                result = -1;
-                goto out;
+/* Lock the pages from <index> to <last> of <mapping> in ascending order, the
+ * ones not cached being read from the server first, or zeroed from offset
+ * <hole> on, where the server has nothing. A locked page stays in the
+ * mapping, so no reference is kept. Return the number of pages locked, less
+ * if the file was truncated meanwhile, or negative value for error with none
+ * locked. */
+static long ftp_fs_lock_pages(struct address_space *mapping, pgoff_t index, pgoff_t last, loff_t hole) {
+    struct page *page;
+    long n;
+    for (n = 0; index + n <= last; n++) {
+        if ((loff_t) (index + n) << PAGE_CACHE_SHIFT >= hole) {
+            if ((page = find_or_create_page(mapping, index + n, mapping_gfp_mask(mapping))) == NULL) {
+                ftp_fs_unlock_pages(mapping, index, n);
+                return -ENOMEM;
             }
-            tmp->next = NULL;
-            tmp->dentry = fake_dentry;
-            if (fake_dentry_last == NULL) {
-                fake_dentry_last = fake_dentry_head = tmp;
-            } else {
-                fake_dentry_last->next = tmp;
-                fake_dentry_last = tmp;
+            if (!PageUptodate(page)) {
+                zero_user_segment(page, 0, PAGE_CACHE_SIZE);
+                SetPageUptodate(page);
             }
+            wait_on_page_writeback(page);
+            page_cache_release(page);
+            continue;
+        }
+        page = read_mapping_page(mapping, index + n, NULL);
+        if (IS_ERR(page)) {
+            ftp_fs_unlock_pages(mapping, index, n);
+            return PTR_ERR(page);
+        }
+        lock_page(page);
+        wait_on_page_writeback(page);
+        if (page->mapping != mapping) {
+            /* truncated, the file ends here */
+            unlock_page(page);
+            page_cache_release(page);
+            break;
+        }
+        if (!PageUptodate(page)) {
+            unlock_page(page);
+            page_cache_release(page);
+            ftp_fs_unlock_pages(mapping, index, n);
+            return -EIO;
         }
+        page_cache_release(page);
+    }
+    return n;
+}
 
-        dcache_readdir(f, ctx);
-out:
-        /* free the fake dentry */
-        pr_debug("fake dentry lists: \n");
-        struct fake_dentry_list *ptr;
-        for (ptr = fake_dentry_head; ptr;) {
-            pr_debug("    %s\n", ptr->dentry->d_name.name);
-            simple_unlink(dentry->d_inode, ptr->dentry);
-            struct fake_dentry_list *next = ptr->next;
-            kfree(ptr);
-            ptr = next;
+/* Send the bytes from <pos> to <size> of the locked pages of <mapping> to
+ * <file> in one transfer, with APPE if <append>, otherwise with STOR from
+ * <pos>. The dirty pages are put in writeback. Return 0 once the server has
+ * confirmed the transfer, or negative value for error. */
+static int ftp_fs_upload_window(struct ftp_info *info, const char *file, struct address_space *mapping, loff_t pos, loff_t size, int append) {
+    struct ftp_upload up;
+    struct page *page;
+    int ret, len;
+    if ((ret = ftp_upload_begin(info, file, pos, append, &up)) < 0)
+        return ret;
+    for (; pos < size && ret == 0; pos += len) {
+        page = find_get_page(mapping, pos >> PAGE_CACHE_SHIFT);
+        len = min_t(loff_t, PAGE_CACHE_SIZE - (pos & (PAGE_CACHE_SIZE - 1)), size - pos);
+        if (clear_page_dirty_for_io(page))
+            set_page_writeback(page);
+        ret = ftp_upload_page(info, &up, file, page, pos & (PAGE_CACHE_SIZE - 1), len);
+        page_cache_release(page);
+    }
+    return ftp_upload_end(info, &up, file, ret);
+}
+
+/* End the writeback of the pages of <mapping> from <index> to <last>, which
+ * are dirtied again if <ret> is an error. The pages are not locked, as a
+ * truncation holds the lock while it waits for the writeback. Return the
+ * number of pages. */
+static long ftp_fs_end_writeback(struct address_space *mapping, struct writeback_control *wbc, pgoff_t index, pgoff_t last, int ret) {
+    struct pagevec pvec;
+    struct page *page;
+    long n = 0;
+    unsigned i;
+    pagevec_init(&pvec, 0);
+    while (index <= last && pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_WRITEBACK,
+                min_t(pgoff_t, last - index, PAGEVEC_SIZE - 1) + 1)) {
+        for (i = 0; i < pagevec_count(&pvec); i++) {
+            page = pvec.pages[i];
+            if (page->index > last)
+                break;
+            if (ret < 0)
+                redirty_page_for_writepage(wbc, page);
+            end_page_writeback(page);
+            n++;
+        }
+        pagevec_release(&pvec);
+    }
+    return n;
+}
+
+/* Store in <temp> the path of the temporary file next to <path> that the file
+ * of inode number <ino> is written to, see ftp_fs_writepages(). It is freed
+ * with __putname(). */
+static int ftp_fs_temp_name(const char *path, unsigned long ino, char **temp) {
+    const char *base = strrchr(path, '/');
+    int dirlen = base != NULL ? base - path + 1 : 0;
+    if ((*temp = __getname()) == NULL)
+        return -ENOMEM;
+    if (snprintf(*temp, PATH_MAX, "%.*s.ftpfs-%lx", dirlen, path, ino) >= PATH_MAX) {
+        __putname(*temp);
+        *temp = NULL;
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+int ftp_fs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
+    struct inode *inode = mapping->host;
+    struct ftp_info *info = (struct ftp_info*) inode->i_sb->s_fs_info;
+    struct ftp_fs_inode *fi = FTP_FS_I(inode);
+    struct ftp_options opts;
+    loff_t size = i_size_read(inode), pos;
+    pgoff_t first = 0, end = (pgoff_t) -1, index, last, window;
+    unsigned long remote;
+    long n;
+    struct page *page;
+    struct ftp_fs_path *path;
+    const char *target;
+    char *temp = NULL;
+    int ret = 0, tmp, append, sent = 0;
+
+    if (wbc->sync_mode == WB_SYNC_NONE) {
+        /* the upload in progress is left alone */
+        if (wbc->nr_to_write <= 0 || !mutex_trylock(&fi->upload))
+            return 0;
+    } else
+        mutex_lock(&fi->upload);
+    if (!wbc->range_cyclic) {
+        first = wbc->range_start >> PAGE_CACHE_SHIFT;
+        end = wbc->range_end >> PAGE_CACHE_SHIFT;
+    }
+    if (size == 0 || find_get_pages_tag(mapping, &first, PAGECACHE_TAG_DIRTY, 1, &page) == 0)
+        goto unlock;
+    first = page->index;
+    page_cache_release(page);
+    last = (size - 1) >> PAGE_CACHE_SHIFT;
+    if (first > end || first > last)
+        goto unlock;
+
+    trace_ftpfs_vfs_enter("writepages", inode->i_ino, (loff_t) first << PAGE_CACHE_SHIFT, size - ((loff_t) first << PAGE_CACHE_SHIFT));
+    path = ftp_fs_inode_path(inode);
+    if (IS_ERR(path)) {
+        ret = PTR_ERR(path);
+        goto out;
+    }
+
+    /* STOR replaces the file from its restarting offset to the end, so the
+     * whole range from the first dirty page to the end of file is sent, clean
+     * pages included. If the server has nothing past the first dirty page,
+     * only the bytes it lacks are appended with APPE. A range longer than a
+     * window is written to a temporary file renamed over the file at the end,
+     * so that the pages not cached are still read from the server meanwhile,
+     * instead of being all held in memory before the STOR. */
+    ftp_info_options(info, &opts);
+    window = max_t(pgoff_t, opts.ra_max >> PAGE_CACHE_SHIFT, 1);
+    pos = (loff_t) first << PAGE_CACHE_SHIFT;
+    target = path->name;
+    if ((tmp = ftp_file_size(info, path->name, &remote)) == -ENOENT) {
+        remote = 0;
+        tmp = 0;
+    }
+    append = tmp == 0 && remote <= pos;
+    if (append)
+        pos = remote;
+    else if (last - first >= window) {
+        if ((ret = ftp_fs_temp_name(path->name, inode->i_ino, &temp)) < 0)
+            goto put;
+        target = temp;
+        pos = 0;
+    }
+    first = index = pos >> PAGE_CACHE_SHIFT;
+
+    /* each window is locked, sent in one transfer and unlocked, the next ones
+     * being appended; the dirty pages stay in writeback until the file is
+     * complete on the server */
+    while (index <= last) {
+        n = ftp_fs_lock_pages(mapping, index, min(last, index + window - 1), tmp == 0 ? remote : LLONG_MAX);
+        if (n < 0) {
+            ret = n;
+            break;
         }
+        /* a truncation waits for the locked pages */
+        size = min_t(loff_t, i_size_read(inode), (loff_t) (index + n) << PAGE_CACHE_SHIFT);
+        if (pos < size) {
+            ret = ftp_fs_upload_window(info, target, mapping, pos, size, append);
+            sent = 1;
+        }
+        ftp_fs_unlock_pages(mapping, index, n);
+        if (ret < 0 || size < (loff_t) (index + n) << PAGE_CACHE_SHIFT)
+            break;
+        index += n;
+        pos = size;
+        append = 1;
+    }
+    if (temp != NULL) {
+        /* RNTO replaces the file, which becomes another file on the server,
+         * so the unique fact of the inode is learned again */
+        if (ret == 0 && sent && (ret = ftp_rename(info, temp, path->name)) == 0)
+            fi->by_path = 1;
+        if (ret < 0 && sent)
+            ftp_remove_file(info, temp);
+        __putname(temp);
+    }
+    wbc->nr_to_write -= ftp_fs_end_writeback(mapping, wbc, first, last, ret);
+    if (ret < 0) {
+        pr_debug("write back failed: %d\n", ret);
+        mapping_set_error(mapping, ret);
+    }
+
+put:
+    ftp_fs_path_put(path);
+out:
+    trace_ftpfs_vfs_exit("writepages", inode->i_ino, ret);
+unlock:
+    mutex_unlock(&fi->upload);
+    return ret;
+}
 
-        ftp_file_info_destroy(file_num, files);
+/* Transfer the bytes of the pinned <page> at <pgoff> of length <len> from or
+ * to <path> at <offset>. Return the number of bytes transferred, less only
+ * at end of file, or negative value for error. */
+static int ftp_fs_direct_page(struct ftp_info *info, const char *path, int rw, loff_t offset, struct page *page, int pgoff, int len, unsigned long ra) {
+    char *buf = kmap(page);
+    int done = 0, ret = 0;
+    while (done < len) {
+        if (rw == WRITE)
+            ret = ftp_write_file(info, path, offset + done, buf + pgoff + done, len - done);
+        else
+            ret = ftp_read_file(info, path, offset + done, buf + pgoff + done, len - done, ra);
+        if (ret <= 0)
+            break;
+        done += ret;
     }
+    kunmap(page);
+    return ret < 0 ? ret : done;
+}
 
-    kfree(path_buf);
-error0:
-    pr_debug("iterate result is %d\n", result);
-    return result;
+#define FTP_FS_DIRECT_PAGES 16
+
+ssize_t ftp_fs_direct_IO(int rw, struct kiocb *iocb, struct iov_iter *iter, loff_t offset) {
+    struct file *f = iocb->ki_filp;
+    struct inode *inode = f->f_mapping->host;
+    struct ftp_info *info = (struct ftp_info*) inode->i_sb->s_fs_info;
+    struct page *pages[FTP_FS_DIRECT_PAGES];
+    ssize_t total = 0, bytes;
+    size_t start;
+    int ret = 0, i, n, len, stop = 0;
+
+    /* STOR drops the data after the end of the transfer, so only writes
+     * reaching the end of file are sent directly, the others fall back to
+     * the page cache */
+    if (rw == WRITE && offset + iov_iter_count(iter) < i_size_read(inode))
+        return 0;
+
+    trace_ftpfs_vfs_enter(rw == WRITE ? "direct_write" : "direct_read", inode->i_ino, offset, iov_iter_count(iter));
+    struct ftp_fs_path *path = ftp_fs_inode_path(inode);
+    if (IS_ERR(path)) {
+        ret = PTR_ERR(path);
+        goto out;
+    }
+
+    /* the buffer of the caller is pinned and the data transfer connection
+     * reads into or sends from it, bypassing the page cache */
+    while (!stop && iov_iter_count(iter) > 0) {
+        bytes = iov_iter_get_pages(iter, pages, iov_iter_count(iter), FTP_FS_DIRECT_PAGES, &start);
+        if (bytes <= 0) {
+            ret = bytes;
+            break;
+        }
+        n = DIV_ROUND_UP(start + bytes, PAGE_SIZE);
+        for (i = 0; i < n; i++) {
+            len = min_t(ssize_t, PAGE_SIZE - start, bytes);
+            if (!stop) {
+                ret = ftp_fs_direct_page(info, path->name, rw, offset + total, pages[i], start, len, ftp_fs_ra_window(f));
+                if (ret > 0) {
+                    total += ret;
+                    iov_iter_advance(iter, ret);
+                }
+                /* end of file or error */
+                if (ret < len)
+                    stop = 1;
+            }
+            if (rw == READ)
+                set_page_dirty_lock(pages[i]);
+            put_page(pages[i]);
+            bytes -= len;
+            start = 0;
+        }
+    }
+    /* errors are reported only with nothing transferred */
+    if (total > 0)
+        ret = 0;
+    ftp_fs_path_put(path);
+
+out:
+    trace_ftpfs_vfs_exit(rw == WRITE ? "direct_write" : "direct_read", inode->i_ino, ret < 0 ? ret : total);
+    return ret < 0 ? ret : total;
 }
 
-int ftp_fs_dir_open(struct inode* inode, struct file* file) {
-    pr_debug("opened file\n");
-    /* set the current dir at this dir */
-    static struct qstr cursor_name = QSTR_INIT(".", 1);
-    file->private_data = d_alloc(file->f_path.dentry, &cursor_name);
-    return file->private_data ? 0 : -ENOMEM;
+/* Complete the STOR streams of direct writes to <f>. */
+static int ftp_fs_flush_direct(struct file *f) {
+    struct ftp_info *info = (struct ftp_info*) f->f_inode->i_sb->s_fs_info;
+    struct ftp_fs_path *path = ftp_fs_path_get(f->f_dentry);
+    int ret;
+    if (IS_ERR(path))
+        return PTR_ERR(path);
+    ret = ftp_flush_file(info, path->name);
+    ftp_fs_path_put(path);
+    return ret;
 }
 
-int ftp_fs_close(struct inode* inode, struct file* file) {
-    char *path_buf = (char*) kmalloc(MAX_PATH_LEN, GFP_KERNEL);
-    if (path_buf == NULL)
+int ftp_fs_fsync(struct file *f, loff_t start, loff_t end, int datasync) {
+    int ret;
+    trace_ftpfs_vfs_enter("fsync", f->f_inode->i_ino, start, end - start);
+    ret = filemap_write_and_wait_range(f->f_mapping, start, end);
+    if (ret == 0 && (f->f_flags & O_DIRECT))
+        ret = ftp_fs_flush_direct(f);
+    trace_ftpfs_vfs_exit("fsync", f->f_inode->i_ino, ret);
+    return ret;
+}
+
+int ftp_fs_flush(struct file *f, fl_owner_t id) {
+    int ret;
+    if (!(f->f_mode & FMODE_WRITE))
+        return 0;
+    ret = filemap_write_and_wait(f->f_mapping);
+    if (ret == 0 && (f->f_flags & O_DIRECT))
+        ret = ftp_fs_flush_direct(f);
+    return ret;
+}
+
+/* Directory being read by ftp_fs_iterate() */
+struct ftp_fs_readdir {
+    struct dir_context *ctx;
+    struct dentry *dentry;
+};
+
+/* Emit a file of the listing, see ftp_dir_actor. */
+static int ftp_fs_emit(void *data, const struct ftp_file_info *file, const char *name, int len) {
+    struct ftp_fs_readdir *rd = data;
+    struct ftp_fs_key key;
+    ino_t ino;
+    /* leave a dentry with attributes for the entries of a listing small
+     * enough to be cached, the others are numbered as lookup would number
+     * them, so that a huge listing does not fill the dcache */
+    if (rd->ctx->pos - 2 < DIR_CACHE_FILES)
+        ino = ftp_fs_instantiate(rd->dentry, name, len, file);
+    else {
+        ftp_fs_key_init(&key, rd->dentry->d_inode, name, len, file->mode, file->unique);
+        ino = key.ino;
+    }
+    if (ino == 0)
+        ino = iunique(rd->dentry->d_sb, 2);
+    if (!dir_emit(rd->ctx, name, len, ino, (file->mode >> 12) & 15))
+        return 1;
+    rd->ctx->pos++;
+    return 0;
+}
+
+int ftp_fs_iterate(struct file* f, struct dir_context* ctx) {
+    if (!dir_emit_dots(f, ctx)) {
+        pr_debug("emit dot failed\n");
         return 0;
+    }
+
+    int result;
+    struct dentry *dentry = f->f_dentry;
+
+    /* get the full path for the file */
+    struct ftp_fs_path *full_path = ftp_fs_path_get(dentry);
+    if (IS_ERR(full_path))
+        return PTR_ERR(full_path);
+
+    /* ctx->pos counts the two dots, then the entries of the listing, which
+     * are emitted as they arrive */
+    struct ftp_fs_readdir rd = { .ctx = ctx, .dentry = dentry };
+    trace_ftpfs_vfs_enter("iterate", f->f_inode->i_ino, ctx->pos, 0);
+    result = ftp_iterate_dir((struct ftp_info*) f->f_inode->i_sb->s_fs_info, full_path->name, ctx->pos - 2, ftp_fs_emit, &rd);
+    trace_ftpfs_vfs_exit("iterate", f->f_inode->i_ino, result);
+    if (result > 0)
+        result = 0;
+    ftp_fs_path_put(full_path);
+    return result;
+}
+
+int ftp_fs_close(struct inode* inode, struct file* file) {
+    kfree(file->private_data);
+    /* pages dirtied through a shared mapping after the last flush */
+    filemap_write_and_wait(inode->i_mapping);
     /* get the full path */
-    char *full_path = dentry_path_raw(file->f_dentry, path_buf, MAX_PATH_LEN);
-    ftp_close_file((struct ftp_info*) inode->i_sb->s_fs_info, full_path);
-    kfree(path_buf);
+    struct ftp_fs_path *full_path = ftp_fs_path_get(file->f_dentry);
+    if (IS_ERR(full_path))
+        return 0;
+    ftp_close_file((struct ftp_info*) inode->i_sb->s_fs_info, full_path->name);
+    ftp_fs_path_put(full_path);
     return 0;
 }
 
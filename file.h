@@ -3,10 +3,18 @@
 // TODO
 extern const struct file_operations ftp_fs_file_operations;
 extern const struct file_operations ftp_fs_dir_operations;
+extern const struct address_space_operations ftp_fs_aops;
 
-ssize_t ftp_fs_read(struct file*, char __user*, size_t, loff_t*);
-ssize_t ftp_fs_write(struct file*, const char __user*, size_t, loff_t*);
+int ftp_fs_open(struct inode*, struct file*);
+ssize_t ftp_fs_read_iter(struct kiocb*, struct iov_iter*);
+ssize_t ftp_fs_splice_read(struct file*, loff_t*, struct pipe_inode_info*, size_t, unsigned int);
+int ftp_fs_readpage(struct file*, struct page*);
+int ftp_fs_readpages(struct file*, struct address_space*, struct list_head*, unsigned);
+int ftp_fs_write_begin(struct file*, struct address_space*, loff_t, unsigned, unsigned, struct page**, void**);
+int ftp_fs_writepages(struct address_space*, struct writeback_control*);
+ssize_t ftp_fs_direct_IO(int, struct kiocb*, struct iov_iter*, loff_t);
+int ftp_fs_fsync(struct file*, loff_t, loff_t, int);
+int ftp_fs_flush(struct file*, fl_owner_t);
 int ftp_fs_iterate(struct file* f, struct dir_context* ctx);
-int ftp_fs_dir_open(struct inode* inode, struct file* file);
 int ftp_fs_close(struct inode* inode, struct file* file);
 #endif
@@ -1,10 +1,18 @@
 #include "ftp.h"
 #include "sock.h"
+#include "trace.h"
 #include <linux/slab.h>
 #include <linux/ctype.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
 
-int ftp_info_init(struct ftp_info **info, struct sockaddr_in addr, const char *user, const char *pass, int max_sock) {
+static void ftp_conn_close(struct ftp_conn_info *conn);
+static void ftp_conn_listing_free(struct ftp_conn_info *conn);
+static void ftp_conn_prefetch(struct work_struct *work);
+static void ftp_keepalive(struct work_struct *work);
+
+int ftp_info_init(struct ftp_info **info, struct sockaddr_in addr, const char *user, const char *pass, int max_sock, const struct ftp_options *opts) {
+    int i;
     *info = (struct ftp_info*)kmalloc(sizeof(struct ftp_info), GFP_KERNEL);
     if (*info == NULL)
         goto error0;
@@ -17,15 +25,49 @@ int ftp_info_init(struct ftp_info **info, struct sockaddr_in addr, const char *u
     (*info)->conn_list = (struct ftp_conn_info*)kmalloc(sizeof(struct ftp_conn_info) * max_sock, GFP_KERNEL);
     if ((*info)->conn_list == NULL)
         goto error3;
+    /* the number of transfers is bounded by the pool, not by the workers,
+     * since a request may wait for others, see ftp_read_file_striped() */
+    (*info)->wq = alloc_workqueue("ftpfs", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if ((*info)->wq == NULL)
+        goto error4;
     memcpy(&(*info)->addr, &addr, sizeof(struct sockaddr_in));
     strcpy((*info)->user, user);
     strcpy((*info)->pass, pass);
     (*info)->max_sock = max_sock;
     memset((*info)->conn_list, 0, sizeof(struct ftp_conn_info) * max_sock);
-    sema_init(&(*info)->sem, max_sock);
-    sema_init(&(*info)->mutex, 1);
+    /* commands are built in a buffer of their session */
+    for (i = 0; i < max_sock; i++)
+        if (((*info)->conn_list[i].cmd = (char*)kmalloc(FTP_CMD_SIZE, GFP_KERNEL)) == NULL)
+            goto error5;
+    spin_lock_init(&(*info)->lock);
+    init_waitqueue_head(&(*info)->wait);
+    INIT_LIST_HEAD(&(*info)->idle);
+    INIT_LIST_HEAD(&(*info)->lru);
+    for (i = 0; i < (1 << FTP_STREAM_BITS); i++)
+        INIT_HLIST_HEAD(&(*info)->streams[i]);
+    for (i = 0; i < max_sock; i++) {
+        INIT_WORK(&(*info)->conn_list[i].ra_work, ftp_conn_prefetch);
+        INIT_HLIST_NODE(&(*info)->conn_list[i].node);
+        (*info)->conn_list[i].stats = &(*info)->stats;
+        list_add_tail(&(*info)->conn_list[i].list, &(*info)->idle);
+    }
+    (*info)->features = 0;
+    (*info)->home = NULL;
+    atomic_set(&(*info)->ino_gen, 0);
+    ftp_stats_init(&(*info)->stats);
+    INIT_DELAYED_WORK(&(*info)->keepalive, ftp_keepalive);
+    dir_cache_init(&(*info)->dir_cache, opts->dir_ttl);
+    (*info)->opts = *opts;
+    seqcount_init(&(*info)->opts_seq);
+    seqcount_init(&(*info)->rename_seq);
     return 0;
 
+error5:
+    for (i = 0; i < max_sock; i++)
+        kfree((*info)->conn_list[i].cmd);
+    destroy_workqueue((*info)->wq);
+error4:
+    kfree((*info)->conn_list);
 error3:
     kfree((*info)->pass);
 error2:
@@ -36,114 +78,280 @@ error0:
     return -ENOMEM;
 }
 
+void ftp_info_set_options(struct ftp_info *info, const struct ftp_options *opts) {
+    unsigned long keepalive;
+    spin_lock(&info->lock);
+    keepalive = info->opts.keepalive;
+    write_seqcount_begin(&info->opts_seq);
+    info->opts = *opts;
+    write_seqcount_end(&info->opts_seq);
+    spin_unlock(&info->lock);
+    ACCESS_ONCE(info->dir_cache.ttl) = opts->dir_ttl;
+    /* the keepalive runs at the new interval from now on */
+    if (opts->keepalive == keepalive)
+        return;
+    if (opts->keepalive > 0)
+        mod_delayed_work(info->wq, &info->keepalive, opts->keepalive);
+    else
+        cancel_delayed_work_sync(&info->keepalive);
+}
+
+void ftp_info_options(struct ftp_info *info, struct ftp_options *opts) {
+    unsigned seq;
+    do {
+        seq = read_seqcount_begin(&info->opts_seq);
+        *opts = info->opts;
+    } while (read_seqcount_retry(&info->opts_seq, seq));
+}
+
 void ftp_info_destroy(struct ftp_info *info) {
+    int i;
+    ftp_stats_unregister(&info->stats);
+    cancel_delayed_work_sync(&info->keepalive);
+    /* close all sessions */
+    for (i = 0; i < info->max_sock; i++) {
+        cancel_work_sync(&info->conn_list[i].ra_work);
+        ftp_conn_close(&info->conn_list[i]);
+        if (info->conn_list[i].ra_buf != NULL)
+            vfree(info->conn_list[i].ra_buf);
+        sock_reader_destroy(&info->conn_list[i].control_rd);
+        sock_reader_destroy(&info->conn_list[i].data_rd);
+        kfree(info->conn_list[i].cmd);
+    }
+    destroy_workqueue(info->wq);
+    dir_cache_clear(&info->dir_cache);
     kfree(info->user);
     kfree(info->pass);
+    kfree(info->home);
     kfree(info->conn_list);
     kfree(info);
 }
 
-void ftp_file_info_destroy(unsigned long len, struct ftp_file_info *files) {
-    unsigned long i = 0;
-    for (; i < len; i++)
-        kfree(files[i].name);
-    kfree(files);
+/* Forget prefetched data, used when the data transfer is (re)opened or
+ * closed. */
+static void ftp_conn_prefetch_reset(struct ftp_conn_info *conn) {
+    conn->ra_start = conn->ra_len = conn->ra_window = 0;
+    conn->ra_end = conn->offset;
+    conn->ra_eof = conn->ra_err = 0;
+}
+
+/* Prefetch work: receive data from the data socket into the prefetch buffer
+ * until the window is full, the stream ends or a reader claims the session.
+ * It only runs while the session is not in use, and every user claiming the
+ * session waits for it by ftp_conn_prefetch_stop(). */
+static void ftp_conn_prefetch(struct work_struct *work) {
+    struct ftp_conn_info *conn = container_of(work, struct ftp_conn_info, ra_work);
+    unsigned long limit;
+    int ret;
+    /* move pending data to the front of the buffer */
+    if (conn->ra_start > 0) {
+        memmove(conn->ra_buf, conn->ra_buf + conn->ra_start, conn->ra_len - conn->ra_start);
+        conn->ra_len -= conn->ra_start;
+        conn->ra_start = 0;
+    }
+    limit = min(conn->ra_window, conn->ra_size);
+    while (!ACCESS_ONCE(conn->ra_stop) && conn->ra_len < limit) {
+        ret = sock_recv(conn->data_sock, conn->ra_buf + conn->ra_len, limit - conn->ra_len);
+        if (ret <= 0) {
+            if (ret == 0)
+                conn->ra_eof = 1;
+            else
+                conn->ra_err = ret;
+            break;
+        }
+        conn->ra_len += ret;
+        ACCESS_ONCE(conn->ra_end) = conn->ra_end + ret;
+        ftp_stats_add(conn->stats, FTP_STAT_RX_BYTES, ret);
+    }
+}
+
+/* Wait for the prefetch work of a session just claimed to finish. */
+static void ftp_conn_prefetch_stop(struct ftp_conn_info *conn) {
+    ACCESS_ONCE(conn->ra_stop) = 1;
+    flush_work(&conn->ra_work);
+    conn->ra_stop = 0;
+}
+
+/* Set the prefetch window of a claimed session, growing the buffer if
+ * needed. If the buffer cannot be grown the window is kept smaller. */
+static void ftp_conn_prefetch_window(struct ftp_conn_info *conn, unsigned long window) {
+    char *buf;
+    if (window > conn->ra_size) {
+        buf = vmalloc(window);
+        if (buf != NULL) {
+            if (conn->ra_buf != NULL) {
+                memcpy(buf, conn->ra_buf + conn->ra_start, conn->ra_len - conn->ra_start);
+                vfree(conn->ra_buf);
+            }
+            conn->ra_len -= conn->ra_start;
+            conn->ra_start = 0;
+            conn->ra_buf = buf;
+            conn->ra_size = window;
+        }
+    }
+    conn->ra_window = min(window, conn->ra_size);
 }
 
 /* Close a session. */
 static void ftp_conn_close(struct ftp_conn_info *conn) {
+    ftp_conn_prefetch_reset(conn);
+    ftp_conn_listing_free(conn);
     if (conn->data_sock != NULL) {
         sock_release(conn->data_sock);
-        if (conn->cmd != NULL)
-            kfree(conn->cmd);
+        conn->cmd[0] = 0;
     }
     if (conn->control_sock != NULL)
         sock_release(conn->control_sock);
     conn->control_sock = conn->data_sock = NULL;
+    sock_reader_init(&conn->control_rd, NULL);
+    sock_reader_init(&conn->data_rd, NULL);
+    conn->npending = 0;
 }
 
-/* Send an FTP command. Return 0 for success and negative value for error.
+/* Close a session on an error in its connection. */
+static void ftp_conn_drop(struct ftp_conn_info *conn) {
+    ftp_stats_inc(conn->stats, FTP_STAT_DROP);
+    ftp_conn_close(conn);
+}
+
+/* Count the commands in <cmd>, and time the replies to them. */
+static void ftp_conn_sent(struct ftp_conn_info *conn, const char *cmd) {
+    int i;
+    trace_ftpfs_cmd(conn, cmd);
+    conn->sent = ktime_get();
+    while (1) {
+        i = ftp_stats_cmd(cmd);
+        atomic64_inc(&conn->stats->cmds[i]);
+        if (conn->npending < FTP_PIPELINE)
+            conn->pending[conn->npending++] = i;
+        if ((cmd = strchr(cmd, '\n')) == NULL)
+            break;
+        cmd++;
+    }
+}
+
+/* Account a reply of status <code> to the oldest command waiting for one. */
+static void ftp_conn_replied(struct ftp_conn_info *conn, int code) {
+    s64 lat;
+    if (conn->npending == 0) {
+        trace_ftpfs_reply(conn, "", code, 0);
+        return;
+    }
+    /* the statistics are updated whether the tracepoint is enabled or not */
+    lat = ftp_stats_time(&conn->stats->latency[conn->pending[0]], conn->sent);
+    trace_ftpfs_reply(conn, ftp_stats_cmd_name(conn->pending[0]), code, lat);
+    memmove(conn->pending, conn->pending + 1, --conn->npending);
+}
+
+/* Send the FTP commands <pre>, unless it is NULL, and <cmd> at once. Several
+ * commands separated by "\r\n" in <pre> are sent. Return 0 for success and
+ * negative value for error.
  * If there is an error in connection, this session is closed. */
-static int ftp_conn_send(struct ftp_conn_info *conn, const char *cmd) {
-    int len, sent = 0, ret;
-    char *buf = (char*)kmalloc(strlen(cmd) + 3, GFP_KERNEL);
-    if (buf == NULL) {
-        ret = -ENOMEM;
-        goto error0;
+static int ftp_conn_sendv(struct ftp_conn_info *conn, const char *pre, const char *cmd) {
+    /* the line endings are sent from here, nothing is copied */
+    struct kvec vec[4];
+    int num = 0, ret;
+    if (pre != NULL) {
+        vec[num].iov_base = (void*)pre;
+        vec[num++].iov_len = strlen(pre);
+        vec[num].iov_base = "\r\n";
+        vec[num++].iov_len = 2;
     }
-    sprintf(buf, "%s\r\n", cmd);
-    len = strlen(buf);
-    while (sent < len) {
-        ret = sock_send(conn->control_sock, buf + sent, len - sent);
-        if (ret < 0)
-            goto error1;
-        sent += ret;
+    vec[num].iov_base = (void*)cmd;
+    vec[num++].iov_len = strlen(cmd);
+    vec[num].iov_base = "\r\n";
+    vec[num++].iov_len = 2;
+    if ((ret = sock_sendv(conn->control_sock, vec, num)) < 0) {
+        ftp_conn_drop(conn);
+        return ret;
     }
-    kfree(buf);
+    if (pre != NULL)
+        ftp_conn_sent(conn, pre);
+    ftp_conn_sent(conn, cmd);
     return 0;
+}
 
-error1:
-    kfree(buf);
-error0:
-    ftp_conn_close(conn);
-    return ret;
+/* Send an FTP command. Return 0 for success and negative value for error.
+ * If there is an error in connection, this session is closed. */
+static int ftp_conn_send(struct ftp_conn_info *conn, const char *cmd) {
+    return ftp_conn_sendv(conn, NULL, cmd);
+}
+
+/* Build the command <op> on <path> in the buffer of the session, which has no
+ * data transfer. Return the command, or NULL if <path> is too long. */
+static const char* ftp_conn_cmd(struct ftp_conn_info *conn, const char *op, const char *path) {
+    if (snprintf(conn->cmd, FTP_CMD_SIZE, "%s ./%s", op, path) >= FTP_CMD_SIZE)
+        return NULL;
+    return conn->cmd;
+}
+
+/* Send the command <op> on <path>, see ftp_conn_cmd(). Return 0 for success
+ * and negative value for error. */
+static int ftp_conn_send_cmd(struct ftp_conn_info *conn, const char *op, const char *path) {
+    const char *cmd = ftp_conn_cmd(conn, op, path);
+    return cmd != NULL ? ftp_conn_send(conn, cmd) : -ENAMETOOLONG;
 }
 
 /* Receive an FTP response. Return the status code for success and negative
  * value for error. If <resp> is not NULL, store the first line of response
- * in <resp>, which should later be kfree()d.
+ * in <resp>, which should later be kfree()d. If <fn> is not NULL, it is
+ * called with <data> on each line between the first and the last one of a
+ * multiline response.
  * If there is an error in connection or the response is not understood,
  * the whole session is closed. */
-static int ftp_conn_recv(struct ftp_conn_info *conn, char **resp) {
-    char *buf, *buf2;
-    int ret = sock_readline(conn->control_sock, &buf), code;
+static int ftp_conn_recv_lines(struct ftp_conn_info *conn, char **resp, void (*fn)(void*, char*), void *data) {
+    char *line, prefix[4];
+    int ret = sock_reader_line(&conn->control_rd, &line), code;
     if (ret <= 0) {
         if (ret == 0)
             ret = -ECONNRESET;
         goto error0;
     }
-    if (ret < 6 || (buf[3] != ' ' && buf[3] != '-')
-            || !isdigit(buf[0]) || !isdigit(buf[1]) || !isdigit(buf[2])
-            || buf[0] == '0') {
+    if (ret < 6 || (line[3] != ' ' && line[3] != '-')
+            || !isdigit(line[0]) || !isdigit(line[1]) || !isdigit(line[2])
+            || line[0] == '0') {
         ret = -EIO;
-        goto error1;
+        goto error0;
+    }
+    sscanf(line, "%d", &code);
+    ftp_conn_replied(conn, code);
+    /* the line is overwritten by further reads, keep a copy */
+    if (resp != NULL && (*resp = kstrdup(line, GFP_KERNEL)) == NULL) {
+        ret = -ENOMEM;
+        goto error0;
     }
-    sscanf(buf, "%d", &code);
-    /* multiline response */
-    if (buf[3] == '-') {
-        while (1) {
-            ret = sock_readline(conn->control_sock, &buf2);
-            if (ret >= 4 && buf[0] == buf2[0] && buf[1] == buf2[1] && buf[2] == buf2[2] && buf2[3] == ' ') {
-                if (resp != NULL)
-                    *resp = buf;
-                else
-                    kfree(buf);
-                kfree(buf2);
-                return code;
-            }
-            if (ret <= 0) {
-                if (ret == 0)
-                    ret = -ECONNRESET;
-                goto error1;
-            }
-            kfree(buf2);
-        }
     /* single-line response */
-    } else {
-        if (resp != NULL)
-            *resp = buf;
-        else
-            kfree(buf);
+    if (line[3] == ' ')
         return code;
+    /* multiline response, ended by a line starting with "<code> " */
+    memcpy(prefix, line, 3);
+    prefix[3] = ' ';
+    while (1) {
+        ret = sock_reader_line(&conn->control_rd, &line);
+        if (ret <= 0) {
+            if (ret == 0)
+                ret = -ECONNRESET;
+            goto error1;
+        }
+        if (ret >= 4 && memcmp(line, prefix, 4) == 0)
+            return code;
+        if (fn != NULL)
+            fn(data, line);
     }
 
 error1:
-    kfree(buf);
+    if (resp != NULL)
+        kfree(*resp);
 error0:
-    ftp_conn_close(conn);
+    ftp_conn_drop(conn);
     return ret;
 }
 
+/* Receive an FTP response, see ftp_conn_recv_lines(). */
+static int ftp_conn_recv(struct ftp_conn_info *conn, char **resp) {
+    return ftp_conn_recv_lines(conn, resp, NULL, NULL);
+}
+
 /* Close the data transfer connection. After closing the connection, this
  * function sends an ABOR command for confirmation, and if this transaction
  * is not successful, the whole session is closed. */
@@ -151,19 +359,64 @@ static void ftp_conn_data_close(struct ftp_conn_info *conn) {
     int ret;
     if (conn->data_sock == NULL)
         return;
-    pr_debug("closed: %s\n", conn->cmd);
+    ftp_conn_prefetch_stop(conn);
+    trace_ftpfs_data_abort(conn, conn->cmd, conn->offset, 0);
+    ftp_conn_prefetch_reset(conn);
+    ftp_conn_listing_free(conn);
     sock_release(conn->data_sock);
     conn->data_sock = NULL;
-    if (conn->cmd != NULL)
-        kfree(conn->cmd);
+    sock_reader_init(&conn->data_rd, NULL);
+    conn->cmd[0] = 0;
+    ftp_stats_inc(conn->stats, FTP_STAT_ABORT);
     if (ftp_conn_send(conn, "ABOR") < 0 || ((ret = ftp_conn_recv(conn, NULL)) != 426 && ret != 226 && ret != 225)
             || (ret != 225 && (ret = ftp_conn_recv(conn, NULL)) != 225 && ret != 226))
-        ftp_conn_close(conn);
+        ftp_conn_drop(conn);
+}
+
+/* Finish a data transfer normally: close the data connection and wait for the
+ * completion reply. Return 0 for success and negative value for error, in
+ * which case the whole session is closed. */
+static int ftp_conn_data_finish(struct ftp_conn_info *conn) {
+    int ret;
+    if (conn->data_sock == NULL)
+        return 0;
+    ftp_conn_prefetch_stop(conn);
+    ftp_conn_prefetch_reset(conn);
+    ftp_conn_listing_free(conn);
+    sock_release(conn->data_sock);
+    conn->data_sock = NULL;
+    sock_reader_init(&conn->data_rd, NULL);
+    ret = ftp_conn_recv(conn, NULL);
+    trace_ftpfs_data_finish(conn, conn->cmd, conn->offset, ret);
+    conn->cmd[0] = 0;
+    if (ret != 226 && ret != 250) {
+        if (ret >= 0) {
+            ret = -EIO;
+            ftp_conn_drop(conn);
+        }
+        return ret;
+    }
+    return 0;
+}
+
+/* Record an extension of a FEAT response line in the feature mask <data>. */
+static void ftp_parse_feat(void *data, char *line) {
+    unsigned int *features = data;
+    for (; *line == ' '; line++);
+    if (strncasecmp(line, "MLST", 4) == 0)
+        *features |= FTP_FEAT_MLST;
+    else if (strncasecmp(line, "SIZE", 4) == 0)
+        *features |= FTP_FEAT_SIZE;
+    else if (strncasecmp(line, "MDTM", 4) == 0)
+        *features |= FTP_FEAT_MDTM;
+    else if (strncasecmp(line, "EPSV", 4) == 0)
+        *features |= FTP_FEAT_EPSV;
 }
 
 /* Connect to the FTP server, log in and set other stuffs. Return 0 for success
  * and negative value for error. On error the session is not created. */
 static int ftp_conn_connect(struct ftp_info *info, struct ftp_conn_info *conn) {
+    unsigned int features;
     int ret, bufsize, tmp;
     char *buf;
     bufsize = strlen(info->user) + 6;
@@ -176,6 +429,7 @@ static int ftp_conn_connect(struct ftp_info *info, struct ftp_conn_info *conn) {
     pr_debug("sock created, connecting to %u,%d\n", info->addr.sin_addr.s_addr, info->addr.sin_port);
     if ((ret = conn->control_sock->ops->connect(conn->control_sock, (struct sockaddr*)&info->addr, sizeof(struct sockaddr_in), 0)) < 0)
         goto error1;
+    sock_reader_init(&conn->control_rd, conn->control_sock);
     pr_debug("connected to server\n");
     /* receive initial response */
     if ((ret = ftp_conn_recv(conn, NULL)) != 220) {
@@ -213,7 +467,19 @@ static int ftp_conn_connect(struct ftp_info *info, struct ftp_conn_info *conn) {
             ret = -EIO;
         goto error1;
     }
-    pr_debug("TYPE I ok, connection opened\n");
+    pr_debug("TYPE I ok\n");
+    /* ask for extensions supported by the server once */
+    if (!(info->features & FTP_FEAT_KNOWN)) {
+        features = FTP_FEAT_KNOWN;
+        if ((ret = ftp_conn_send(conn, "FEAT")) < 0 || (ret = ftp_conn_recv_lines(conn, NULL, ftp_parse_feat, &features)) < 0)
+            goto error0;
+        if (ret != 211)
+            features = FTP_FEAT_KNOWN;
+        pr_debug("server features: %x\n", features);
+        info->features = features;
+    }
+    pr_debug("connection opened\n");
+    ftp_stats_inc(conn->stats, FTP_STAT_LOGIN);
     return 0;
 
 error2:
@@ -221,118 +487,230 @@ error2:
 error1:
     ftp_conn_close(conn);
 error0:
+    ftp_stats_inc(conn->stats, FTP_STAT_LOGIN_FAIL);
     return ret;
 }
 
-/* Open data transfer connection in PASV mode. Return 0 for success and
- * negative value for error. On error the connection is not established. */
-static int ftp_conn_open_pasv(struct ftp_conn_info *conn) {
-    char *resp, *ptr;
-    struct sockaddr_in data_addr;
-    int seg[6], i, ret;
-    /* send PASV command */
-    if ((ret = ftp_conn_send(conn, "PASV")) < 0)
-        goto error0;
-    if ((ret = ftp_conn_recv(conn, &resp)) != 227) {
-        if (ret >= 0) {
-            ret = -EIO;
-            kfree(resp);
-        }
-        goto error0;
+/* Parse the data transfer address in a reply <resp> to EPSV, "229 ... (|||port|)",
+ * or to PASV, "227 ... (h1,h2,h3,h4,p1,p2)", into <addr>. Return 0 for success
+ * and -EIO if the reply is not understood. */
+static int ftp_parse_passive(struct ftp_info *info, const char *resp, int epsv, struct sockaddr_in *addr) {
+    const char *ptr = resp + 4;
+    char *end;
+    unsigned long port;
+    int seg[6], i;
+    memcpy(addr, &info->addr, sizeof(struct sockaddr_in));
+    if (epsv) {
+        /* the address is that of the control connection */
+        if ((ptr = strchr(ptr, '(')) == NULL || ptr[1] == 0 || ptr[2] != ptr[1] || ptr[3] != ptr[1])
+            return -EIO;
+        port = simple_strtoul(ptr + 4, &end, 10);
+        if (*end != ptr[1] || port == 0 || port > 65535)
+            return -EIO;
+        addr->sin_port = htons(port);
+        return 0;
     }
-    pr_debug("pasv ok\n");
-    /* parse response and get IP and port to connect to */
-    ptr = resp + 4;
     for (; *ptr != 0 && (*ptr < '0' || *ptr > '9'); ptr++);
-    if (*ptr == 0 || sscanf(ptr, "%d,%d,%d,%d,%d,%d", &seg[0], &seg[1], &seg[2], &seg[3], &seg[4], &seg[5]) < 6) {
+    if (*ptr == 0 || sscanf(ptr, "%d,%d,%d,%d,%d,%d", &seg[0], &seg[1], &seg[2], &seg[3], &seg[4], &seg[5]) < 6)
+        return -EIO;
+    for (i = 0; i < 6; i++)
+        if (seg[i] < 0 || seg[i] >= 256)
+            return -EIO;
+    for (i = 0; i < 4; i++)
+        ((unsigned char*)&addr->sin_addr)[i] = seg[i];
+    addr->sin_port = htons((seg[4] << 8) + seg[5]);
+    return 0;
+}
+
+/* Open data transfer connection in passive mode and start command <cmd>
+ * restarting at <offset>. EPSV (or PASV if the server does not support it),
+ * REST and <cmd> are sent at once and their replies are matched in order, so
+ * that the server handles REST and <cmd> while the data connection is being
+ * established, instead of one round trip each. Return 0 for success and
+ * negative value for error. On error the connection is not established, and
+ * unless <cmd> itself is refused, the session is closed since the replies
+ * pipelined are not in step any more. */
+static int ftp_conn_open_data(struct ftp_info *info, struct ftp_conn_info *conn, const char *cmd, unsigned long offset) {
+    struct sockaddr_in data_addr;
+    struct ftp_options opts;
+    int epsv = info->features & FTP_FEAT_EPSV, ret;
+    char pre[32], *resp;
+    if (offset)
+        sprintf(pre, "%s\r\nREST %lu", epsv ? "EPSV" : "PASV", offset);
+    else
+        strcpy(pre, epsv ? "EPSV" : "PASV");
+    if ((ret = ftp_conn_sendv(conn, pre, cmd)) < 0)
+        return ret;
+    /* get the address to connect to */
+    if ((ret = ftp_conn_recv(conn, &resp)) < 0)
+        return ret;
+    if (ret != (epsv ? 229 : 227) || ftp_parse_passive(info, resp, epsv, &data_addr) < 0) {
         kfree(resp);
         ret = -EIO;
         goto error0;
     }
     kfree(resp);
-    data_addr.sin_family = AF_INET;
-    for (i = 0; i < 6; i++)
-        if (seg[i] < 0 || seg[i] >= 256) {
-            ret = -EIO;
-            goto error0;
-        }
-    for (i = 0; i < 4; i++)
-        ((unsigned char*)&data_addr.sin_addr)[i] = seg[i];
-    pr_debug("got pasv port no: %d\n", (seg[4] << 8) + seg[5]);
-    data_addr.sin_port = htons((seg[4] << 8) + seg[5]);
-    /* create data socket and connect to the given address */
+    /* create data socket and connect to the given address, buffer sizes are
+     * set before connecting so that the TCP window scale takes them into
+     * account */
     if ((ret = sock_create(AF_INET, SOCK_STREAM, 0, &conn->data_sock)) < 0)
         goto error0;
-    if ((ret = conn->data_sock->ops->connect(conn->data_sock, (struct sockaddr*)&data_addr, sizeof(struct sockaddr_in), 0)) < 0)
-        goto error1;
-    pr_debug("connected to pasv port, pasv succeeded\n");
+    ftp_info_options(info, &opts);
+    if ((ret = sock_set_bufsize(conn->data_sock, opts.rcvbuf, opts.sndbuf)) < 0
+            || (ret = conn->data_sock->ops->connect(conn->data_sock, (struct sockaddr*)&data_addr, sizeof(struct sockaddr_in), 0)) < 0) {
+        sock_release(conn->data_sock);
+        conn->data_sock = NULL;
+        goto error0;
+    }
+    sock_reader_init(&conn->data_rd, conn->data_sock);
+    /* the replies to REST and the command */
+    if (offset && (ret = ftp_conn_recv(conn, NULL)) != 350) {
+        if (ret >= 0)
+            ret = -EIO;
+        goto error0;
+    }
+    if ((ret = ftp_conn_recv(conn, NULL)) != 150 && ret != 125) {
+        if (ret >= 0) {
+            /* refused by the server, e.g. 550 for a missing file, the
+             * replies are still in step */
+            ftp_conn_data_close(conn);
+            ret = -EPERM;
+        }
+        return ret;
+    }
     return 0;
 
-error1:
-    ftp_conn_data_close(conn);
 error0:
+    ftp_conn_close(conn);
     return ret;
 }
 
-/* Find a session to use. If <cmd> is not NULL, it means that data transfer
- * is also needed. */
-static void ftp_find_conn(struct ftp_info *info, const char *cmd, unsigned long offset, struct ftp_conn_info **conn) {
-    int i;
-    down(&info->mutex);
-    if (cmd != NULL) {
+/* Hash of the file <file> transferred by a session. */
+static unsigned int ftp_stream_hash(const char *file) {
+    return full_name_hash((const unsigned char*)file, strlen(file));
+}
+
+/* Take the idle session <conn> out of the pool, with info->lock held. */
+static void ftp_pool_unlink(struct ftp_conn_info *conn) {
+    list_del_init(&conn->list);
+    if (!hlist_unhashed(&conn->node))
+        hlist_del_init(&conn->node);
+}
+
+/* Take an idle session out of the pool, preferring one without data transfer,
+ * then the least recently used file transfer, which restarts at any offset,
+ * over a directory listing, which is read again from its start, or return
+ * NULL if all sessions are in use. */
+static struct ftp_conn_info* ftp_pool_take(struct ftp_info *info) {
+    struct ftp_conn_info *conn = NULL, *tmp;
+    spin_lock(&info->lock);
+    if (!list_empty(&info->idle))
+        conn = list_first_entry(&info->idle, struct ftp_conn_info, list);
+    else if (!list_empty(&info->lru)) {
+        conn = list_first_entry(&info->lru, struct ftp_conn_info, list);
+        list_for_each_entry(tmp, &info->lru, list)
+            if (strncmp(tmp->cmd, "MLSD", 4) != 0 && strncmp(tmp->cmd, "LIST", 4) != 0) {
+                conn = tmp;
+                break;
+            }
+    }
+    if (conn != NULL)
+        ftp_pool_unlink(conn);
+    spin_unlock(&info->lock);
+    return conn;
+}
+
+/* Whether the data transfer of <conn> is of command <op> on <file>. */
+static int ftp_conn_is(const struct ftp_conn_info *conn, const char *op, const char *file) {
+    int len = strlen(op);
+    return strncmp(conn->cmd, op, len) == 0 && strncmp(conn->cmd + len, " ./", 3) == 0
+        && strcmp(conn->cmd + len + 3, file) == 0;
+}
+
+/* Take an idle session with data transfer on file <file> out of the pool,
+ * whose command is <op> ("RETR" or "STOR"), or either if it is NULL. Return
+ * NULL if there is not such a session. */
+static struct ftp_conn_info* ftp_pool_take_stream(struct ftp_info *info, const char *file, const char *op) {
+    unsigned int hash = ftp_stream_hash(file);
+    struct ftp_conn_info *conn;
+    spin_lock(&info->lock);
+    hlist_for_each_entry(conn, &info->streams[hash & ((1 << FTP_STREAM_BITS) - 1)], node)
+        if (conn->hash == hash && (op != NULL ? ftp_conn_is(conn, op, file)
+                    : ftp_conn_is(conn, "RETR", file) || ftp_conn_is(conn, "STOR", file))) {
+            ftp_pool_unlink(conn);
+            spin_unlock(&info->lock);
+            return conn;
+        }
+    spin_unlock(&info->lock);
+    return NULL;
+}
+
+/* Release a session resource. If the session has a prefetch window, the data
+ * transfer keeps on draining into the prefetch buffer in background. */
+static void ftp_release_conn(struct ftp_info *info, struct ftp_conn_info *conn) {
+    trace_ftpfs_session_release(conn, conn->data_sock != NULL ? conn->cmd : NULL, conn->offset);
+    /* the work is queued while the session is still out of the pool, so that
+     * the next user claiming it always waits for the work */
+    if (conn->data_sock != NULL && conn->ra_window > 0 && !conn->ra_eof && !conn->ra_err
+            && conn->ra_len - conn->ra_start < conn->ra_window)
+        queue_work(info->wq, &conn->ra_work);
+    conn->last_used = jiffies;
+    spin_lock(&info->lock);
+    if (conn->data_sock != NULL) {
+        hlist_add_head(&conn->node, &info->streams[conn->hash & ((1 << FTP_STREAM_BITS) - 1)]);
+        list_add_tail(&conn->list, &info->lru);
+    } else
+        list_add(&conn->list, &info->idle);
+    spin_unlock(&info->lock);
+    wake_up(&info->wait);
+}
+
+/* Find a session to use, waiting if all sessions are in use. If <op> is not
+ * NULL, it means that data transfer of command <op> on <file> is also
+ * needed. */
+static void ftp_find_conn(struct ftp_info *info, const char *op, const char *file, unsigned long offset, struct ftp_conn_info **conn) {
+    struct ftp_conn_info *tmp;
+    unsigned int hash;
+    ktime_t start;
+    s64 wait;
+    if (op != NULL) {
         /* if data transfer is needed and there is a session with desired
-         * state, return this session at once */
-        for (i = 0; i < info->max_sock; i++)
-            if (info->conn_list[i].used == 0 && info->conn_list[i].data_sock != NULL
-                    && strcmp(info->conn_list[i].cmd, cmd) == 0 && info->conn_list[i].offset == offset) {
-                info->conn_list[i].used = 1;
-                *conn = &info->conn_list[i];
-                up(&info->mutex);
+         * data connection, use it; an offset already prefetched also
+         * matches */
+        hash = ftp_stream_hash(file);
+        spin_lock(&info->lock);
+        hlist_for_each_entry(tmp, &info->streams[hash & ((1 << FTP_STREAM_BITS) - 1)], node)
+            if (tmp->hash == hash && ftp_conn_is(tmp, op, file) && tmp->offset <= offset
+                    && (tmp->offset == offset || offset < ACCESS_ONCE(tmp->ra_end))) {
+                ftp_pool_unlink(tmp);
+                spin_unlock(&info->lock);
+                ftp_conn_prefetch_stop(tmp);
+                ftp_stats_inc(&info->stats, FTP_STAT_STREAM_HIT);
+                trace_ftpfs_session_acquire(tmp, tmp->cmd, offset, 1, 0);
+                *conn = tmp;
                 return;
             }
+        spin_unlock(&info->lock);
         /* if there is not a suitable session, try to avoid deadlock: for
          * RETR(read), close STOR(write)s on the same file; for STOR, close
          * RETRs and other STORs on the same file */
-        for (i = 0; i < info->max_sock; i++)
-            if (info->conn_list[i].used == 0 && info->conn_list[i].data_sock != NULL
-                    && ((strncmp(info->conn_list[i].cmd, cmd, 4) != 0
-                            && strcmp(info->conn_list[i].cmd + 7, cmd + 7) == 0)
-                        || (strncmp(cmd, "STOR", 4) == 0
-                            && strcmp(info->conn_list[i].cmd, cmd) == 0))) {
-                info->conn_list[i].used = 1;
-                up(&info->mutex);
-                ftp_conn_data_close(&info->conn_list[i]);
-                down(&info->mutex);
-                info->conn_list[i].used = 0;
-            }
-    }
-    /* try to find a session with no data transfer currently */
-    for (i = 0; i < info->max_sock; i++)
-        if (info->conn_list[i].used == 0 && info->conn_list[i].data_sock == NULL) {
-            info->conn_list[i].used = 1;
-            *conn = &info->conn_list[i];
-            up(&info->mutex);
-            return;
+        while ((tmp = ftp_pool_take_stream(info, file, strcmp(op, "STOR") == 0 ? NULL : "STOR")) != NULL) {
+            ftp_stats_inc(&info->stats, FTP_STAT_CONFLICT);
+            ftp_conn_data_close(tmp);
+            ftp_release_conn(info, tmp);
         }
-    /* there are only sessions with data transfer connections, close data
-     * transfer */
-    for (i = 0; i < info->max_sock; i++)
-        if (info->conn_list[i].used == 0) {
-            info->conn_list[i].used = 1;
-            *conn = &info->conn_list[i];
-            up(&info->mutex);
-            ftp_conn_data_close(*conn);
-            return;
-        }
-    /* this line should never be reached */
-}
-
-/* Release a session resource. */
-static void ftp_release_conn(struct ftp_info *info, struct ftp_conn_info *conn) {
-    down(&info->mutex);
-    conn->used = 0;
-    up(&info->mutex);
-    up(&info->sem);
+    }
+    /* try to find a session with no data transfer currently, or else the
+     * least recently used one, whose data transfer is closed */
+    start = ktime_get();
+    wait_event(info->wait, (tmp = ftp_pool_take(info)) != NULL);
+    wait = ftp_stats_time(&info->stats.wait, start);
+    trace_ftpfs_session_acquire(tmp, file, offset, 0, wait);
+    if (tmp->data_sock != NULL) {
+        ftp_stats_inc(&info->stats, FTP_STAT_EVICT);
+        ftp_conn_data_close(tmp);
+    }
+    *conn = tmp;
 }
 
 /* Request a session resource. This session should be established. On success,
@@ -341,9 +719,8 @@ static void ftp_release_conn(struct ftp_info *info, struct ftp_conn_info *conn)
 static int ftp_request_conn(struct ftp_info *info, struct ftp_conn_info **conn) {
     struct ftp_conn_info *tmp_conn;
     int ret;
-    down(&info->sem);
     /* find a session */
-    ftp_find_conn(info, NULL, 0, &tmp_conn);
+    ftp_find_conn(info, NULL, NULL, 0, &tmp_conn);
     /* if the session is not established, connect to FTP server */
     if (tmp_conn->control_sock == NULL && (ret = ftp_conn_connect(info, tmp_conn)) < 0)
         goto error;
@@ -355,491 +732,1271 @@ error:
     return ret;
 }
 
-/* Request a session resource. This session should be established and also its
- * data transfer connection should be created for command <cmd> with offset
- * <offset>. On success, 0 is returned and the session is stored in <conn>. On
- * error, negative value is returned and <conn> is not affected. */
-static int ftp_request_conn_open_pasv(struct ftp_info *info, struct ftp_conn_info **conn, const char *cmd, unsigned long offset) {
-    struct ftp_conn_info *tmp_conn;
-    char *tmp_cmd, buf[256];
+/* A session logged in by ftp_info_connect(), by a work item. */
+struct ftp_warm {
+    struct work_struct work;
+    struct ftp_info *info;
+    struct ftp_conn_info *conn;
     int ret;
-    down(&info->sem);
-    /* find a session */
-    ftp_find_conn(info, cmd, offset, &tmp_conn);
-    /* if the session is already suitable, return immediately */
-    if (tmp_conn->data_sock != NULL) {
-        *conn = tmp_conn;
-        return 0;
+};
+
+static void ftp_warm_work(struct work_struct *work) {
+    struct ftp_warm *warm = container_of(work, struct ftp_warm, work);
+    warm->ret = ftp_conn_connect(warm->info, warm->conn);
+}
+
+int ftp_info_connect(struct ftp_info *info) {
+    struct ftp_warm *warm;
+    struct ftp_options opts;
+    int i, n, ret = 0, ok = 0;
+    ftp_info_options(info, &opts);
+    n = min(opts.warm, info->max_sock);
+    if (n > 0) {
+        warm = (struct ftp_warm*)kmalloc(n * sizeof(struct ftp_warm), GFP_KERNEL);
+        if (warm == NULL)
+            return -ENOMEM;
+        /* the pool is not used yet, so the first sessions are idle */
+        spin_lock(&info->lock);
+        for (i = 0; i < n; i++)
+            ftp_pool_unlink(&info->conn_list[i]);
+        spin_unlock(&info->lock);
+        /* the logins take several round trips each, do them at the same time */
+        for (i = 0; i < n; i++) {
+            INIT_WORK(&warm[i].work, ftp_warm_work);
+            warm[i].info = info;
+            warm[i].conn = &info->conn_list[i];
+            queue_work(system_unbound_wq, &warm[i].work);
+        }
+        for (i = 0; i < n; i++) {
+            flush_work(&warm[i].work);
+            if (warm[i].ret < 0)
+                ret = warm[i].ret;
+            else
+                ok++;
+            ftp_release_conn(info, warm[i].conn);
+        }
+        kfree(warm);
+        pr_debug("%d of %d sessions logged in\n", ok, n);
     }
-    /* if the session is not established, connect to FTP server */
-    if (tmp_conn->control_sock == NULL && (ret = ftp_conn_connect(info, tmp_conn)) < 0)
-        goto error0;
-    /* open data transfer connection */
-    if ((ret = ftp_conn_open_pasv(tmp_conn)) < 0)
-        goto error0;
-    tmp_conn->cmd = NULL;
-    /* set restarting offset */
-    if (offset) {
-        sprintf(buf, "REST %ld", offset);
-        if ((ret = ftp_conn_send(tmp_conn, buf)) < 0 || (ret = ftp_conn_recv(tmp_conn, NULL)) != 350) {
+    if (opts.keepalive > 0)
+        queue_delayed_work(info->wq, &info->keepalive, opts.keepalive);
+    return ok > 0 ? 0 : ret;
+}
+
+/* Take an idle session without data transfer out of the pool that the
+ * keepalive should visit: one not used for opts.keepalive, either logged in
+ * or among the first opts.warm sessions. Return NULL if there is none. The
+ * options are stable under info->lock. */
+static struct ftp_conn_info* ftp_pool_take_stale(struct ftp_info *info) {
+    struct ftp_conn_info *conn;
+    spin_lock(&info->lock);
+    list_for_each_entry(conn, &info->idle, list)
+        if (time_after_eq(jiffies, conn->last_used + info->opts.keepalive)
+                && (conn->control_sock != NULL || conn - info->conn_list < info->opts.warm)) {
+            ftp_pool_unlink(conn);
+            spin_unlock(&info->lock);
+            return conn;
+        }
+    spin_unlock(&info->lock);
+    return NULL;
+}
+
+/* Send NOOP on idle sessions so that the server does not drop them, and log in
+ * again the warm sessions dropped anyway. The released sessions are not stale
+ * any more, so each one is visited once. */
+static void ftp_keepalive(struct work_struct *work) {
+    struct ftp_info *info = container_of(to_delayed_work(work), struct ftp_info, keepalive);
+    struct ftp_conn_info *conn;
+    struct ftp_options opts;
+    int ret;
+    ftp_info_options(info, &opts);
+    while ((conn = ftp_pool_take_stale(info)) != NULL) {
+        if (conn->control_sock != NULL
+                && ((ret = ftp_conn_send(conn, "NOOP")) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 200)) {
+            pr_debug("keepalive failed: %d\n", ret);
             if (ret >= 0)
-                ret = -EIO;
-            goto error1;
+                ftp_conn_close(conn);
         }
+        if (conn->control_sock == NULL && conn - info->conn_list < opts.warm
+                && (ret = ftp_conn_connect(info, conn)) < 0)
+            pr_debug("keepalive login failed: %d\n", ret);
+        ftp_release_conn(info, conn);
     }
-    /* send the command */
-    if ((ret = ftp_conn_send(tmp_conn, cmd)) < 0 || (ret = ftp_conn_recv(tmp_conn, NULL)) != 150) {
-        if (ret >= 0)
-            ret = -EPERM;
-        goto error1;
-    }
-    /* set corresponding <cmd> and <offset> in session info */
-    tmp_cmd = (char*)kmalloc(strlen(cmd) + 1, GFP_KERNEL);
-    if (tmp_cmd == NULL) {
-        ret = -ENOMEM;
-        goto error1;
+    /* a remount changing the interval has rescheduled the work already */
+    if (opts.keepalive > 0)
+        queue_delayed_work(info->wq, &info->keepalive, opts.keepalive);
+}
+
+/* Open the data transfer of command <op> on <file> at <offset> on the session
+ * <conn>, which has none, logging in first if needed. On error, negative
+ * value is returned and the session is released. */
+static int ftp_conn_start(struct ftp_info *info, struct ftp_conn_info *conn, const char *op, const char *file, unsigned long offset) {
+    int ret;
+    /* if the session is not established, connect to FTP server */
+    if (conn->control_sock == NULL && (ret = ftp_conn_connect(info, conn)) < 0)
+        goto error0;
+    /* the command stays in the session buffer for the data transfer */
+    if (ftp_conn_cmd(conn, op, file) == NULL) {
+        ret = -ENAMETOOLONG;
+        goto error0;
     }
-    strcpy(tmp_cmd, cmd);
-    tmp_conn->cmd = tmp_cmd;
-    tmp_conn->offset = offset;
-    *conn = tmp_conn;
+    /* open data transfer connection and send the command */
+    ret = ftp_conn_open_data(info, conn, conn->cmd, offset);
+    trace_ftpfs_data_open(conn, conn->cmd, offset, ret);
+    if (ret < 0)
+        goto error0;
+    ftp_stats_inc(&info->stats, FTP_STAT_STREAM_MISS);
+    /* set corresponding <offset> in session info */
+    conn->hash = ftp_stream_hash(file);
+    conn->offset = offset;
+    ftp_conn_prefetch_reset(conn);
     return 0;
 
-error1:
-    ftp_conn_data_close(tmp_conn);
 error0:
-    ftp_release_conn(info, tmp_conn);
+    ftp_release_conn(info, conn);
     return ret;
 }
 
-int ftp_read_file(struct ftp_info *info, const char *file, unsigned long offset, char *buf, unsigned long len) {
-    struct ftp_conn_info *conn;
-    /* prepare command */
-    char *cmd = (char*)kmalloc(strlen(file) + 8, GFP_KERNEL);
+/* Request a session resource. This session should be established and also its
+ * data transfer connection should be created for command <op> on <file> with
+ * offset <offset>. On success, 0 is returned and the session is stored in <conn>. On
+ * error, negative value is returned and <conn> is not affected. */
+static int ftp_request_conn_open_pasv(struct ftp_info *info, struct ftp_conn_info **conn, const char *op, const char *file, unsigned long offset) {
+    struct ftp_conn_info *tmp_conn;
     int ret;
-    if (cmd == NULL) {
-        ret = -ENOMEM;
-        goto error0;
+    /* find a session, which is suitable already if it has a data transfer */
+    ftp_find_conn(info, op, file, offset, &tmp_conn);
+    if (tmp_conn->data_sock == NULL && (ret = ftp_conn_start(info, tmp_conn, op, file, offset)) < 0)
+        return ret;
+    *conn = tmp_conn;
+    return 0;
+}
+
+/* Read maximum <len> bytes at <offset> from the RETR data transfer of a
+ * claimed session, from the prefetch buffer first. <offset> must lie between
+ * the session offset and the end of its prefetched data. Return the number of
+ * bytes read, 0 at end of file, or negative value for error. */
+static int ftp_conn_read(struct ftp_conn_info *conn, unsigned long offset, char *buf, unsigned long len) {
+    int ret;
+    /* skip prefetched data before <offset> */
+    conn->ra_start += offset - conn->offset;
+    conn->offset = offset;
+    if (conn->ra_start < conn->ra_len) {
+        ret = min(len, conn->ra_len - conn->ra_start);
+        memcpy(buf, conn->ra_buf + conn->ra_start, ret);
+        conn->ra_start += ret;
+    } else if (conn->ra_err < 0) {
+        return conn->ra_err;
+    } else if (conn->ra_eof) {
+        ret = 0;
+    } else {
+        ret = sock_recv(conn->data_sock, buf, len);
+        if (ret < 0)
+            return ret;
+        conn->ra_end += ret;
+        ftp_stats_add(conn->stats, FTP_STAT_RX_BYTES, ret);
     }
-    sprintf(cmd, "RETR ./%s", file);
+    if (conn->ra_start == conn->ra_len)
+        conn->ra_start = conn->ra_len = 0;
+    /* increase <offset> in session info */
+    conn->offset += ret;
+    return ret;
+}
+
+int ftp_read_file(struct ftp_info *info, const char *file, unsigned long offset, char *buf, unsigned long len, unsigned long ra) {
+    struct ftp_conn_info *conn;
+    int ret;
     /* request a session */
-    if ((ret = ftp_request_conn_open_pasv(info, &conn, cmd, offset)) < 0)
+    if ((ret = ftp_request_conn_open_pasv(info, &conn, "RETR", file, offset)) < 0)
+        goto error0;
+    ftp_conn_prefetch_window(conn, ra);
+    /* retrive data */
+    if ((ret = ftp_conn_read(conn, offset, buf, len)) < 0)
         goto error1;
-    /* retrive data and increase <offset> in session info */
-    ret = sock_recv(conn->data_sock, buf, len);
-    if (ret < 0)
-        goto error2;
-    conn->offset += ret;
     /* release the session */
     ftp_release_conn(info, conn);
-    kfree(cmd);
+    trace_ftpfs_read(file, offset, len, ret);
     return ret;
 
-error2:
+error1:
     /* on error, data transfer connection is closed */
     ftp_conn_data_close(conn);
     ftp_release_conn(info, conn);
-error1:
-    kfree(cmd);
 error0:
+    trace_ftpfs_read(file, offset, len, ret);
     return ret;
 }
 
-int ftp_write_file(struct ftp_info *info, const char *file, unsigned long offset, const char *buf, unsigned long len) {
-    /* see ftp_read_file() for explanation */
+/* Read the range [<offset>, <offset> + <len>) of file <file> on one session,
+ * less only at end of file. Unless <keep> is set, the transfer is aborted at
+ * the end of the range so that the session is free again, otherwise up to
+ * <ra> following bytes are prefetched. Return the number of bytes read or
+ * negative value for error. */
+static int ftp_read_range(struct ftp_info *info, const char *file, unsigned long offset, char *buf, unsigned long len, int keep, unsigned long ra) {
     struct ftp_conn_info *conn;
-    char *cmd = (char*)kmalloc(strlen(file) + 8, GFP_KERNEL);
+    unsigned long read = 0;
     int ret;
-    if (cmd == NULL) {
-        ret = -ENOMEM;
-        goto error0;
+    if ((ret = ftp_request_conn_open_pasv(info, &conn, "RETR", file, offset)) < 0)
+        goto out;
+    if (keep && ra > 0)
+        ftp_conn_prefetch_window(conn, ra);
+    while (read < len) {
+        if ((ret = ftp_conn_read(conn, offset + read, buf + read, len - read)) <= 0)
+            break;
+        read += ret;
     }
-    sprintf(cmd, "STOR ./%s", file);
-    if ((ret = ftp_request_conn_open_pasv(info, &conn, cmd, offset)) < 0)
-        goto error1;
-    ret = sock_send(conn->data_sock, buf, len);
-    if (ret < 0)
-        goto error2;
-    conn->offset += ret;
+    if (ret < 0 || !keep)
+        ftp_conn_data_close(conn);
     ftp_release_conn(info, conn);
-    kfree(cmd);
-    return ret;
+    if (ret >= 0)
+        ret = read;
 
-error2:
-    ftp_conn_data_close(conn);
-    ftp_release_conn(info, conn);
-error1:
-    kfree(cmd);
-error0:
+out:
+    trace_ftpfs_read(file, offset, len, ret);
     return ret;
 }
 
-void ftp_close_file(struct ftp_info *info, const char *file) {
-    int i;
-    down(&info->mutex);
-    /* all data transfer connections related to <file> is closed */
-    for (i = 0; i < info->max_sock; i++)
-        if (info->conn_list[i].used == 0 && info->conn_list[i].data_sock != NULL
-                && strcmp(info->conn_list[i].cmd + 7, file) == 0) {
-            info->conn_list[i].used = 1;
-            up(&info->mutex);
-            ftp_conn_data_close(&info->conn_list[i]);
-            down(&info->mutex);
-            info->conn_list[i].used = 0;
-        }
-    up(&info->mutex);
+static int ftp_request_read_run(struct ftp_request *req) {
+    if (req->len == 0)
+        return 0;
+    if (req->stripes > 1)
+        return ftp_read_file_striped(req->info, req->file, req->offset, req->buf, req->len, req->stripes);
+    return ftp_read_range(req->info, req->file, req->offset, req->buf, req->len, req->keep, req->ra);
 }
 
-int ftp_read_dir(struct ftp_info *info, const char *path, unsigned long *len, struct ftp_file_info **files) {
-    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-    struct ftp_conn_info *conn;
-    struct ftp_file_info *tmp_files;
-    int ret, i, current_year, year, month, day, hour, min;
-    unsigned long tmp_len, buf_len, tmp;
-    struct timeval time;
-    struct tm tm;
-    char *cmd = (char*)kmalloc(strlen(path) + 12, GFP_KERNEL), *line, *ptr, *next, next_backup;
-    if (cmd == NULL) {
-        ret = -ENOMEM;
-        goto error0;
-    }
-    /* prepare command */
-    sprintf(cmd, "LIST -al ./%s", path);
-    if ((ret = ftp_request_conn_open_pasv(info, &conn, cmd, 0)) < 0)
-        goto error1;
-    /* get current year */
-    /* XXX: due to flaw in FTP protocol, current year at server
-     * side cannot be determined, use that at client side as an approximation */
-    do_gettimeofday(&time);
-    time_to_tm(time.tv_sec, 0, &tm);
-    current_year = tm.tm_year;
+void ftp_request_read(struct ftp_request *req, const char *file, unsigned long offset, char *buf, unsigned long len, int stripes, unsigned long ra) {
+    req->run = ftp_request_read_run;
+    req->file = file;
+    req->offset = offset;
+    req->buf = buf;
+    req->len = len;
+    req->stripes = stripes;
+    /* a sequential reader continues where the read ends */
+    req->keep = 1;
+    req->ra = ra;
+}
 
-    /* allocate an array of 16 elements */
-    tmp_len = 0;
-    buf_len = 16;
-    tmp_files = (struct ftp_file_info*)kmalloc(buf_len * sizeof(struct ftp_file_info), GFP_KERNEL);
-    if (tmp_files == NULL) {
-        ret = -ENOMEM;
-        goto error2;
-    }
-    memset(tmp_files, 0, buf_len * sizeof(struct ftp_file_info));
-    /* read lines from server and parse them */
-    /* XXX: FTP protocol does not specify the format returned for LIST command,
-     * and here we assume the response is of the same format as ls(1) */
-    while ((ret = sock_readline(conn->data_sock, &line)) > 0) {
-        /* buffer full, allocate an array of doubled size and copy data */
-        if (tmp_len == buf_len) {
-            struct ftp_file_info *tmp_files2 = (struct ftp_file_info*)kmalloc(2 * buf_len * sizeof(struct ftp_file_info), GFP_KERNEL);
-            if (tmp_files2 == NULL) {
-                ret = -ENOMEM;
-                goto error3;
-            }
-            memcpy(tmp_files2, tmp_files, buf_len * sizeof(struct ftp_file_info));
-            memset(tmp_files2 + buf_len, 0, buf_len * sizeof(struct ftp_file_info));
-            kfree(tmp_files);
-            tmp_files = tmp_files2;
-            buf_len *= 2;
-        }
+static void ftp_request_work(struct work_struct *work) {
+    struct ftp_request *req = container_of(work, struct ftp_request, work);
+    req->ret = req->run(req);
+    /* <req> may be freed by <done> */
+    if (req->done != NULL)
+        req->done(req);
+    else
+        complete(&req->completion);
+}
 
-        /* read the first 8 fields */
-        ptr = line;
-        for (i = 0; i < 8; i++) {
-            for (; *ptr != 0 && *ptr == ' '; ptr++);
-            if (*ptr == 0) {
-                ret = -EIO;
-                goto error4;
-            }
-            next = ptr;
-            for (; *next != 0 && *next != ' '; next++);
-            next_backup = *next;
-            *next = 0;
-            switch (i) {
-                /* mode */
-                case 0:
-                    if (next - ptr != 10) {
-                        ret = -EIO;
-                        goto error4;
-                    }
-                    if (ptr[0] == 'd') tmp_files[tmp_len].mode |= S_IFDIR;
-                    else if (ptr[0] == 'l') tmp_files[tmp_len].mode |= S_IFLNK;
-                    else tmp_files[tmp_len].mode |= S_IFREG;
-                    if (ptr[1] == 'r') tmp_files[tmp_len].mode |= S_IRUSR;
-                    if (ptr[2] == 'w') tmp_files[tmp_len].mode |= S_IWUSR;
-                    if (ptr[3] == 'x') tmp_files[tmp_len].mode |= S_IXUSR;
-                    if (ptr[4] == 'r') tmp_files[tmp_len].mode |= S_IRGRP;
-                    if (ptr[5] == 'w') tmp_files[tmp_len].mode |= S_IWGRP;
-                    if (ptr[6] == 'x') tmp_files[tmp_len].mode |= S_IXGRP;
-                    if (ptr[7] == 'r') tmp_files[tmp_len].mode |= S_IROTH;
-                    if (ptr[8] == 'w') tmp_files[tmp_len].mode |= S_IWOTH;
-                    if (ptr[9] == 'x') tmp_files[tmp_len].mode |= S_IXOTH;
-                    break;
-                /* number of links */
-                case 1:
-                    if (sscanf(ptr, "%lu", &tmp) < 1) {
-                        ret = -EIO;
-                        goto error4;
-                    }
-                    tmp_files[tmp_len].nlink = tmp;
-                    break;
-                /* owner and group */
-                /* TODO: these fields should be taken into consideration */
-                case 2: case 3:
-                    break;
-                /* file size */
-                case 4:
-                    if (sscanf(ptr, "%lu", &tmp) < 1) {
-                        ret = -EIO;
-                        goto error4;
-                    }
-                    tmp_files[tmp_len].size = tmp;
-                    break;
-                /* month, represented in abbreviated month name */
-                case 5:
-                    if (next - ptr != 3) {
-                        ret = -EIO;
-                        goto error4;
-                    }
-                    month = 0;
-                    for (; month < 12; month++)
-                        if (strcmp(months[month], ptr) == 0)
-                            break;
-                    if (month == 12) {
-                        ret = -EIO;
-                        goto error4;
-                    }
-                    month++;
-                    break;
-                /* day */
-                case 6:
-                    if (sscanf(ptr, "%d", &day) < 1) {
-                        ret = -EIO;
-                        goto error4;
-                    }
-                    break;
-                /* hour:minute if last modification time is in the current
-                 * year, or year */
-                case 7:
-                    if (sscanf(ptr, "%d:%d", &hour, &min) == 2)
-                        year = current_year;
-                    else if (sscanf(ptr, "%d", &year) == 1)
-                        /* XXX: set hour and minute to zero */
-                        hour = min = 0;
-                    else {
-                        ret = -EIO;
-                        goto error4;
-                    }
-                    /* XXX: set second to zero */
-                    tmp_files[tmp_len].mtime = mktime(year, month, day, hour, min, 0);
-                    break;
-            }
-            *next = next_backup;
-            ptr = next;
+void ftp_submit(struct ftp_info *info, struct ftp_request *req, void (*done)(struct ftp_request *req)) {
+    req->info = info;
+    req->done = done;
+    req->ret = 0;
+    init_completion(&req->completion);
+    INIT_WORK(&req->work, ftp_request_work);
+    queue_work(info->wq, &req->work);
+}
+
+int ftp_wait(struct ftp_request *req) {
+    wait_for_completion(&req->completion);
+    return req->ret;
+}
+
+int ftp_read_file_striped(struct ftp_info *info, const char *file, unsigned long offset, char *buf, unsigned long len, int stripes) {
+    struct ftp_request *stripe;
+    unsigned long seg, start;
+    int i, ret;
+    if (stripes > info->max_sock)
+        stripes = info->max_sock;
+    if (stripes < 1)
+        stripes = 1;
+    stripe = (struct ftp_request*)kmalloc(stripes * sizeof(struct ftp_request), GFP_KERNEL);
+    if (stripe == NULL)
+        return -ENOMEM;
+    /* split the range, only the last stripe keeps its transfer open since
+     * a sequential reader continues from there */
+    seg = (len + stripes - 1) / stripes;
+    for (i = 0; i < stripes; i++) {
+        start = min(len, i * seg);
+        ftp_request_read(&stripe[i], file, offset + start, buf + start, min(len, (i + 1) * seg) - start, 1, 0);
+        stripe[i].keep = i == stripes - 1;
+    }
+    /* fetch the stripes at the same time, the first one in the caller */
+    for (i = 1; i < stripes; i++)
+        if (stripe[i].len > 0)
+            ftp_submit(info, &stripe[i], NULL);
+    stripe[0].info = info;
+    stripe[0].ret = ftp_request_read_run(&stripe[0]);
+    for (i = 1; i < stripes; i++)
+        stripe[i].ret = stripe[i].len > 0 ? ftp_wait(&stripe[i]) : 0;
+    /* reassemble: the result is the part read without holes */
+    ret = 0;
+    for (i = 0; i < stripes; i++) {
+        if (stripe[i].ret < 0) {
+            if (ret == 0)
+                ret = stripe[i].ret;
+            break;
         }
+        ret += stripe[i].ret;
+        if (stripe[i].ret < stripe[i].len)
+            break;
+    }
+    pr_debug("striped read of %lu bytes in %d stripes: %d\n", len, stripes, ret);
+    kfree(stripe);
+    return ret;
+}
+
+/* Claim the session of the STOR stream of <file> at <offset>, opening one if
+ * needed. Return 0 with the session in <conn> or negative value for error. */
+static int ftp_stor_conn(struct ftp_info *info, const char *file, unsigned long offset, struct ftp_conn_info **conn) {
+    return ftp_request_conn_open_pasv(info, conn, "STOR", file, offset);
+}
+
+/* Account the result <ret> of a send on the STOR stream of <conn> and release
+ * the session. Return <ret>. */
+static int ftp_stor_sent(struct ftp_info *info, struct ftp_conn_info *conn, const char *file, int ret) {
+    if (ret < 0)
+        ftp_conn_data_close(conn);
+    else {
+        conn->offset += ret;
+        ftp_stats_add(conn->stats, FTP_STAT_TX_BYTES, ret);
+    }
+    ftp_release_conn(info, conn);
+    /* the listed size of the file changes */
+    if (ret >= 0)
+        dir_cache_invalidate_parent(&info->dir_cache, file);
+    return ret;
+}
+
+int ftp_write_file(struct ftp_info *info, const char *file, unsigned long offset, const char *buf, unsigned long len) {
+    struct ftp_conn_info *conn;
+    int ret;
+    if ((ret = ftp_stor_conn(info, file, offset, &conn)) == 0)
+        ret = ftp_stor_sent(info, conn, file, sock_send(conn->data_sock, buf, len));
+    trace_ftpfs_write(file, offset, len, ret);
+    return ret;
+}
+
+/* Ask the size of <file> over the claimed session <conn> into <size>. Return 0
+ * for success, -ENOENT if the file does not exist, -EOPNOTSUPP if the server
+ * does not tell, or negative value for error. */
+static int ftp_conn_size(struct ftp_conn_info *conn, const char *file, unsigned long *size) {
+    char *resp;
+    int ret;
+    if ((ret = ftp_conn_send_cmd(conn, "SIZE", file)) < 0 || (ret = ftp_conn_recv(conn, &resp)) < 0)
+        return ret;
+    if (ret == 213 && sscanf(resp + 4, "%lu", size) == 1)
+        ret = 0;
+    else
+        ret = ret == 550 ? -ENOENT : -EOPNOTSUPP;
+    kfree(resp);
+    return ret;
+}
 
-        /* rest of the line is the name of the file */
-        /* TODO: link */
-        /* XXX: the name is succeeded by '-> target' if the file is a link,
-         * but if the file or target itself contains '->', ambiguity is
-         * present */
-        for (; *ptr != 0 && *ptr == ' '; ptr++);
-        if (*ptr == 0) {
+int ftp_file_size(struct ftp_info *info, const char *file, unsigned long *size) {
+    struct ftp_conn_info *conn;
+    int ret;
+    if (!(info->features & FTP_FEAT_SIZE))
+        return -EOPNOTSUPP;
+    if ((ret = ftp_request_conn(info, &conn)) < 0)
+        return ret;
+    ret = ftp_conn_size(conn, file, size);
+    ftp_release_conn(info, conn);
+    return ret;
+}
+
+int ftp_upload_begin(struct ftp_info *info, const char *file, unsigned long offset, int append, struct ftp_upload *up) {
+    struct ftp_conn_info *conn;
+    int ret;
+    /* the streams of direct writes are completed first, and the others on
+     * the file closed, the session of the upload stays out of the pool */
+    if ((ret = ftp_flush_file(info, file)) < 0)
+        return ret;
+    ftp_close_file(info, file);
+    ftp_find_conn(info, NULL, NULL, 0, &conn);
+    if ((ret = ftp_conn_start(info, conn, append ? "APPE" : "STOR", file, append ? 0 : offset)) < 0)
+        return ret;
+    conn->offset = offset;
+    up->conn = conn;
+    up->offset = offset;
+    return 0;
+}
+
+int ftp_upload_page(struct ftp_info *info, struct ftp_upload *up, const char *file, struct page *page, int pgoff, int len) {
+    int sent = 0, ret = 0;
+    while (sent < len) {
+        if ((ret = sock_send_page(up->conn->data_sock, page, pgoff + sent, len - sent)) <= 0)
+            break;
+        sent += ret;
+    }
+    if (ret == 0 && sent < len)
+        ret = -EIO;
+    trace_ftpfs_write(file, up->offset, len, ret < 0 ? ret : sent);
+    ftp_stats_add(up->conn->stats, FTP_STAT_TX_BYTES, sent);
+    up->offset += sent;
+    up->conn->offset = up->offset;
+    return ret < 0 ? ret : 0;
+}
+
+int ftp_upload_end(struct ftp_info *info, struct ftp_upload *up, const char *file, int ret) {
+    struct ftp_conn_info *conn = up->conn;
+    unsigned long size;
+    if (ret < 0)
+        ftp_conn_data_close(conn);
+    else if ((ret = ftp_conn_data_finish(conn)) == 0 && (info->features & FTP_FEAT_SIZE)) {
+        /* the transfer is confirmed, and the size the server has tells an
+         * upload cut short */
+        if ((ret = ftp_conn_size(conn, file, &size)) == 0 && size < up->offset) {
+            pr_debug("upload of %s cut short at %lu of %lu bytes\n", file, size, up->offset);
             ret = -EIO;
-            goto error4;
+        } else if (ret == -EOPNOTSUPP)
+            ret = 0;
+    }
+    ftp_release_conn(info, conn);
+    /* the listed size of the file changes */
+    dir_cache_invalidate_parent(&info->dir_cache, file);
+    return ret;
+}
+
+int ftp_flush_file(struct ftp_info *info, const char *file) {
+    struct ftp_conn_info *conn;
+    int ret = 0, tmp;
+    while ((conn = ftp_pool_take_stream(info, file, "STOR")) != NULL) {
+        if ((tmp = ftp_conn_data_finish(conn)) < 0)
+            ret = tmp;
+        ftp_release_conn(info, conn);
+    }
+    return ret;
+}
+
+void ftp_close_file(struct ftp_info *info, const char *file) {
+    struct ftp_conn_info *conn;
+    /* all data transfer connections related to <file> is closed */
+    while ((conn = ftp_pool_take_stream(info, file, NULL)) != NULL) {
+        ftp_conn_data_close(conn);
+        ftp_release_conn(info, conn);
+    }
+}
+
+/* Parse <len> digits at <str>, return -1 if there is a non-digit. */
+static int ftp_parse_digits(const char *str, int len) {
+    int i, ret = 0;
+    for (i = 0; i < len; i++) {
+        if (!isdigit(str[i]))
+            return -1;
+        ret = ret * 10 + str[i] - '0';
+    }
+    return ret;
+}
+
+/* Parse a time value "YYYYMMDDHHMMSS[.sss]" in UTC used by MLST and MDTM.
+ * Return 0 for success and -EIO if it is not understood. */
+static int ftp_parse_time(const char *str, time_t *time) {
+    int year, month, day, hour, min, sec;
+    if ((year = ftp_parse_digits(str, 4)) < 0 || (month = ftp_parse_digits(str + 4, 2)) < 0
+            || (day = ftp_parse_digits(str + 6, 2)) < 0 || (hour = ftp_parse_digits(str + 8, 2)) < 0
+            || (min = ftp_parse_digits(str + 10, 2)) < 0 || (sec = ftp_parse_digits(str + 12, 2)) < 0)
+        return -EIO;
+    *time = mktime(year, month, day, hour, min, sec);
+    return 0;
+}
+
+/* Hash the unique id <str> of <len> bytes given by the server (FNV-1a), 0 is
+ * reserved for unknown. */
+static u64 ftp_hash_unique(const char *str, int len) {
+    u64 hash = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/* Parse a line of facts "fact=value;...; name" returned by MLST or MLSD,
+ * storing the facts into <file> except its name, and the pointer to the name
+ * in <line> into <name>. Unknown facts are ignored. Return 0 for success, 1 if
+ * the line describes the listed directory itself or its parent, or -EIO if the
+ * line is not understood. */
+static int ftp_parse_facts(char *line, struct ftp_file_info *file, char **name) {
+    char *fact, *value, *end;
+    int perm = -1, mode = -1, self = 0;
+    memset(file, 0, sizeof(struct ftp_file_info));
+    file->mode = S_IFREG;
+    file->nlink = 1;
+    for (fact = line; *fact == ' '; fact++);
+    /* facts end at the first space */
+    while (*fact != ' ') {
+        for (end = fact; *end != ';' && *end != ' ' && *end != 0; end++);
+        if (*end != ';')
+            return -EIO;
+        for (value = fact; value < end && *value != '='; value++);
+        if (value == end)
+            return -EIO;
+        value++;
+        if (strncasecmp(fact, "type=", 5) == 0) {
+            if (strncasecmp(value, "dir;", 4) == 0)
+                file->mode = S_IFDIR;
+            else if (strncasecmp(value, "cdir;", 5) == 0 || strncasecmp(value, "pdir;", 5) == 0) {
+                file->mode = S_IFDIR;
+                self = 1;
+            }
+            else if (strncasecmp(value, "OS.unix=slink", 13) == 0 || strncasecmp(value, "OS.unix=symlink", 15) == 0)
+                file->mode = S_IFLNK;
+            else
+                file->mode = S_IFREG;
+        } else if (strncasecmp(fact, "size=", 5) == 0) {
+            file->size = simple_strtoul(value, NULL, 10);
+        } else if (strncasecmp(fact, "modify=", 7) == 0) {
+            if (end - value < 14 || ftp_parse_time(value, &file->mtime) < 0)
+                return -EIO;
+        } else if (strncasecmp(fact, "UNIX.mode=", 10) == 0) {
+            mode = simple_strtoul(value, NULL, 8) & 0777;
+        } else if (strncasecmp(fact, "unique=", 7) == 0) {
+            file->unique = ftp_hash_unique(value, end - value);
+        } else if (strncasecmp(fact, "perm=", 5) == 0) {
+            /* permissions of the logged in user, applied to the owner */
+            perm = 0;
+            for (; value < end; value++)
+                switch (tolower(*value)) {
+                    case 'r': case 'l': perm |= S_IRUSR; break;
+                    case 'w': case 'a': case 'c': case 'm': perm |= S_IWUSR; break;
+                    case 'e': perm |= S_IXUSR; break;
+                }
         }
-        next = ptr + strlen(ptr);
-        /* strip line endings */
-        for (; next > ptr && (*(next - 1) == '\r' || *(next - 1) == '\n'); *(--next) = 0);
-        tmp_files[tmp_len].name = kmalloc(strlen(ptr) + 1, GFP_KERNEL);
-        if (tmp_files[tmp_len].name == NULL) {
-            ret = -ENOMEM;
-            goto error4;
+        fact = end + 1;
+        if (*fact == 0)
+            return -EIO;
+    }
+    /* UNIX.mode is exact, perm only gives the owner part */
+    if (mode >= 0)
+        file->mode |= mode;
+    else if (perm >= 0)
+        file->mode |= perm;
+    else
+        file->mode |= S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    if (S_ISDIR(file->mode) && mode < 0)
+        file->mode |= S_IXUSR;
+    *name = fact + 1;
+    return self;
+}
+
+/* Parse the decimal digits at <*ptr> into <val>, advancing <*ptr> past them.
+ * Return the number of digits. */
+static int ftp_parse_number(const char **ptr, unsigned long long *val) {
+    const char *p = *ptr;
+    int digits;
+    *val = 0;
+    for (; *p >= '0' && *p <= '9'; p++)
+        *val = *val * 10 + *p - '0';
+    digits = p - *ptr;
+    *ptr = p;
+    return digits;
+}
+
+/* Return the month 1-12 of the abbreviated month name at <str>, followed by a
+ * space, or 0 if it is not one. */
+static int ftp_parse_month(const char *str) {
+    unsigned int key;
+    if (str[0] == 0 || str[1] == 0 || str[2] == 0 || str[3] != ' ')
+        return 0;
+    /* the three letters folded to lower case, compared at once */
+    key = (str[0] | 0x20) << 16 | (str[1] | 0x20) << 8 | (str[2] | 0x20);
+    switch (key) {
+        case 'j' << 16 | 'a' << 8 | 'n': return 1;
+        case 'f' << 16 | 'e' << 8 | 'b': return 2;
+        case 'm' << 16 | 'a' << 8 | 'r': return 3;
+        case 'a' << 16 | 'p' << 8 | 'r': return 4;
+        case 'm' << 16 | 'a' << 8 | 'y': return 5;
+        case 'j' << 16 | 'u' << 8 | 'n': return 6;
+        case 'j' << 16 | 'u' << 8 | 'l': return 7;
+        case 'a' << 16 | 'u' << 8 | 'g': return 8;
+        case 's' << 16 | 'e' << 8 | 'p': return 9;
+        case 'o' << 16 | 'c' << 8 | 't': return 10;
+        case 'n' << 16 | 'o' << 8 | 'v': return 11;
+        case 'd' << 16 | 'e' << 8 | 'c': return 12;
+    }
+    return 0;
+}
+
+/* Parse the rest of a DOS/IIS listing line after the date at <ptr>,
+ * "HH:MM[AM|PM]  (<DIR>|size) name". */
+static int ftp_parse_dos_line(const char *ptr, int year, int month, int day,
+        struct ftp_file_info *file, const char **name, int *name_len) {
+    unsigned long long hour, min, size;
+    for (; *ptr == ' '; ptr++);
+    if (ftp_parse_number(&ptr, &hour) == 0 || *ptr++ != ':' || ftp_parse_number(&ptr, &min) != 2
+            || hour > 23 || min > 59)
+        return -EIO;
+    /* 12-hour clock if AM or PM follows, 24-hour otherwise */
+    if ((ptr[0] | 0x20) == 'a' || (ptr[0] | 0x20) == 'p') {
+        if ((ptr[1] | 0x20) != 'm' || hour == 0 || hour > 12)
+            return -EIO;
+        hour = hour % 12 + ((ptr[0] | 0x20) == 'p' ? 12 : 0);
+        ptr += 2;
+    }
+    if (*ptr != ' ')
+        return -EIO;
+    for (; *ptr == ' '; ptr++);
+    if (strncmp(ptr, "<DIR>", 5) == 0) {
+        file->mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+        ptr += 5;
+    } else {
+        if (ftp_parse_number(&ptr, &size) == 0)
+            return -EIO;
+        file->mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+        file->size = size;
+    }
+    if (*ptr != ' ')
+        return -EIO;
+    for (; *ptr == ' '; ptr++);
+    if (*ptr == 0)
+        return -EIO;
+    file->nlink = 1;
+    file->mtime = mktime(year, month, day, hour, min, 0);
+    *name = ptr;
+    *name_len = strlen(ptr);
+    return 0;
+}
+
+/* Parse a line returned by LIST in one pass without modifying it, storing the
+ * info into <file> except its name, and the name, which is a part of <line>,
+ * into <name> and <name_len>. Both the format of ls(1), with or without the
+ * group, and the DOS format of IIS "MM-DD-YY HH:MMAM <DIR> name" are
+ * understood. <year> is the current year and <now> the current time, needed
+ * for the dates of ls(1) within the last six months, which have no year.
+ * Return 0 for success, 1 if the line is to be skipped, or -EIO if the line is
+ * not understood. */
+static int ftp_parse_list_line(const char *line, int year, time_t now,
+        struct ftp_file_info *file, const char **name, int *name_len) {
+    unsigned long long nlink, size, day, hour = 0, min = 0, num;
+    const char *ptr = line, *tok, *end;
+    int month, digits;
+    memset(file, 0, sizeof(struct ftp_file_info));
+    /* DOS format, starting with the date "MM-DD-YY" or "MM-DD-YYYY" */
+    if (*ptr >= '0' && *ptr <= '9') {
+        if (ftp_parse_number(&ptr, &num) != 2 || *ptr++ != '-' || (month = num) < 1 || month > 12
+                || ftp_parse_number(&ptr, &day) != 2 || *ptr++ != '-' || day < 1 || day > 31)
+            return -EIO;
+        digits = ftp_parse_number(&ptr, &num);
+        if (digits == 2)
+            num += num < 70 ? 2000 : 1900;
+        else if (digits != 4)
+            return -EIO;
+        return ftp_parse_dos_line(ptr, num, month, day, file, name, name_len);
+    }
+    /* mode, e.g. "drwxr-xr-x", possibly followed by '+', '.' or '@' for ACLs
+     * and extended attributes; anything else, e.g. "total 42", is skipped */
+    for (end = ptr; *end != ' ' && *end != 0; end++);
+    if (end - ptr != 10 && (end - ptr != 11 || strchr("+.@", ptr[10]) == NULL))
+        return 1;
+    if (ptr[0] == 'd') file->mode = S_IFDIR;
+    else if (ptr[0] == 'l') file->mode = S_IFLNK;
+    else if (strchr("-bcps", ptr[0]) != NULL) file->mode = S_IFREG;
+    else return 1;
+    if (ptr[1] == 'r') file->mode |= S_IRUSR;
+    if (ptr[2] == 'w') file->mode |= S_IWUSR;
+    if (ptr[3] == 'x' || ptr[3] == 's') file->mode |= S_IXUSR;
+    if (ptr[4] == 'r') file->mode |= S_IRGRP;
+    if (ptr[5] == 'w') file->mode |= S_IWGRP;
+    if (ptr[6] == 'x' || ptr[6] == 's') file->mode |= S_IXGRP;
+    if (ptr[7] == 'r') file->mode |= S_IROTH;
+    if (ptr[8] == 'w') file->mode |= S_IWOTH;
+    if (ptr[9] == 'x' || ptr[9] == 't') file->mode |= S_IXOTH;
+    /* number of links */
+    ptr = end;
+    for (; *ptr == ' '; ptr++);
+    if (ftp_parse_number(&ptr, &nlink) == 0 || *ptr != ' ')
+        return -EIO;
+    file->nlink = nlink;
+    /* owner, then the group unless the size follows directly, which is told
+     * by the month after it */
+    for (; *ptr == ' '; ptr++);
+    for (; *ptr != ' '; ptr++)
+        if (*ptr == 0)
+            return -EIO;
+    for (; *ptr == ' '; ptr++);
+    tok = ptr;
+    for (end = tok; *end != ' '; end++)
+        if (*end == 0)
+            return -EIO;
+    for (ptr = end; *ptr == ' '; ptr++);
+    if ((month = ftp_parse_month(ptr)) == 0) {
+        tok = ptr;
+        for (end = tok; *end != ' '; end++)
+            if (*end == 0)
+                return -EIO;
+        for (ptr = end; *ptr == ' '; ptr++);
+        if ((month = ftp_parse_month(ptr)) == 0)
+            return -EIO;
+    }
+    if (ftp_parse_number(&tok, &size) == 0 || tok != end)
+        return -EIO;
+    file->size = size;
+    /* day, then "HH:MM" in the last six months or the year */
+    for (ptr += 3; *ptr == ' '; ptr++);
+    if (ftp_parse_number(&ptr, &day) == 0 || day < 1 || day > 31 || *ptr != ' ')
+        return -EIO;
+    for (; *ptr == ' '; ptr++);
+    if (ftp_parse_number(&ptr, &num) == 0)
+        return -EIO;
+    if (*ptr == ':') {
+        hour = num;
+        ptr++;
+        if (ftp_parse_number(&ptr, &min) != 2 || hour > 23 || min > 59)
+            return -EIO;
+        file->mtime = mktime(year, month, day, hour, min, 0);
+        /* a date in the future, allowing for clock skew, is of last year */
+        if (file->mtime > now + 86400)
+            file->mtime = mktime(year - 1, month, day, hour, min, 0);
+    } else
+        file->mtime = mktime(num, month, day, 0, 0, 0);
+    if (*ptr != ' ')
+        return -EIO;
+    /* the rest of the line is the name, followed by " -> target" for a
+     * link, which is ambiguous if the name itself contains " -> " */
+    for (; *ptr == ' '; ptr++);
+    if (*ptr == 0)
+        return -EIO;
+    *name = ptr;
+    if (S_ISLNK(file->mode) && (end = strstr(ptr, " -> ")) != NULL)
+        *name_len = end - ptr;
+    else
+        *name_len = strlen(ptr);
+    return 0;
+}
+
+/* A listing read from the data transfer of a session. */
+struct ftp_list_reader {
+    struct ftp_conn_info *conn;
+    int mlsd;
+    /* Current year and time, for the dates of LIST lines without a year */
+    int year;
+    time_t now;
+};
+
+/* The command listing a directory, MLSD if the server supports it, whose
+ * facts are exact and in UTC, or LIST otherwise. */
+static const char* ftp_list_op(struct ftp_info *info) {
+    return info->features & FTP_FEAT_MLST ? "MLSD" : "LIST -al";
+}
+
+static void ftp_list_reader_init(struct ftp_list_reader *rd, struct ftp_conn_info *conn) {
+    struct timeval time;
+    struct tm tm;
+    rd->conn = conn;
+    rd->mlsd = strncmp(conn->cmd, "MLSD", 4) == 0;
+    /* as the year at the server cannot be determined, that at client side is
+     * an approximation */
+    do_gettimeofday(&time);
+    time_to_tm(time.tv_sec, 0, &tm);
+    rd->year = tm.tm_year + 1900;
+    rd->now = time.tv_sec;
+}
+
+/* Read the next file of the listing into <file>, except its name, which is
+ * stored in <name> and <len> as a part of the line read; the directory itself
+ * and its parent are skipped. Return the number of bytes of the line, which
+ * can be given back by sock_reader_unread(), 0 at the end of the listing, or
+ * negative value for error. */
+static int ftp_list_next(struct ftp_list_reader *rd, struct ftp_file_info *file, const char **name, int *len) {
+    char *line, *fact_name;
+    int ret, line_len;
+    while ((line_len = sock_reader_line(&rd->conn->data_rd, &line)) > 0) {
+        ftp_stats_add(rd->conn->stats, FTP_STAT_RX_BYTES, line_len);
+        if (rd->mlsd) {
+            ret = ftp_parse_facts(line, file, &fact_name);
+            *name = fact_name;
+            *len = strlen(fact_name);
+        } else
+            ret = ftp_parse_list_line(line, rd->year, rd->now, file, name, len);
+        if (ret < 0) {
+            pr_debug("cannot parse listing line: %s\n", line);
+            return ret;
         }
-        strcpy(tmp_files[tmp_len].name, ptr);
-        tmp_len++;
-        /* free the space */
-        kfree(line);
+        if (ret == 0 && !((*name)[0] == '.' && (*len == 1 || (*len == 2 && (*name)[1] == '.'))))
+            return line_len;
+    }
+    return line_len;
+}
+
+/* Files collected from a listing: <len> files in an array of <size>, and the
+ * chunks of their names. */
+struct ftp_file_list {
+    struct ftp_file_info *files;
+    unsigned long len, size;
+    struct ftp_names *names;
+    /* Generation of the listing cache when the listing started */
+    unsigned long gen;
+};
+
+/* Append <file> named <name> of <len> bytes to <list>, doubling the array when
+ * it is full. Return 0 or -ENOMEM. */
+static int ftp_file_list_add(struct ftp_file_list *list, const struct ftp_file_info *file, const char *name, int len) {
+    struct ftp_file_info *files;
+    if (list->len == list->size) {
+        files = (struct ftp_file_info*)kmalloc(2 * list->size * sizeof(struct ftp_file_info), GFP_KERNEL);
+        if (files == NULL)
+            return -ENOMEM;
+        memcpy(files, list->files, list->len * sizeof(struct ftp_file_info));
+        kfree(list->files);
+        list->files = files;
+        list->size *= 2;
+    }
+    list->files[list->len] = *file;
+    if ((list->files[list->len].name = ftp_names_add(&list->names, name, len)) == NULL)
+        return -ENOMEM;
+    list->len++;
+    return 0;
+}
+
+/* Start an empty list with room for 16 files. Return 0 or -ENOMEM. */
+static int ftp_file_list_init(struct ftp_file_list *list) {
+    list->len = 0;
+    list->size = 16;
+    list->names = NULL;
+    list->files = (struct ftp_file_info*)kmalloc(list->size * sizeof(struct ftp_file_info), GFP_KERNEL);
+    return list->files != NULL ? 0 : -ENOMEM;
+}
+
+static void ftp_file_list_free(struct ftp_file_list *list) {
+    kfree(list->files);
+    ftp_names_free(list->names);
+    list->files = NULL;
+    list->names = NULL;
+}
+
+/* Drop the files collected from the listing in transfer on <conn>. */
+static void ftp_conn_listing_free(struct ftp_conn_info *conn) {
+    if (conn->listing == NULL)
+        return;
+    ftp_file_list_free(conn->listing);
+    kfree(conn->listing);
+    conn->listing = NULL;
+}
+
+/* Cache the complete listing <list> of directory <path>, unless the cache was
+ * invalidated since <gen> was read. The list is taken over. Return 0 or
+ * -ENOMEM. */
+static int ftp_list_cache(struct ftp_info *info, const char *path, struct ftp_file_list *list,
+        unsigned long gen, struct ftp_dir_info **dir) {
+    if ((*dir = ftp_dir_alloc(path, list->len, list->files, list->names)) == NULL) {
+        ftp_file_list_free(list);
+        return -ENOMEM;
     }
+    dir_cache_add(&info->dir_cache, *dir, gen);
+    return 0;
+}
+
+/* List the directory <path> on the server into <list>, see ftp_read_dir(). */
+static int ftp_list_dir(struct ftp_info *info, const char *path, struct ftp_file_list *list) {
+    struct ftp_conn_info *conn;
+    struct ftp_list_reader rd;
+    struct ftp_file_info file;
+    const char *name;
+    int ret, len;
+    if ((ret = ftp_request_conn_open_pasv(info, &conn, ftp_list_op(info), path, 0)) < 0)
+        goto error0;
+    if ((ret = ftp_file_list_init(list)) < 0)
+        goto error1;
+    /* read lines from server and parse them */
+    ftp_stats_inc(&info->stats, FTP_STAT_LISTING);
+    ftp_list_reader_init(&rd, conn);
+    while ((ret = ftp_list_next(&rd, &file, &name, &len)) > 0)
+        if ((ret = ftp_file_list_add(list, &file, name, len)) < 0)
+            goto error2;
     if (ret < 0)
-        goto error3;
+        goto error2;
 
     /* finalization, close data connection */
-    if ((ret = ftp_conn_recv(conn, NULL)) != 226) {
-        ret = -EIO;
-        goto error3;
-    }
-    ftp_conn_data_close(conn);
-    kfree(cmd);
-    *files = tmp_files;
-    *len = tmp_len;
+    if ((ret = ftp_conn_data_finish(conn)) < 0)
+        goto error2;
     ftp_release_conn(info, conn);
     return 0;
 
-error4:
-    kfree(line);
-error3:
-    ftp_file_info_destroy(tmp_len, tmp_files);
 error2:
+    ftp_file_list_free(list);
+error1:
     ftp_conn_data_close(conn);
     ftp_release_conn(info, conn);
-error1:
-    kfree(cmd);
 error0:
     return ret;
 }
 
-int ftp_rename(struct ftp_info *info, const char *oldpath, const char *newpath) {
+int ftp_read_dir(struct ftp_info *info, const char *path, struct ftp_dir_info **dir) {
+    struct ftp_file_list list;
+    unsigned long gen;
+    int ret;
+    if ((*dir = dir_cache_get(&info->dir_cache, path)) != NULL) {
+        pr_debug("listing of %s found in cache\n", path);
+        ftp_stats_inc(&info->stats, FTP_STAT_LISTING_HIT);
+        return 0;
+    }
+    gen = ACCESS_ONCE(info->dir_cache.gen);
+    if ((ret = ftp_list_dir(info, path, &list)) < 0)
+        return ret;
+    return ftp_list_cache(info, path, &list, gen, dir);
+}
+
+int ftp_iterate_dir(struct ftp_info *info, const char *path, unsigned long pos, ftp_dir_actor actor, void *data) {
     struct ftp_conn_info *conn;
-    char *cmd;
-    int bufsize, tmp, ret;
-    bufsize = strlen(oldpath) + 8;
-    tmp = strlen(newpath) + 8;
-    if (tmp > bufsize) bufsize = tmp;
-    if ((cmd = kmalloc(bufsize, GFP_KERNEL)) == NULL) {
-        ret = -ENOMEM;
-        goto error0;
+    struct ftp_list_reader rd;
+    struct ftp_file_info file;
+    struct ftp_file_list *list;
+    struct ftp_dir_info *dir;
+    unsigned long i, gen, count = 0, skipped = 0;
+    int ret, len, resumed, retried = 0;
+    const char *name, *op = ftp_list_op(info);
+    /* a cached listing is iterated over at once */
+    if ((dir = dir_cache_get(&info->dir_cache, path)) != NULL) {
+        ftp_stats_inc(&info->stats, FTP_STAT_LISTING_HIT);
+        for (i = pos; i < dir->len; i++, count++)
+            if (actor(data, &dir->files[i], dir->files[i].name, strlen(dir->files[i].name)))
+                break;
+        ftp_dir_put(dir);
+        return count;
     }
-    /* request a session */
-    if ((ret = ftp_request_conn(info, &conn)) < 0)
-        goto error1;
-    /* first piece of command */
-    sprintf(cmd, "RNFR ./%s", oldpath);
-    if ((ret = ftp_conn_send(conn, cmd)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 350) {
-        if (ret >= 0)
-            ret = -EPERM;
-        goto error2;
+    gen = ACCESS_ONCE(info->dir_cache.gen);
+
+again:
+    /* continue the listing left idle by the previous call if it stopped at
+     * <pos>, otherwise start it over and skip <pos> files */
+    ftp_find_conn(info, op, path, pos, &conn);
+    resumed = conn->data_sock != NULL;
+    if (!resumed) {
+        if ((ret = ftp_conn_start(info, conn, op, path, 0)) < 0)
+            return ret;
+        ftp_stats_inc(&info->stats, FTP_STAT_LISTING);
+        /* the files are collected along, whichever calls read them, to cache
+         * the listing at its end if it is small */
+        if (info->dir_cache.ttl > 0) {
+            if ((conn->listing = (struct ftp_file_list*)kmalloc(sizeof(struct ftp_file_list), GFP_KERNEL)) == NULL
+                    || ftp_file_list_init(conn->listing) < 0) {
+                kfree(conn->listing);
+                conn->listing = NULL;
+                ret = -ENOMEM;
+                goto error1;
+            }
+            conn->listing->gen = gen;
+        }
     }
-    /* second piece */
-    sprintf(cmd, "RNTO ./%s", newpath);
-    if ((ret = ftp_conn_send(conn, cmd)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 250) {
-        if (ret >= 0)
-            ret = -EPERM;
-        goto error2;
+    ftp_list_reader_init(&rd, conn);
+    while ((ret = ftp_list_next(&rd, &file, &name, &len)) > 0) {
+        if (conn->offset < pos)
+            skipped++;
+        else if (actor(data, &file, name, len)) {
+            /* the file is read again by the next call */
+            sock_reader_unread(&conn->data_rd, ret);
+            ftp_stats_add(&info->stats, FTP_STAT_RX_BYTES, -ret);
+            ftp_stats_add(&info->stats, FTP_STAT_LISTING_SKIP, skipped);
+            ftp_release_conn(info, conn);
+            return count;
+        } else
+            count++;
+        conn->offset++;
+        if (conn->listing != NULL && (conn->listing->len == DIR_CACHE_FILES
+                    || ftp_file_list_add(conn->listing, &file, name, len) < 0))
+            ftp_conn_listing_free(conn);
+    }
+    ftp_stats_add(&info->stats, FTP_STAT_LISTING_SKIP, skipped);
+    /* the listing outlives the transfer if it is complete */
+    list = conn->listing;
+    conn->listing = NULL;
+    if (ret < 0 || (ret = ftp_conn_data_finish(conn)) < 0) {
+        if (list != NULL) {
+            ftp_file_list_free(list);
+            kfree(list);
+        }
+        /* a listing left idle may have been dropped by the server meanwhile */
+        if (resumed && count == 0 && !retried) {
+            retried = 1;
+            ftp_conn_data_close(conn);
+            ftp_release_conn(info, conn);
+            goto again;
+        }
+        goto error1;
     }
-    kfree(cmd);
     ftp_release_conn(info, conn);
-    return 0;
+    if (list != NULL) {
+        if (ftp_list_cache(info, path, list, list->gen, &dir) == 0)
+            ftp_dir_put(dir);
+        kfree(list);
+    }
+    return count;
 
-error2:
-    ftp_release_conn(info, conn);
 error1:
-    kfree(cmd);
-error0:
+    ftp_conn_data_close(conn);
+    ftp_release_conn(info, conn);
     return ret;
 }
 
-int ftp_create_file(struct ftp_info *info, const char *file) {
-    /* see ftp_read_file() for further explanation */
-    struct ftp_conn_info *conn;
-    char *cmd;
+/* Keep the facts line of an MLST response in the buffer <data>. */
+static void ftp_keep_facts(void *data, char *line) {
+    char **facts = data;
+    if (*facts == NULL && (*facts = kmalloc(strlen(line) + 1, GFP_KERNEL)) != NULL)
+        strcpy(*facts, line);
+}
+
+/* Whether the reply <code> tells the command is not understood, rather than
+ * it failed. */
+static int ftp_not_understood(int code) {
+    return code == 500 || code == 501 || code == 502 || code == 504;
+}
+
+/* Get the login directory of the sessions, asked by PWD over <conn> the first
+ * time, into <home>. Return 0 for success, -EOPNOTSUPP if the server does not
+ * tell, or other negative value for error. */
+static int ftp_home(struct ftp_info *info, struct ftp_conn_info *conn, const char **home) {
+    char *resp = NULL, *dir, *src, *dst;
     int ret;
-    if ((cmd = kmalloc(strlen(file) + 8, GFP_KERNEL)) == NULL) {
+    spin_lock(&info->lock);
+    *home = info->home;
+    spin_unlock(&info->lock);
+    if (*home != NULL)
+        return 0;
+    if ((ret = ftp_conn_send(conn, "PWD")) < 0 || (ret = ftp_conn_recv(conn, &resp)) < 0)
+        return ret;
+    /* 257 "dir" comment, with the quotes in dir doubled */
+    if (ret != 257 || (src = strchr(resp, '"')) == NULL) {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+    if ((dir = (char*)kmalloc(strlen(src), GFP_KERNEL)) == NULL) {
         ret = -ENOMEM;
-        goto error0;
+        goto out;
     }
-    sprintf(cmd, "STOR ./%s", file);
-    if ((ret = ftp_request_conn_open_pasv(info, &conn, cmd, 0)) < 0)
-        goto error1;
-    ftp_conn_data_close(conn);
-    if ((ret = ftp_conn_recv(conn, NULL)) != 226) {
-        if (ret >= 0)
-            ret = -EIO;
-        goto error2;
+    for (dst = dir, src++; *src != 0 && (*src != '"' || src[1] == '"'); src++)
+        *dst++ = *src == '"' ? *src++ : *src;
+    *dst = 0;
+    if (*src != '"' || strlen(dir) + 5 > FTP_CMD_SIZE) {
+        kfree(dir);
+        ret = -EOPNOTSUPP;
+        goto out;
     }
-    kfree(cmd);
-    ftp_release_conn(info, conn);
+    spin_lock(&info->lock);
+    if (info->home == NULL) {
+        info->home = dir;
+        dir = NULL;
+    }
+    *home = info->home;
+    spin_unlock(&info->lock);
+    kfree(dir);
+    ret = 0;
+
+out:
+    kfree(resp);
+    return ret;
+}
+
+/* Tell whether the path in the command "SIZE ./path" built in the buffer of
+ * <conn>, which SIZE did not find as a regular file, is a directory by CWD,
+ * then go back to the login directory. Fill <fi> and return 0 for a directory,
+ * -ENOENT if there is none, -EOPNOTSUPP if the server cannot tell, or other
+ * negative value for error. */
+static int ftp_stat_dir(struct ftp_info *info, struct ftp_conn_info *conn, struct ftp_file_info *fi) {
+    const char *home;
+    int ret;
+    if ((ret = ftp_home(info, conn, &home)) < 0)
+        return ret;
+    memmove(conn->cmd + 4, conn->cmd + 5, strlen(conn->cmd + 5) + 1);
+    memcpy(conn->cmd, "CWD ", 4);
+    if ((ret = ftp_conn_send(conn, conn->cmd)) < 0 || (ret = ftp_conn_recv(conn, NULL)) < 0)
+        return ret;
+    if (ret == 550)
+        return -ENOENT;
+    if (ret != 250)
+        return ftp_not_understood(ret) ? -EOPNOTSUPP : -EIO;
+    /* the paths of the session are relative to the login directory */
+    sprintf(conn->cmd, "CWD %s", home);
+    if ((ret = ftp_conn_send(conn, conn->cmd)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 250) {
+        ftp_conn_drop(conn);
+        return ret < 0 ? ret : -EIO;
+    }
+    memset(fi, 0, sizeof(struct ftp_file_info));
+    fi->mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    fi->nlink = 2;
     return 0;
+}
 
-error2:
+/* Ask the server for the info of the single file <name> in directory <dir>
+ * over the control connection, by MLST, or SIZE and MDTM. Return 0 for success, -ENOENT if it
+ * does not exist, -EOPNOTSUPP if the server cannot tell, or other negative
+ * value for error. */
+static int ftp_stat_remote(struct ftp_info *info, const char *dir, const char *name, struct ftp_file_info *fi) {
+    struct ftp_conn_info *conn;
+    char *resp = NULL, *fact_name;
+    unsigned long size;
+    int ret;
+    if (!(info->features & (FTP_FEAT_MLST | FTP_FEAT_SIZE)))
+        return -EOPNOTSUPP;
+    if ((ret = ftp_request_conn(info, &conn)) < 0)
+        return ret;
+    /* the command is built once in the session buffer, MLST, SIZE and MDTM
+     * are of the same length */
+    if (snprintf(conn->cmd, FTP_CMD_SIZE, "MLST ./%s%s%s", dir, strcmp(dir, "/") == 0 ? "" : "/", name) >= FTP_CMD_SIZE) {
+        ret = -ENAMETOOLONG;
+        goto out;
+    }
+    if (info->features & FTP_FEAT_MLST) {
+        if ((ret = ftp_conn_send(conn, conn->cmd)) < 0 || (ret = ftp_conn_recv_lines(conn, NULL, ftp_keep_facts, &resp)) < 0)
+            goto out;
+        if (ret == 550)
+            ret = -ENOENT;
+        else if (ftp_not_understood(ret))
+            ret = -EOPNOTSUPP;
+        else if (ret != 250 || resp == NULL || ftp_parse_facts(resp, fi, &fact_name) < 0)
+            ret = -EIO;
+        else
+            ret = 0;
+        goto out;
+    }
+    /* SIZE only works on regular files, CWD tells a directory from a missing
+     * file */
+    memcpy(conn->cmd, "SIZE", 4);
+    if ((ret = ftp_conn_send(conn, conn->cmd)) < 0 || (ret = ftp_conn_recv(conn, &resp)) < 0)
+        goto out;
+    if (ret == 550) {
+        ret = ftp_stat_dir(info, conn, fi);
+        goto out;
+    }
+    if (ret != 213 || sscanf(resp + 4, "%lu", &size) < 1) {
+        ret = ret == 213 || ftp_not_understood(ret) ? -EOPNOTSUPP : -EIO;
+        goto out;
+    }
+    kfree(resp);
+    resp = NULL;
+    memset(fi, 0, sizeof(struct ftp_file_info));
+    fi->mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    fi->nlink = 1;
+    fi->size = size;
+    if (info->features & FTP_FEAT_MDTM) {
+        memcpy(conn->cmd, "MDTM", 4);
+        if ((ret = ftp_conn_send(conn, conn->cmd)) < 0 || (ret = ftp_conn_recv(conn, &resp)) < 0)
+            goto out;
+        if (ret == 213 && strlen(resp) >= 18)
+            ftp_parse_time(resp + 4, &fi->mtime);
+    }
+    ret = 0;
+
+out:
+    if (resp != NULL)
+        kfree(resp);
     ftp_release_conn(info, conn);
-error1:
-    kfree(cmd);
-error0:
     return ret;
 }
 
-int ftp_remove_file(struct ftp_info *info, const char *file) {
-    /* see ftp_rename() for explanation */
-    struct ftp_conn_info *conn;
-    char *cmd;
+int ftp_stat(struct ftp_info *info, const char *dir, const char *name, struct ftp_file_info *file) {
+    struct ftp_dir_info *listing;
+    struct ftp_file_info *found;
     int ret;
-    if ((cmd = kmalloc(strlen(file) + 8, GFP_KERNEL)) == NULL) {
-        ret = -ENOMEM;
-        goto error0;
+    ftp_stats_inc(&info->stats, FTP_STAT_LOOKUP);
+    /* a cached listing answers at once */
+    if ((listing = dir_cache_get(&info->dir_cache, dir)) != NULL)
+        ftp_stats_inc(&info->stats, FTP_STAT_LISTING_HIT);
+    else {
+        ret = ftp_stat_remote(info, dir, name, file);
+        if (ret != -EOPNOTSUPP) {
+            pr_debug("stat of %s in %s: %d\n", name, dir, ret);
+            return ret;
+        }
+        /* fall back to listing the whole directory */
+        if ((ret = ftp_read_dir(info, dir, &listing)) < 0)
+            return ret;
     }
-    sprintf(cmd, "DELE ./%s", file);
+    ret = -ENOENT;
+    if ((found = ftp_dir_find(listing, name, strlen(name))) != NULL) {
+        *file = *found;
+        file->name = NULL;
+        ret = 0;
+    }
+    ftp_dir_put(listing);
+    return ret;
+}
+
+int ftp_rename(struct ftp_info *info, const char *oldpath, const char *newpath) {
+    struct ftp_conn_info *conn;
+    int ret;
+    /* request a session */
     if ((ret = ftp_request_conn(info, &conn)) < 0)
+        goto error0;
+    /* first piece of command */
+    if ((ret = ftp_conn_send_cmd(conn, "RNFR", oldpath)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 350) {
+        if (ret >= 0)
+            ret = -EPERM;
         goto error1;
-    if ((ret = ftp_conn_send(conn, cmd)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 250) {
+    }
+    /* second piece */
+    if ((ret = ftp_conn_send_cmd(conn, "RNTO", newpath)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 250) {
         if (ret >= 0)
             ret = -EPERM;
-        goto error2;
+        goto error1;
     }
-    kfree(cmd);
     ftp_release_conn(info, conn);
+    /* paths under a renamed directory also change */
+    dir_cache_clear(&info->dir_cache);
     return 0;
 
-error2:
-    ftp_release_conn(info, conn);
 error1:
-    kfree(cmd);
+    ftp_release_conn(info, conn);
 error0:
     return ret;
 }
 
-int ftp_create_dir(struct ftp_info *info, const char *path) {
-    /* see ftp_rename() for explanation */
+int ftp_create_file(struct ftp_info *info, const char *file) {
+    /* see ftp_read_file() for further explanation */
     struct ftp_conn_info *conn;
-    char *cmd;
     int ret;
-    if ((cmd = kmalloc(strlen(path) + 7, GFP_KERNEL)) == NULL) {
-        ret = -ENOMEM;
+    if ((ret = ftp_request_conn_open_pasv(info, &conn, "STOR", file, 0)) < 0)
         goto error0;
-    }
-    sprintf(cmd, "MKD ./%s", path);
-    if ((ret = ftp_request_conn(info, &conn)) < 0)
+    /* an empty transfer creates the file */
+    if ((ret = ftp_conn_data_finish(conn)) < 0)
         goto error1;
-    if ((ret = ftp_conn_send(conn, cmd)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 257) {
-        if (ret >= 0)
-            ret = -EPERM;
-        goto error2;
-    }
-    kfree(cmd);
     ftp_release_conn(info, conn);
+    dir_cache_invalidate_parent(&info->dir_cache, file);
     return 0;
 
-error2:
-    ftp_release_conn(info, conn);
 error1:
-    kfree(cmd);
+    ftp_release_conn(info, conn);
 error0:
     return ret;
 }
 
-int ftp_remove_dir(struct ftp_info *info, const char *path) {
-    /* see ftp_rename() for explanation */
+/* Run the command <op> on <path> over the control connection of a session,
+ * which succeeds with the reply <code>. Return 0 for success and negative
+ * value for error. */
+static int ftp_path_op(struct ftp_info *info, const char *op, const char *path, int code) {
     struct ftp_conn_info *conn;
-    char *cmd;
     int ret;
-    if ((cmd = kmalloc(strlen(path) + 7, GFP_KERNEL)) == NULL) {
-        ret = -ENOMEM;
-        goto error0;
-    }
-    sprintf(cmd, "RMD ./%s", path);
     if ((ret = ftp_request_conn(info, &conn)) < 0)
-        goto error1;
-    if ((ret = ftp_conn_send(conn, cmd)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != 250) {
+        return ret;
+    if ((ret = ftp_conn_send_cmd(conn, op, path)) < 0 || (ret = ftp_conn_recv(conn, NULL)) != code) {
         if (ret >= 0)
             ret = -EPERM;
-        goto error2;
-    }
-    kfree(cmd);
+    } else
+        ret = 0;
     ftp_release_conn(info, conn);
+    return ret;
+}
+
+int ftp_remove_file(struct ftp_info *info, const char *file) {
+    int ret;
+    if ((ret = ftp_path_op(info, "DELE", file, 250)) < 0)
+        return ret;
+    dir_cache_invalidate_parent(&info->dir_cache, file);
     return 0;
+}
 
-error2:
-    ftp_release_conn(info, conn);
-error1:
-    kfree(cmd);
-error0:
-    return ret;
+int ftp_create_dir(struct ftp_info *info, const char *path) {
+    int ret;
+    if ((ret = ftp_path_op(info, "MKD", path, 257)) < 0)
+        return ret;
+    dir_cache_invalidate_parent(&info->dir_cache, path);
+    return 0;
+}
+
+int ftp_remove_dir(struct ftp_info *info, const char *path) {
+    int ret;
+    if ((ret = ftp_path_op(info, "RMD", path, 250)) < 0)
+        return ret;
+    dir_cache_invalidate_parent(&info->dir_cache, path);
+    dir_cache_invalidate(&info->dir_cache, path);
+    return 0;
 }
@@ -1,32 +1,107 @@
 /*
  * FTP side functions and data types.
  * On FTP side, max_sock sessions are maintained and upon receiving a
- * request, a session is chosen with a certain strategy.
+ * request, a session is chosen with a certain strategy: an idle session whose
+ * data transfer continues at the requested offset is found in a hash table,
+ * otherwise a session without data transfer is taken from the idle list.
  */
 #ifndef _FTP_H
 #define _FTP_H
 #include <linux/net.h>
 #include <linux/in.h>
-#include <linux/semaphore.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/limits.h>
+#include "dircache.h"
+#include "sock.h"
+#include "stats.h"
+
+struct ftp_file_list;
+
+/* Number of bits of the hash table of idle data transfers */
+#define FTP_STREAM_BITS 6
+/* Maximum number of commands sent at once whose replies are timed */
+#define FTP_PIPELINE 4
+/* Size of the command buffer of a session, for a command on a path of up to
+ * PATH_MAX bytes */
+#define FTP_CMD_SIZE (PATH_MAX + 16)
 
 /* Information about a FTP session. */
 struct ftp_conn_info {
     /* Control socket (NULL if no session),
      * and data socket (NULL if no data transfer) */
     struct socket *control_sock, *data_sock;
-    /* Command for opening data transfer (NULL if no data transfer) */
+    /* Buffer of FTP_CMD_SIZE bytes holding the command of the data transfer
+     * while there is one, otherwise the last command built in the session */
     char *cmd;
     /* Offset number in data transfer */
     unsigned long offset;
-    /* Mark if it is currently in use */
-    int used;
+    /* Entry in the idle list or the stream list of the pool, empty while the
+     * session is in use */
+    struct list_head list;
+    /* Entry in the stream table of the pool while the session is idle with a
+     * data transfer, and the hash of the file transferred */
+    struct hlist_node node;
+    unsigned int hash;
+    /* Time when the session was last released */
+    unsigned long last_used;
+    /* Buffered readers of the control socket and the data socket */
+    struct sock_reader control_rd, data_rd;
+    /* Prefetch buffer of <ra_size> bytes, filled in background from the data
+     * socket while the session is idle. Bytes [ra_start, ra_len) of it are
+     * the data at <offset>, and <ra_end> is the offset following them. */
+    char *ra_buf;
+    unsigned long ra_size, ra_start, ra_len, ra_end;
+    /* Number of bytes to keep prefetched, 0 for no prefetching */
+    unsigned long ra_window;
+    /* End of stream or error met by prefetching, and the flag asking the
+     * prefetch work to stop */
+    int ra_eof, ra_err, ra_stop;
+    struct work_struct ra_work;
+    /* Statistics of the mount, and the commands waiting for a reply with the
+     * time they were sent */
+    struct ftp_stats *stats;
+    unsigned char pending[FTP_PIPELINE];
+    int npending;
+    ktime_t sent;
+    /* Files of the directory listing in transfer read so far, collected
+     * across the calls continuing it to be cached at its end, NULL if it is
+     * not to be cached, see ftp_iterate_dir() */
+    struct ftp_file_list *listing;
+};
+
+/* Tunables of a mount, set from mount options. Times are in jiffies and sizes
+ * in bytes. */
+struct ftp_options {
+    /* Socket buffer sizes of data connections, 0 for the system default */
+    int rcvbuf, sndbuf;
+    /* Time during which attributes and directory listings are trusted */
+    unsigned long attr_ttl, dir_ttl;
+    /* Bounds of the window prefetched after sequential reads */
+    unsigned long ra_min, ra_max;
+    /* Number of ranges a large read is split into, 1 for no striping */
+    int stripes;
+    /* Number of sessions logged in at mount and kept logged in */
+    int warm;
+    /* Interval of NOOPs sent on idle sessions, 0 for no keepalive */
+    unsigned long keepalive;
 };
 
 /* Global information about the FTP side status. */
 struct ftp_info {
-    /* Semaphore indicating if there is a session available
-     * and mutex for locking session states. */
-    struct semaphore sem, mutex;
+    /* Lock of the pool, and the queue waiting for an idle session */
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    /* Idle sessions without data transfer, most recently used first */
+    struct list_head idle;
+    /* Idle sessions with data transfer, least recently used first, also
+     * hashed by the file transferred in <streams> */
+    struct list_head lru;
+    struct hlist_head streams[1 << FTP_STREAM_BITS];
     /* FTP server address */
     struct sockaddr_in addr;
     /* User name and password */
@@ -35,38 +110,165 @@ struct ftp_info {
     int max_sock;
     /* List of FTP sessions, an array of max_sock elements */
     struct ftp_conn_info *conn_list;
+    /* Workqueue running background work on sessions */
+    struct workqueue_struct *wq;
+    /* Cache of directory listings */
+    struct ftp_dir_cache dir_cache;
+    /* Extensions supported by the server, FTP_FEAT_* */
+    unsigned int features;
+    /* Login directory of the sessions, asked once under <lock> when a
+     * directory is told from a missing file by CWD, NULL until then */
+    char *home;
+    /* Last generation given to a directory renamed or created, the numbers
+     * of its files derived from their paths depend on it */
+    atomic_t ino_gen;
+    /* Tunables, changed under <lock> by ftp_info_set_options() and read
+     * with ftp_info_options() */
+    struct ftp_options opts;
+    seqcount_t opts_seq;
+    /* Moved on under <lock> by every rename of the mount, which caches the
+     * paths of its dentries computed since, see ftp_fs_path_get() */
+    seqcount_t rename_seq;
+    /* Work keeping idle sessions alive */
+    struct delayed_work keepalive;
+    struct ftp_stats stats;
+};
+
+/* Bits of ftp_info.features, set from the response to FEAT */
+#define FTP_FEAT_KNOWN 1
+#define FTP_FEAT_MLST 2
+#define FTP_FEAT_SIZE 4
+#define FTP_FEAT_MDTM 8
+#define FTP_FEAT_EPSV 16
+
+/* An asynchronous request, run by a worker of the workqueue of the sessions,
+ * which takes a session from the pool for it. */
+struct ftp_request {
+    struct work_struct work;
+    struct ftp_info *info;
+    /* Operation run by the worker, see ftp_request_read() */
+    int (*run)(struct ftp_request *req);
+    /* Arguments of the operation */
+    const char *file;
+    unsigned long offset, len, ra;
+    char *buf;
+    int stripes, keep;
+    /* Result of the operation */
+    int ret;
+    /* Called by the worker when the request is done if not NULL, otherwise
+     * the submitter waits for the request by ftp_wait() */
+    void (*done)(struct ftp_request *req);
+    struct completion completion;
 };
 
 /* Information about a file item returned by ftp_read_file(), including
- * name, mode, number of links, file size, and last modified time. */
+ * name, mode, number of links, file size, and last modified time. The names of
+ * the files of a listing are kept in its chunks of names. */
 struct ftp_file_info {
     char *name;
     umode_t mode;
     nlink_t nlink;
     off_t size;
     time_t mtime;
+    /* hash of the unique fact given by MLST or MLSD, 0 if unknown */
+    u64 unique;
 };
 
-/* Allocate space for global info and initialize it using provided arguments. */
+/* Allocate space for global info and initialize it using provided arguments.
+ * Return 0 for success and negative value for error. */
 int ftp_info_init(struct ftp_info **info, struct sockaddr_in addr,
-        const char *user, const char *pass, int max_sock);
+        const char *user, const char *pass, int max_sock, const struct ftp_options *opts);
+/* Log in the first opts.warm sessions in parallel and start the keepalive,
+ * which sends NOOP on sessions idle for opts.keepalive and logs in again the
+ * first opts.warm sessions if they are dropped. Return 0 if any of the
+ * sessions is logged in, or the error of the login otherwise. */
+int ftp_info_connect(struct ftp_info *info);
+/* Replace the tunables of <info>, which apply to sessions opened afterwards. */
+void ftp_info_set_options(struct ftp_info *info, const struct ftp_options *opts);
+/* Copy the tunables of <info> into <opts>, consistent with a remount running
+ * meanwhile. */
+void ftp_info_options(struct ftp_info *info, struct ftp_options *opts);
 /* Deallocate global info */
 void ftp_info_destroy(struct ftp_info *info);
-/* Free the space allocated by ftp_read_dir(). */
-void ftp_file_info_destroy(unsigned long len, struct ftp_file_info *files);
-/* Read maximum <len> bytes from file <file> starting from offset <offset>. */
+/* Read maximum <len> bytes from file <file> starting from offset <offset>.
+ * After the read, up to <ra> following bytes are prefetched in background so
+ * that a sequential read can be served from memory. */
 int ftp_read_file(struct ftp_info *info, const char *file,
-        unsigned long offset, char *buf, unsigned long len);
-/* Write <len> bytes to file <file> starting from offset <offset>. */
+        unsigned long offset, char *buf, unsigned long len, unsigned long ra);
+/* Read <len> bytes from file <file> starting from offset <offset> (less only
+ * at end of file), split in <stripes> ranges fetched at the same time on
+ * different sessions. */
+int ftp_read_file_striped(struct ftp_info *info, const char *file,
+        unsigned long offset, char *buf, unsigned long len, int stripes);
+/* Prepare <req> to read <len> bytes of file <file> starting from offset
+ * <offset> into <buf>, split in <stripes> ranges if it is more than 1. The
+ * result is the number of bytes read, less only at end of file. After the
+ * read, up to <ra> following bytes are prefetched. */
+void ftp_request_read(struct ftp_request *req, const char *file,
+        unsigned long offset, char *buf, unsigned long len, int stripes, unsigned long ra);
+/* Submit <req> to be run in background. If <done> is not NULL, it is called
+ * by the worker with the request done, otherwise the request should be waited
+ * for by ftp_wait(). */
+void ftp_submit(struct ftp_info *info, struct ftp_request *req, void (*done)(struct ftp_request *req));
+/* Wait for a request submitted without <done> and return its result. */
+int ftp_wait(struct ftp_request *req);
+/* Write <len> bytes to file <file> starting from offset <offset>. Writes
+ * continuing each other go to the same STOR stream, which is completed by
+ * ftp_flush_file(). */
 int ftp_write_file(struct ftp_info *info, const char *file,
         unsigned long offset, const char *buf, unsigned long len);
+/* An upload to a file over a session held from ftp_upload_begin() to
+ * ftp_upload_end(), so that no other transfer of the file runs along. */
+struct ftp_upload {
+    struct ftp_conn_info *conn;
+    /* Offset of the next byte sent */
+    unsigned long offset;
+};
+/* Store the size of file <file> on the server in <size> (SIZE). Return 0 for
+ * success, -EOPNOTSUPP if the server does not tell, or negative value for
+ * error. */
+int ftp_file_size(struct ftp_info *info, const char *file, unsigned long *size);
+/* Start uploading to <file> from <offset> in <up>: if <append>, with APPE,
+ * <offset> being the size of the file on the server, otherwise with REST and
+ * STOR, which replaces the file from <offset>. Direct writes to the file are
+ * completed first. Return 0 for success and negative value for error. */
+int ftp_upload_begin(struct ftp_info *info, const char *file, unsigned long offset, int append, struct ftp_upload *up);
+/* Send <len> bytes at <pgoff> of <page> on the upload <up> without copying
+ * them. Return 0 for success and negative value for error. */
+int ftp_upload_page(struct ftp_info *info, struct ftp_upload *up, const char *file, struct page *page, int pgoff, int len);
+/* Complete the upload <up> if <ret> is 0, otherwise abort it, and release its
+ * session. Return 0 if the server confirmed the transfer and has all the
+ * bytes sent, or negative value for error. */
+int ftp_upload_end(struct ftp_info *info, struct ftp_upload *up, const char *file, int ret);
+/* Complete the uploads to file <file> and wait for the server to confirm them.
+ * Return 0 for success and negative value for error. */
+int ftp_flush_file(struct ftp_info *info, const char *file);
 /* Close data transfer connections related to file <file>. */
 void ftp_close_file(struct ftp_info *info, const char *file);
-/* Retrieve info of all files contained in the directory <path>, store its
- * length in <len> and the starting pointer of the array in <files>,
- * whose space should later be freed by ftp_file_info_destroy(). */
-int ftp_read_dir(struct ftp_info *info, const char *path,
-        unsigned long *len, struct ftp_file_info **files);
+/* Retrieve info of all files contained in the directory <path>, except "."
+ * and "..", and store the listing in <dir>, which should later be released by ftp_dir_put(). The
+ * listing may come from the listing cache. */
+int ftp_read_dir(struct ftp_info *info, const char *path, struct ftp_dir_info **dir);
+/* Called by ftp_iterate_dir() with <data> for each file, whose name <name> of
+ * <len> bytes is not terminated and replaces file->name. Return 0 to go on, or
+ * non-zero to stop before this file, which then comes first in the next call. */
+typedef int (*ftp_dir_actor)(void *data, const struct ftp_file_info *file, const char *name, int len);
+/* Iterate over the files of directory <path> from the <pos>-th on, except "."
+ * and "..", with <actor>. The files come from the listing cache if it has the
+ * directory, otherwise they are parsed as they arrive from the server, and
+ * memory does not grow with the directory. A listing stopped by <actor> is
+ * left idle in the pool, so that the next call from where this one stopped
+ * continues it; a call at another position lists the directory again and
+ * skips <pos> files. A listing of at most DIR_CACHE_FILES files is cached
+ * once read to its end, over as many calls as needed. Return the number of
+ * files iterated over or negative value for error. */
+int ftp_iterate_dir(struct ftp_info *info, const char *path, unsigned long pos, ftp_dir_actor actor, void *data);
+/* Retrieve info of the single file <name> in directory <dir> into <file>,
+ * whose name is not set. A cached listing of <dir> is used if any, otherwise
+ * the server is asked about that file only if it supports MLST or SIZE, and
+ * <dir> is listed only as the last resort. Return 0 for success and -ENOENT
+ * if the file does not exist. */
+int ftp_stat(struct ftp_info *info, const char *dir, const char *name, struct ftp_file_info *file);
 /* Rename <oldpath> to <newpath>. */
 int ftp_rename(struct ftp_info *info, const char *oldpath, const char *newpath);
 /* Create a file at path <file>. */
@@ -22,16 +22,44 @@
 #define FTP_FS_DEFAULT_MODE 0755
 #define FTP_FS_MAGIC 0x19950522
 
-#define MAX_PATH_LEN (50 * sizeof (char))
 #define MAX_CONTENT_SIZE 52428800
 
 #define DEFAULT_MODE 0755
 
+/* Defaults of the mount options, see super.c */
+
+/* Time in seconds during which cached attributes are trusted without asking
+ * the server (attr_ttl) */
+#define ATTR_CACHE_TIMEOUT 3
+/* Time in seconds during which a directory listing is reused (dir_ttl) */
+#define DIR_CACHE_TTL 5
+/* Largest time in seconds accepted by the options attr_ttl, dir_ttl and
+ * keepalive, a day */
+#define MAX_TIME_OPTION (24 * 3600)
+
+/* Bounds of the window prefetched after sequential reads (ra_min, ra_max) */
+#define READAHEAD_MIN (128 * 1024)
+#define READAHEAD_MAX (2 * 1024 * 1024)
+
+/* Files of at least STRIPE_THRESHOLD bytes are read in STRIPE_COUNT ranges
+ * (stripes) at the same time, for reads of at least 2 * STRIPE_MIN bytes */
+#define STRIPE_THRESHOLD (8 * 1024 * 1024)
+#define STRIPE_MIN (256 * 1024)
+#define STRIPE_COUNT 4
+
+/* server, user, pass */
 #define FTP_IP "104.236.22.129"
 #define FTP_USERNAME "ftpusr"
 #define FTP_PASSWORD "ftpfsdev"
 
+/* sessions */
 #define MAX_SOCK 5
 #define FTP_PORT 21u
 
+/* Number of sessions logged in at mount (warm) */
+#define WARM_SOCK 2
+/* Interval in seconds of NOOPs on idle sessions (keepalive), which should be
+ * shorter than the idle timeout of the server */
+#define KEEPALIVE_INTERVAL 60
+
 #endif
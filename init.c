@@ -2,14 +2,37 @@
 #include "super.h"
 #include "inode.h"
 #include "file.h"
+#include "stats.h"
+
+/* the tracepoints are defined here, see trace.h */
+#define CREATE_TRACE_POINTS
+#include "trace.h"
 
 
 int __init ftpfs_init(void) {
+    int err;
     pr_debug("ftpfs module loaded\n");
 
+    err = ftp_fs_inode_cache_init();
+    if (err)
+        return err;
+    /* set up the backing device used by the page cache of all mounts */
+    err = bdi_setup_and_register(&ftp_fs_bdi, "ftpfs", BDI_CAP_MAP_COPY);
+    if (err) {
+        ftp_fs_inode_cache_destroy();
+        return err;
+    }
+
+    ftp_stats_module_init();
+
     /* register the file system */
-    register_filesystem(&ftp_fs_type);
-    return 0;
+    err = register_filesystem(&ftp_fs_type);
+    if (err) {
+        ftp_stats_module_exit();
+        bdi_destroy(&ftp_fs_bdi);
+        ftp_fs_inode_cache_destroy();
+    }
+    return err;
 }
 
 void __exit ftpfs_fini(void) {
@@ -17,6 +40,9 @@ void __exit ftpfs_fini(void) {
 
     /* unregister the file system */
     unregister_filesystem(&ftp_fs_type);
+    ftp_stats_module_exit();
+    bdi_destroy(&ftp_fs_bdi);
+    ftp_fs_inode_cache_destroy();
 }
 
 module_init(ftpfs_init); // Maybe fs_initcall() is more appropriate
@@ -1,6 +1,7 @@
 #include "ftpfs.h"
 #include "ftp.h"
 #include "inode.h"
+#include "trace.h"
 #include "super.h"
 #include "file.h"
 #include <linux/mount.h>
@@ -14,15 +15,119 @@ const struct inode_operations ftp_fs_dir_inode_operations = {
     .create = ftp_fs_create,
     .lookup = ftp_fs_lookup,
     .mknod = ftp_fs_mknod,
-    .link = simple_link,
-    .unlink = simple_unlink,
+    .unlink = ftp_fs_unlink,
+    .mkdir = ftp_fs_mkdir,
+    .rmdir = ftp_fs_rmdir,
+    .rename = ftp_fs_rename,
 };
 
-struct inode* ftp_fs_get_inode(struct super_block *sb, const struct inode* dir, umode_t mode, dev_t dev) {
-    /* allocate a inode */
-    struct inode* inode = new_inode(sb);
-    if (inode) {
-        inode->i_ino = get_next_ino();
+void ftp_fs_key_init(struct ftp_fs_key *key, const struct inode *dir, const char *name, int len, umode_t mode, u64 unique) {
+    u64 hash = 0xcbf29ce484222325ULL;
+    unsigned long seed[2];
+    int i;
+    key->mode = mode;
+    key->by_path = unique == 0;
+    if (!key->by_path)
+        hash = unique;
+    else {
+        /* FNV-1a of the directory, its generation and the name */
+        seed[0] = dir->i_ino;
+        seed[1] = FTP_FS_I((struct inode*) dir)->gen;
+        for (i = 0; i < sizeof(seed); i++)
+            hash = (hash ^ ((unsigned char*)seed)[i]) * 0x100000001b3ULL;
+        for (i = 0; i < len; i++)
+            hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    }
+    key->key = hash;
+    key->ino = (unsigned long)hash;
+    if (sizeof(key->ino) < sizeof(hash))
+        key->ino ^= hash >> 32;
+    /* 0 is no inode and the root has its own */
+    if (key->ino <= FTP_FS_ROOT_INO)
+        key->ino += FTP_FS_ROOT_INO + 1;
+}
+
+static struct kmem_cache *ftp_fs_inode_cachep;
+
+static void ftp_fs_inode_init_once(void *data) {
+    struct ftp_fs_inode *fi = (struct ftp_fs_inode*) data;
+    mutex_init(&fi->upload);
+    inode_init_once(&fi->vfs_inode);
+}
+
+int ftp_fs_inode_cache_init(void) {
+    ftp_fs_inode_cachep = kmem_cache_create("ftpfs_inode_cache", sizeof(struct ftp_fs_inode), 0,
+            SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, ftp_fs_inode_init_once);
+    return ftp_fs_inode_cachep ? 0 : -ENOMEM;
+}
+
+void ftp_fs_inode_cache_destroy(void) {
+    /* wait for the inodes freed after a grace period */
+    rcu_barrier();
+    kmem_cache_destroy(ftp_fs_inode_cachep);
+}
+
+struct inode* ftp_fs_alloc_inode(struct super_block *sb) {
+    struct ftp_fs_inode *fi = (struct ftp_fs_inode*) kmem_cache_alloc(ftp_fs_inode_cachep, GFP_KERNEL);
+    if (fi == NULL)
+        return NULL;
+    fi->key = 0;
+    fi->by_path = 0;
+    fi->gen = 0;
+    return &fi->vfs_inode;
+}
+
+static void ftp_fs_free_inode(struct rcu_head *head) {
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+    kmem_cache_free(ftp_fs_inode_cachep, FTP_FS_I(inode));
+}
+
+void ftp_fs_destroy_inode(struct inode *inode) {
+    call_rcu(&inode->i_rcu, ftp_fs_free_inode);
+}
+
+/* Callbacks of iget5_locked(), which a new inode of the same identity but
+ * another type does not match */
+static int ftp_fs_test_inode(struct inode *inode, void *data) {
+    const struct ftp_fs_key *key = data;
+    struct ftp_fs_inode *fi = FTP_FS_I(inode);
+    return fi->key == key->key && fi->by_path == key->by_path
+        && (inode->i_mode & S_IFMT) == (key->mode & S_IFMT);
+}
+
+static int ftp_fs_set_inode(struct inode *inode, void *data) {
+    const struct ftp_fs_key *key = data;
+    inode->i_ino = key->ino;
+    FTP_FS_I(inode)->key = key->key;
+    FTP_FS_I(inode)->by_path = key->by_path;
+    /* set before the inode is unlocked, for the test of concurrent lookups */
+    inode->i_mode = key->mode;
+    return 0;
+}
+
+/* Give the directory <inode> a generation no other one had, so that none of
+ * the numbers of its files is that of a cached inode of another path. */
+static void ftp_fs_new_gen(struct inode *inode) {
+    FTP_FS_I(inode)->gen = atomic_inc_return(&((struct ftp_info*) inode->i_sb->s_fs_info)->ino_gen);
+}
+
+/* Hash <inode> by <key> from now on, numbered accordingly. */
+static void ftp_fs_rekey(struct inode *inode, const struct ftp_fs_key *key) {
+    remove_inode_hash(inode);
+    inode->i_ino = key->ino;
+    FTP_FS_I(inode)->key = key->key;
+    FTP_FS_I(inode)->by_path = key->by_path;
+    insert_inode_hash(inode);
+    /* the files of a directory keep no number of its former path */
+    if (S_ISDIR(inode->i_mode))
+        ftp_fs_new_gen(inode);
+}
+
+struct inode* ftp_fs_get_inode(struct super_block *sb, const struct inode* dir, umode_t mode, dev_t dev, const struct ftp_fs_key *key) {
+    /* find the cached inode of this file, with its pages, or allocate one,
+     * hashed so that it is also written back in background */
+    struct inode* inode = iget5_locked(sb, key->ino, ftp_fs_test_inode, ftp_fs_set_inode, (void*)key);
+    if (inode && (inode->i_state & I_NEW)) {
         /* initialize the owener */
         inode_init_owner(inode, dir, mode);
         inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
@@ -33,9 +138,14 @@ struct inode* ftp_fs_get_inode(struct super_block *sb, const struct inode* dir,
                 /* the operations of this inode as the file operations */
                 inode->i_op = &ftp_fs_file_inode_operations;
                 inode->i_fop = &ftp_fs_file_operations;
+                /* file content is cached in the page cache */
+                inode->i_mapping->a_ops = &ftp_fs_aops;
                 break;
             case S_IFDIR:
                 pr_debug("got a dir inode\n");
+                /* a directory renamed away took a newer generation, so the
+                 * one found later at its former path numbers its files anew */
+                FTP_FS_I(inode)->gen = atomic_read(&((struct ftp_info*) sb->s_fs_info)->ino_gen);
                 /* the operations of this inode as the dir operations */
                 inode->i_op = &ftp_fs_dir_inode_operations;
                 inode->i_fop = &ftp_fs_dir_operations;
@@ -45,23 +155,348 @@ struct inode* ftp_fs_get_inode(struct super_block *sb, const struct inode* dir,
                 init_special_inode(inode, mode, dev);
                 break;
         }
+        unlock_new_inode(inode);
     }
     return inode;
 }
 
+/* Get the inode of the listing entry <file> named <name> of <len> bytes in
+ * <dir>, with its attributes refreshed. */
+static struct inode* ftp_fs_iget(struct inode *dir, const char *name, int len, const struct ftp_file_info *file) {
+    struct ftp_fs_key key;
+    struct inode *inode;
+    ftp_fs_key_init(&key, dir, name, len, file->mode, file->unique);
+    if ((inode = ftp_fs_get_inode(dir->i_sb, dir, file->mode, 0, &key)) != NULL)
+        ftp_fs_update_inode(inode, file);
+    return inode;
+}
+
+/* Whether <inode> is still the file of the listing entry <file> named <name>
+ * of <len> bytes in <dir>: a file replaced by a directory or vice versa, or by
+ * a file of another unique fact, needs a new inode. */
+static int ftp_fs_same_file(struct inode *inode, struct inode *dir, const char *name, int len, const struct ftp_file_info *file) {
+    struct ftp_fs_inode *fi = FTP_FS_I(inode);
+    struct ftp_fs_key key;
+    struct inode *other;
+    if ((inode->i_mode & S_IFMT) != (file->mode & S_IFMT))
+        return 0;
+    ftp_fs_key_init(&key, dir, name, len, file->mode, file->unique);
+    if (key.by_path)
+        return 1;
+    if (!fi->by_path)
+        return fi->key == key.key;
+    /* a file made by create or mkdir is keyed by its path until the server
+     * tells its unique fact, then takes it, unless the file has an inode of
+     * that identity already */
+    if ((other = ilookup5(inode->i_sb, key.ino, ftp_fs_test_inode, &key)) != NULL) {
+        iput(other);
+        return other == inode;
+    }
+    ftp_fs_rekey(inode, &key);
+    return 1;
+}
+
+void ftp_fs_update_inode(struct inode *inode, const struct ftp_file_info *file) {
+    struct timespec mtime = { .tv_sec = file->mtime, .tv_nsec = 0 };
+
+    /* dirty pages are newer than the server until they are written back */
+    if (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY)
+            || mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK))
+        return;
+    /* the remote file has changed since its pages were cached */
+    if (S_ISREG(inode->i_mode) && (i_size_read(inode) != file->size
+                || !timespec_equal(&inode->i_mtime, &mtime))) {
+        pr_debug("remote file changed, invalidate cached pages\n");
+        invalidate_remote_inode(inode);
+    }
+    i_size_write(inode, file->size);
+    inode->i_mtime = mtime;
+    set_nlink(inode, file->nlink);
+}
+
+static void ftp_fs_path_free(struct kref *ref) {
+    kfree(container_of(ref, struct ftp_fs_path, ref));
+}
+
+void ftp_fs_path_put(struct ftp_fs_path *path) {
+    kref_put(&path->ref, ftp_fs_path_free);
+}
+
+struct ftp_fs_path* ftp_fs_path_get(struct dentry *dentry) {
+    seqcount_t *rename_seq = &((struct ftp_info*) dentry->d_sb->s_fs_info)->rename_seq;
+    unsigned seq = read_seqcount_begin(rename_seq);
+    struct ftp_fs_path *path, *old;
+    char *buf, *name;
+    int len;
+
+    /* a rename in this mount moves rename_seq on, which may change the path,
+     * those of other mounts do not */
+    spin_lock(&dentry->d_lock);
+    path = dentry->d_fsdata;
+    if (path != NULL && path->seq == seq)
+        kref_get(&path->ref);
+    else
+        path = NULL;
+    spin_unlock(&dentry->d_lock);
+    if (path != NULL)
+        return path;
+
+    if ((buf = __getname()) == NULL)
+        return ERR_PTR(-ENOMEM);
+    name = dentry_path_raw(dentry, buf, PATH_MAX);
+    if (IS_ERR(name)) {
+        path = ERR_CAST(name);
+        goto out;
+    }
+    len = strlen(name);
+    if ((path = (struct ftp_fs_path*) kmalloc(sizeof(struct ftp_fs_path) + len + 1, GFP_KERNEL)) == NULL) {
+        path = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+    kref_init(&path->ref);
+    path->seq = seq;
+    memcpy(path->name, name, len + 1);
+    /* cache it unless a rename ran meanwhile, d_release drops it */
+    if (dentry->d_op == &ftp_fs_dentry_operations && !read_seqcount_retry(rename_seq, seq)) {
+        kref_get(&path->ref);
+        spin_lock(&dentry->d_lock);
+        old = dentry->d_fsdata;
+        dentry->d_fsdata = path;
+        spin_unlock(&dentry->d_lock);
+        if (old != NULL)
+            ftp_fs_path_put(old);
+    }
+
+out:
+    __putname(buf);
+    return path;
+}
+
+static void ftp_fs_d_release(struct dentry *dentry) {
+    if (dentry->d_fsdata != NULL)
+        ftp_fs_path_put(dentry->d_fsdata);
+}
+
+/* Check that a cached dentry still matches the server. Attributes are trusted
+ * for the attr_ttl of the mount, after that the file is looked up again. */
+static int ftp_fs_d_revalidate(struct dentry *dentry, unsigned int flags) {
+    struct dentry *parent;
+    struct inode *inode;
+    struct ftp_file_info file;
+    struct ftp_info *info = (struct ftp_info*) dentry->d_sb->s_fs_info;
+    struct ftp_options opts;
+    int valid = 0;
+
+    if (flags & LOOKUP_RCU)
+        return -ECHILD;
+    /* negative dentries are looked up again, the file may have been created
+     * on the server meanwhile */
+    inode = dentry->d_inode;
+    if (inode == NULL)
+        return 0;
+    ftp_info_options(info, &opts);
+    if (IS_ROOT(dentry) || time_before(jiffies, dentry->d_time + opts.attr_ttl))
+        return 1;
+
+    parent = dget_parent(dentry);
+    struct ftp_fs_path *path = ftp_fs_path_get(parent);
+    if (IS_ERR(path))
+        goto out;
+
+    pr_debug("revalidate %s in %s\n", dentry->d_name.name, path->name);
+    if (ftp_stat(info, path->name, dentry->d_name.name, &file) == 0
+            && ftp_fs_same_file(inode, parent->d_inode, dentry->d_name.name, dentry->d_name.len, &file)) {
+        ftp_fs_update_inode(inode, &file);
+        dentry->d_time = jiffies;
+        valid = 1;
+    }
+    ftp_fs_path_put(path);
+
+out:
+    dput(parent);
+    return valid;
+}
+
+ino_t ftp_fs_instantiate(struct dentry *parent, const char *name, int len, const struct ftp_file_info *file) {
+    struct qstr q = QSTR_INIT(name, len);
+    struct dentry *dentry;
+    struct inode *inode;
+    ino_t ino = 0;
+
+    q.hash = full_name_hash(q.name, q.len);
+    if ((dentry = d_lookup(parent, &q)) != NULL) {
+        inode = dentry->d_inode;
+        /* refresh a dentry of the same file, replace any other */
+        if (inode && ftp_fs_same_file(inode, parent->d_inode, name, len, file)) {
+            ftp_fs_update_inode(inode, file);
+            dentry->d_time = jiffies;
+            ino = inode->i_ino;
+            dput(dentry);
+            return ino;
+        }
+        d_drop(dentry);
+        dput(dentry);
+    }
+
+    /* allocate a hashed dentry and its inode, so that lookups and getattrs
+     * after listing are served from the dcache */
+    if ((inode = ftp_fs_iget(parent->d_inode, name, len, file)) == NULL)
+        return 0;
+    ino = inode->i_ino;
+    /* a directory has one dentry only, leave another one to lookup */
+    if (S_ISDIR(inode->i_mode) && (dentry = d_find_alias(inode)) != NULL) {
+        dput(dentry);
+        iput(inode);
+        return ino;
+    }
+    if ((dentry = d_alloc(parent, &q)) == NULL) {
+        iput(inode);
+        return 0;
+    }
+    dentry->d_time = jiffies;
+    d_add(dentry, inode);
+    dput(dentry);
+    return ino;
+}
+
+const struct dentry_operations ftp_fs_dentry_operations = {
+    .d_revalidate = ftp_fs_d_revalidate,
+    .d_release = ftp_fs_d_release,
+};
+
+/* Run the FTP side operation <op> on the full path of <dentry>, for the VFS
+ * operation <name> in directory <dir>. */
+static int ftp_fs_remote_op(const char *name, struct inode *dir, struct dentry *dentry, int (*op)(struct ftp_info*, const char*)) {
+    int ret;
+    trace_ftpfs_vfs_enter(name, dir->i_ino, 0, 0);
+    struct ftp_fs_path *path = ftp_fs_path_get(dentry);
+    if (IS_ERR(path)) {
+        ret = PTR_ERR(path);
+        goto out;
+    }
+    ret = op((struct ftp_info*) dentry->d_sb->s_fs_info, path->name);
+    ftp_fs_path_put(path);
+
+out:
+    trace_ftpfs_vfs_exit(name, dir->i_ino, ret);
+    return ret;
+}
+
 int ftp_fs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    int error = ftp_fs_remote_op("create", dir, dentry, ftp_create_file);
+    if (error)
+        return error;
     return ftp_fs_mknod(dir, dentry, mode | S_IFREG, 0);
 }
 
+int ftp_fs_mkdir(struct inode* dir, struct dentry* dentry, umode_t mode) {
+    int error = ftp_fs_remote_op("mkdir", dir, dentry, ftp_create_dir);
+    if (error)
+        return error;
+    error = ftp_fs_mknod(dir, dentry, mode | S_IFDIR, 0);
+    if (!error) {
+        /* it is not the directory that was at this path before */
+        ftp_fs_new_gen(dentry->d_inode);
+        inc_nlink(dir);
+    }
+    return error;
+}
+
+int ftp_fs_unlink(struct inode* dir, struct dentry* dentry) {
+    int error = ftp_fs_remote_op("unlink", dir, dentry, ftp_remove_file);
+    if (error)
+        return error;
+    drop_nlink(dentry->d_inode);
+    /* a file created later at this path is another one */
+    remove_inode_hash(dentry->d_inode);
+    dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+    return 0;
+}
+
+int ftp_fs_rmdir(struct inode* dir, struct dentry* dentry) {
+    int error = ftp_fs_remote_op("rmdir", dir, dentry, ftp_remove_dir);
+    if (error)
+        return error;
+    clear_nlink(dentry->d_inode);
+    remove_inode_hash(dentry->d_inode);
+    drop_nlink(dir);
+    dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+    return 0;
+}
+
+int ftp_fs_rename(struct inode* old_dir, struct dentry* old_dentry, struct inode* new_dir, struct dentry* new_dentry) {
+    struct ftp_info *info = (struct ftp_info*) old_dir->i_sb->s_fs_info;
+    int is_dir = S_ISDIR(old_dentry->d_inode->i_mode), error;
+    struct ftp_fs_path *old_path = NULL, *new_path = NULL;
+    trace_ftpfs_vfs_enter("rename", old_dir->i_ino, 0, 0);
+    old_path = ftp_fs_path_get(old_dentry);
+    if (IS_ERR(old_path)) {
+        error = PTR_ERR(old_path);
+        old_path = NULL;
+        goto out;
+    }
+    new_path = ftp_fs_path_get(new_dentry);
+    if (IS_ERR(new_path)) {
+        error = PTR_ERR(new_path);
+        new_path = NULL;
+        goto out;
+    }
+    if ((error = ftp_rename(info, old_path->name, new_path->name)) < 0)
+        goto out;
+
+    /* the server replaced the target, update link counts as simple_rename() */
+    if (new_dentry->d_inode) {
+        drop_nlink(new_dentry->d_inode);
+        if (is_dir) {
+            drop_nlink(new_dentry->d_inode);
+            drop_nlink(old_dir);
+        }
+    } else if (is_dir) {
+        drop_nlink(old_dir);
+        inc_nlink(new_dir);
+    }
+
+    /* the replaced target is gone, and the moved file is numbered by its new
+     * path if it was by the old one. A moved directory numbered so also takes
+     * a new generation, its files renumbered when they are looked up again. */
+    struct inode *inode = old_dentry->d_inode;
+    struct ftp_fs_key key;
+    if (new_dentry->d_inode)
+        remove_inode_hash(new_dentry->d_inode);
+    if (FTP_FS_I(inode)->by_path) {
+        ftp_fs_key_init(&key, new_dir, new_dentry->d_name.name, new_dentry->d_name.len, inode->i_mode, 0);
+        ftp_fs_rekey(inode, &key);
+    }
+    old_dir->i_ctime = old_dir->i_mtime = new_dir->i_ctime = new_dir->i_mtime = CURRENT_TIME;
+
+    /* move the dentry here rather than in vfs_rename() after us, so that no
+     * path computed before it is cached as one of the new sequence */
+    spin_lock(&info->lock);
+    write_seqcount_begin(&info->rename_seq);
+    d_move(old_dentry, new_dentry);
+    write_seqcount_end(&info->rename_seq);
+    spin_unlock(&info->lock);
+
+out:
+    trace_ftpfs_vfs_exit("rename", old_dir->i_ino, error);
+    if (old_path != NULL)
+        ftp_fs_path_put(old_path);
+    if (new_path != NULL)
+        ftp_fs_path_put(new_path);
+    return error;
+}
+
 int ftp_fs_mknod(struct inode* dir, struct dentry* dentry, umode_t mode, dev_t dev) {
-    /* get the inode */
-    struct inode* inode = ftp_fs_get_inode(dir->i_sb, dir, mode, dev);
+    /* get the inode, numbered by its path */
+    struct ftp_fs_key key;
+    ftp_fs_key_init(&key, dir, dentry->d_name.name, dentry->d_name.len, mode, 0);
+    struct inode* inode = ftp_fs_get_inode(dir->i_sb, dir, mode, dev, &key);
     int error = -ENOSPC;
 
     if (inode) {
-        /* instantiate the dentry with this inode */
+        /* instantiate the dentry with this inode, it is not pinned since
+         * the server keeps the file */
         d_instantiate(dentry, inode);
-        dget(dentry);
         error = 0;
         dir->i_mtime = dir->i_ctime = CURRENT_TIME;
     }
@@ -71,56 +506,40 @@ int ftp_fs_mknod(struct inode* dir, struct dentry* dentry, umode_t mode, dev_t d
 struct dentry* ftp_fs_lookup(struct inode* inode, struct dentry* dentry, unsigned int flags) {
     struct inode* target = NULL;
 
-    pr_debug("process lookup %s\n", dentry->d_name.name);
     if (dentry->d_name.len > NAME_MAX)
         return ERR_PTR(-ENAMETOOLONG);
     if (!dentry->d_sb->s_d_op)
         d_set_d_op(dentry, &simple_dentry_operations);
 
-    /* got the full path from inode */
-    struct dentry *d = list_entry(inode->i_dentry.first, struct dentry, d_alias);
+    /* got the full path of the directory from its dentry */
     char *filename = dentry->d_name.name;
-    char *filebuf = (char*) kmalloc(MAX_PATH_LEN, GFP_KERNEL);
-    if (filebuf == NULL) {
-        pr_debug("allocate filebuf failed\n");
-        goto out;
-    }
-    char *file_path = dentry_path_raw(d, filebuf, MAX_PATH_LEN);
-    if (file_path == NULL) {
+    struct ftp_fs_path *file_path = ftp_fs_path_get(dentry->d_parent);
+    if (IS_ERR(file_path)) {
         pr_debug("calculate file path failed\n");
-        goto error;
+        return ERR_CAST(file_path);
     }
-    pr_debug("@lookup full path name %s\n", filename);
 
     int result = -1;
-    unsigned long file_num;
-    struct ftp_file_info *files;
+    struct ftp_file_info file;
 
-    /* fetch the dir content from the server and the look up the file in the content. If it exists, then allocate a dentry cache for it 
+    /* ask the server about this file only. If it exists, then allocate a inode for it,
      * if not, the target is set as NULL and d_add it */
-    if ((result = ftp_read_dir((struct ftp_info*) inode->i_sb->s_fs_info, file_path, &file_num, &files)) == 0) {
-        pr_debug("got %lu file\n", file_num);
-        int i;
-        for (i = 2; i < file_num; i++) if (strcmp(filename, files[i].name) == 0) {
-            pr_debug("got this file\n");
-            if ((target = ftp_fs_get_inode(inode->i_sb, inode, files[i].mode, 0)) == NULL) {
-                pr_debug("can not allocate a inode\n");
-                goto error;
-            }
-            /* missing m_time (need format converting) */
-            if (target) target->i_size = files[i].size;
-
-            pr_debug("new inode done\n");
-            break;
+    trace_ftpfs_vfs_enter("lookup", inode->i_ino, 0, 0);
+    if ((result = ftp_stat((struct ftp_info*) inode->i_sb->s_fs_info, file_path->name, filename, &file)) == 0) {
+        if ((target = ftp_fs_iget(inode, filename, dentry->d_name.len, &file)) == NULL) {
+            pr_debug("can not allocate a inode\n");
+            result = -ENOMEM;
         }
     }
+    trace_ftpfs_vfs_exit("lookup", inode->i_ino, result);
+    ftp_fs_path_put(file_path);
+    /* only a file missing on the server makes a negative dentry, other
+     * failures are not cached */
+    if (result < 0 && result != -ENOENT)
+        return ERR_PTR(result);
 
-error:
-    if (filebuf) kfree(filebuf);
-    pr_debug("freed filebuf\n");
-out:
-    d_add(dentry, target);
-    pr_debug("add dentry\n");
-    return NULL;
+    dentry->d_time = jiffies;
+    /* the inode may be cached with a dentry of a directory already */
+    return d_splice_alias(target, dentry);
 }
 
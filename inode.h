@@ -1,14 +1,88 @@
 #ifndef _INODE_H
 #define _INODE_H
+#include <linux/kref.h>
+#include <linux/mutex.h>
+
 // TODO
 extern const struct inode_operations ftp_fs_file_inode_operations;
+extern const struct dentry_operations ftp_fs_dentry_operations;
+
+struct ftp_file_info;
+
+/* Full path of a dentry, cached in its d_fsdata while no rename happened in the
+ * mount since it was computed. */
+struct ftp_fs_path {
+    struct kref ref;
+    /* Sequence of ftp_info.rename_seq at which <name> was computed */
+    unsigned seq;
+    char name[];
+};
+
+/* Return the full path of <dentry>, or an ERR_PTR. It is computed in a
+ * PATH_MAX buffer of names_cachep on the first call after a rename, and shared
+ * by the later ones. Release it with ftp_fs_path_put(). */
+struct ftp_fs_path* ftp_fs_path_get(struct dentry *dentry);
+void ftp_fs_path_put(struct ftp_fs_path *path);
+
+/* Inode number of the root directory */
+#define FTP_FS_ROOT_INO 1
+
+/* Identity of an inode in the inode hash. A file whose unique fact is known
+ * keeps its number wherever it is; others are numbered by the number and the
+ * generation of their directory, and their name. */
+struct ftp_fs_key {
+    /* Full key, and the inode number folded from it */
+    u64 key;
+    unsigned long ino;
+    umode_t mode;
+    /* whether <key> is derived from the path */
+    int by_path;
+};
+
+/* Inode of ftpfs, with the identity it is hashed by, which iget5_locked()
+ * compares in full since the inode number may be folded. */
+struct ftp_fs_inode {
+    u64 key;
+    int by_path;
+    /* Generation of the numbers of the files of a directory derived from
+     * their path, taken from ftp_info.ino_gen */
+    unsigned long gen;
+    /* Serializes the write-back uploads of the file */
+    struct mutex upload;
+    struct inode vfs_inode;
+};
+
+static inline struct ftp_fs_inode* FTP_FS_I(struct inode *inode) {
+    return container_of(inode, struct ftp_fs_inode, vfs_inode);
+}
+
+/* Create and destroy the cache of struct ftp_fs_inode, at module load and
+ * unload. */
+int ftp_fs_inode_cache_init(void);
+void ftp_fs_inode_cache_destroy(void);
+/* alloc_inode and destroy_inode of the super block */
+struct inode* ftp_fs_alloc_inode(struct super_block *sb);
+void ftp_fs_destroy_inode(struct inode *inode);
 
-struct inode* ftp_fs_get_inode(struct super_block *sb, const struct inode* dir, umode_t mode, dev_t dev);
+/* Set <key> to the identity of the file of <mode> named <name> of <len> bytes
+ * in <dir>, whose unique fact hashes to <unique>, 0 if unknown. */
+void ftp_fs_key_init(struct ftp_fs_key *key, const struct inode *dir, const char *name, int len, umode_t mode, u64 unique);
+/* Return the inode of identity <key>, allocating one if it is not cached. */
+struct inode* ftp_fs_get_inode(struct super_block *sb, const struct inode* dir, umode_t mode, dev_t dev, const struct ftp_fs_key *key);
+/* Refresh the attributes of <inode> from a listing entry, dropping its cached
+ * pages if the remote size or mtime differs. */
+void ftp_fs_update_inode(struct inode *inode, const struct ftp_file_info *file);
+/* Make sure a hashed dentry with an up to date inode exists under <parent> for
+ * the listing entry <file> named <name> of <len> bytes. Return its inode
+ * number, or 0 on failure. */
+ino_t ftp_fs_instantiate(struct dentry *parent, const char *name, int len, const struct ftp_file_info *file);
 
 // inode operations
 int ftp_fs_create(struct inode* inode, struct dentry* dentry, umode_t mode, bool flag);
 int ftp_fs_mkdir(struct inode* inode, struct dentry* dentry, umode_t mode);
 int ftp_fs_rmdir(struct inode* inode, struct dentry* dentry);
+int ftp_fs_unlink(struct inode* inode, struct dentry* dentry);
+int ftp_fs_rename(struct inode* old_dir, struct dentry* old_dentry, struct inode* new_dir, struct dentry* new_dentry);
 
 int ftp_fs_mknod(struct inode* dir, struct dentry* dentry, umode_t mode, dev_t dev);
 struct dentry* ftp_fs_lookup(struct inode* inode, struct dentry* dentry, unsigned int flags);
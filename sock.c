@@ -1,105 +1,127 @@
 #include "sock.h"
 #include "ftpfs.h"
 
-#include <asm/uaccess.h>
 #include <linux/net.h>
 #include <linux/slab.h>
 #include <linux/in.h>
+#include <linux/inet.h>
 
 int sock_send(struct socket *sock, const void *buf, int len) {
-    struct iovec iov;
+    struct kvec iov = { .iov_base = (void*)buf, .iov_len = len };
     struct msghdr msg;
-    int ret;
-    mm_segment_t old_fs = get_fs();
-    set_fs(get_ds());
-
-    iov.iov_base = (void*)buf;
-    iov.iov_len = len;
     memset(&msg, 0, sizeof(msg));
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    ret = sock_sendmsg(sock, &msg, len);
+    return kernel_sendmsg(sock, &msg, &iov, 1, len);
+}
 
-    set_fs(old_fs);
-    return ret;
+int sock_sendv(struct socket *sock, struct kvec *vec, int num) {
+    struct msghdr msg;
+    int len = 0, sent = 0, ret, i;
+    for (i = 0; i < num; i++)
+        len += vec[i].iov_len;
+    while (sent < len) {
+        memset(&msg, 0, sizeof(msg));
+        if ((ret = kernel_sendmsg(sock, &msg, vec, num, len - sent)) < 0)
+            return ret;
+        sent += ret;
+        /* skip the chunks sent, and the part sent of the next one */
+        for (; num > 0 && ret >= vec->iov_len; num--, vec++)
+            ret -= vec->iov_len;
+        if (num > 0) {
+            vec->iov_base += ret;
+            vec->iov_len -= ret;
+        }
+    }
+    return sent;
 }
 
 int sock_recv(struct socket *sock, void *buf, int size) {
-    struct iovec iov;
+    struct kvec iov = { .iov_base = buf, .iov_len = size };
     struct msghdr msg;
-    int ret;
-    mm_segment_t old_fs = get_fs();
-    set_fs(get_ds());
-
-    iov.iov_base = buf;
-    iov.iov_len = size;
     memset(&msg, 0, sizeof(msg));
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    ret = sock_recvmsg(sock, &msg, size, 0);
+    return kernel_recvmsg(sock, &msg, &iov, 1, size, 0);
+}
 
-    set_fs(old_fs);
-    return ret;
+int sock_send_page(struct socket *sock, struct page *page, int offset, int len) {
+    return kernel_sendpage(sock, page, offset, len, 0);
 }
 
-int sock_readline(struct socket *sock, char **buf) {
-    int size = 4096, read = 0, ret;
-    char *tmp;
-    /* allocate an initial buffer of size 4096 */
-    *buf = kmalloc(size, GFP_KERNEL);
-    if (*buf == NULL)
-        return -ENOMEM;
+void sock_reader_init(struct sock_reader *rd, struct socket *sock) {
+    rd->sock = sock;
+    rd->start = rd->end = 0;
+}
 
-    while (1) {
-        /* read 1 char every time */
-        ret = sock_recv(sock, *buf + read, 1);
-        if (ret <= 0) {
-            kfree(*buf);
-            return ret;
-        }
-        read++;
-        if ((*buf)[read - 1] == '\n') {
-            (*buf)[read] = 0;
-            return read;
+void sock_reader_destroy(struct sock_reader *rd) {
+    if (rd->buf != NULL)
+        kfree(rd->buf);
+    rd->buf = NULL;
+    rd->size = rd->start = rd->end = 0;
+}
+
+int sock_reader_line(struct sock_reader *rd, char **line) {
+    int scan = rd->start, ret;
+    char *eol = NULL, *tmp;
+    while (scan == rd->end || (eol = memchr(rd->buf + scan, '\n', rd->end - scan)) == NULL) {
+        /* bytes before <end> are known to contain no line ending */
+        scan = rd->end;
+        /* move the incomplete line to the beginning of the buffer */
+        if (rd->start > 0) {
+            memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+            rd->end -= rd->start;
+            scan -= rd->start;
+            rd->start = 0;
         }
         /* not enough space, allocate a buffer of doubled size and copy data */
-        if (read == size - 1) {
-            tmp = kmalloc(size * 2, GFP_KERNEL);
-            if (tmp == NULL) {
-                kfree(*buf);
+        if (rd->end == rd->size) {
+            tmp = kmalloc(rd->size > 0 ? rd->size * 2 : SOCK_READER_SIZE, GFP_KERNEL);
+            if (tmp == NULL)
                 return -ENOMEM;
+            if (rd->buf != NULL) {
+                memcpy(tmp, rd->buf, rd->end);
+                kfree(rd->buf);
             }
-            memcpy(tmp, *buf, read);
-            kfree(*buf);
-            *buf = tmp;
-            size *= 2;
+            rd->buf = tmp;
+            rd->size = rd->size > 0 ? rd->size * 2 : SOCK_READER_SIZE;
         }
+        ret = sock_recv(rd->sock, rd->buf + rd->end, rd->size - rd->end);
+        if (ret <= 0)
+            return ret;
+        rd->end += ret;
     }
+    *line = rd->buf + rd->start;
+    ret = eol + 1 - *line;
+    rd->start += ret;
+    /* strip the line ending */
+    *eol = 0;
+    if (eol > *line && *(eol - 1) == '\r')
+        *(eol - 1) = 0;
+    return ret;
 }
 
-static unsigned short _htons(unsigned short port) {
-    unsigned short s0 = port & (unsigned short)0x00ff;
-    unsigned short s1 = port & (unsigned short)0xff00; 
-    pr_debug("got the port %lu\n", (s0 << 8) + s1);
-    return (s0 << 8) + s1;
+void sock_reader_unread(struct sock_reader *rd, int len) {
+    rd->start -= len;
+    /* restore the line ending, a '\r' stripped or a '\0' in the line alike
+     * end the line read again */
+    rd->buf[rd->start + len - 1] = '\n';
+    if (len >= 2 && rd->buf[rd->start + len - 2] == 0)
+        rd->buf[rd->start + len - 2] = '\r';
 }
 
-static void _inet_aton(const char* ip, unsigned int *res) {
-    unsigned int s[4];
-    int i;
-    sscanf(ip, "%u.%u.%u.%u", s, s + 1, s + 2, s + 3);
-    *res = 0;
-    for (i = 0; i < 4; i++) *res |= s[i] << (8 * i);
-    pr_debug("%u.%u.%u.%u\n", s[0], s[1], s[2], s[3]);
-    pr_debug("got the ip %u\n", *res);
+int sock_set_bufsize(struct socket *sock, int rcvbuf, int sndbuf) {
+    int ret;
+    if (rcvbuf > 0 && (ret = kernel_setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&rcvbuf, sizeof(rcvbuf))) < 0)
+        return ret;
+    if (sndbuf > 0 && (ret = kernel_setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char*)&sndbuf, sizeof(sndbuf))) < 0)
+        return ret;
+    return 0;
 }
 
-struct sockaddr_in* cons_addr(const char* ip) {
-    struct sockaddr_in *addr = kmalloc(sizeof(struct sockaddr_in), GFP_KERNEL);
-    if (addr) {
-        addr->sin_family = AF_INET;
-        addr->sin_port = _htons(FTP_PORT);
-        _inet_aton(ip, &addr->sin_addr.s_addr);
+int cons_addr(const char *ip, unsigned short port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (!in4_pton(ip, -1, (u8*)&addr->sin_addr.s_addr, -1, NULL)) {
+        pr_debug("bad address %s\n", ip);
+        return -EINVAL;
     }
-    return addr;
+    return 0;
 }
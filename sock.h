@@ -8,19 +8,53 @@
 /* Send a chunk of data, analogous to send() in user space.
  * Return value: same as sock_sendmsg(). */
 int sock_send(struct socket *sock, const void *buf, int len);
+/* Send all the <num> chunks of <vec> in order, which are modified.
+ * Return value: number of bytes sent or negative value for error. */
+int sock_sendv(struct socket *sock, struct kvec *vec, int num);
 /* Receive a chunk of data, analogous to recv() in user space.
  * Return value: same as sock_recvmsg(). */
 int sock_recv(struct socket *sock, void *buf, int size);
-/* Read a line of data and return the start pointer of the line in <buf>,
- * which should later be kfree()d. The line is padded with '\0'.
- * Return value: length of the line on success; otherwise 0 for an incomplete
- * line before closing connection or negative value for error, and <buf> is
- * not set. */
-int sock_readline(struct socket *sock, char **buf);
+/* Send <len> bytes at <offset> of <page> without copying them, the socket
+ * holding a reference to the page until the data is acknowledged.
+ * Return value: same as kernel_sendpage(). */
+int sock_send_page(struct socket *sock, struct page *page, int offset, int len);
 
-/* Convert the dot-represented IPv4 address to a sockaddr_in struct allocated,
- * which should later be kfree()d.
- * Return value: pointer to the address or NULL for error. */
-struct sockaddr_in* cons_addr(const char*);
+/* Buffered reader of a socket, which receives data in bulk and returns lines
+ * as slices of its buffer. */
+struct sock_reader {
+    struct socket *sock;
+    /* Buffer of <size> bytes (NULL until the first read), where bytes
+     * [start, end) are received but not consumed yet */
+    char *buf;
+    int size, start, end;
+};
+
+/* Initial size of the buffer of a reader, doubled if a line does not fit */
+#define SOCK_READER_SIZE 4096
+
+/* Attach the reader to <sock> (NULL for none) and discard buffered data. The
+ * buffer is kept for reuse. */
+void sock_reader_init(struct sock_reader *rd, struct socket *sock);
+/* Free the buffer of the reader. */
+void sock_reader_destroy(struct sock_reader *rd);
+/* Read a line of data and return the start pointer of the line in <line>,
+ * which points into the buffer of the reader and is valid until the next
+ * read. The line ending ("\n" or "\r\n") is replaced with '\0'.
+ * Return value: number of bytes consumed including the line ending on
+ * success; otherwise 0 for an incomplete line before closing connection or
+ * negative value for error, and <line> is not set. */
+int sock_reader_line(struct sock_reader *rd, char **line);
+/* Give back the line returned by the last sock_reader_line(), which consumed
+ * <len> bytes, so that the next read returns it again. */
+void sock_reader_unread(struct sock_reader *rd, int len);
+
+/* Set the receive and send buffer sizes of a socket, where 0 keeps the
+ * system default.
+ * Return value: 0 on success or negative value for error. */
+int sock_set_bufsize(struct socket *sock, int rcvbuf, int sndbuf);
+
+/* Fill <addr> with the dot-represented IPv4 address <ip> and the port.
+ * Return value: 0 on success or -EINVAL for a malformed address. */
+int cons_addr(const char *ip, unsigned short port, struct sockaddr_in *addr);
 
 #endif
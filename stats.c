@@ -0,0 +1,133 @@
+#include "stats.h"
+#include "ftpfs.h"
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+
+static const char *ftp_cmd_names[FTP_CMD_MAX] = {
+    "USER", "PASS", "TYPE", "FEAT", "EPSV",
+    "PASV", "REST", "RETR", "STOR", "ABOR",
+    "LIST", "MLSD", "MLST", "SIZE", "MDTM",
+    "NOOP", "RNFR", "RNTO", "DELE", "MKD",
+    "RMD", "other",
+};
+
+static const char *ftp_event_names[FTP_STAT_MAX] = {
+    "rx_bytes", "tx_bytes",
+    "stream_hits", "stream_misses",
+    "aborts", "conflicts", "evictions",
+    "logins", "login_failures", "drops",
+    "lookups", "listings", "listing_hits", "listing_skips",
+};
+
+/* Root directory of the module in debugfs */
+static struct dentry *ftp_stats_root;
+
+void ftp_stats_module_init(void) {
+    ftp_stats_root = debugfs_create_dir("ftpfs", NULL);
+    if (IS_ERR(ftp_stats_root))
+        ftp_stats_root = NULL;
+}
+
+void ftp_stats_module_exit(void) {
+    debugfs_remove_recursive(ftp_stats_root);
+}
+
+void ftp_stats_init(struct ftp_stats *stats) {
+    memset(stats, 0, sizeof(struct ftp_stats));
+}
+
+int ftp_stats_cmd(const char *cmd) {
+    int i, len;
+    for (len = 0; cmd[len] != 0 && cmd[len] != ' ' && cmd[len] != '\r'; len++);
+    for (i = 0; i < FTP_CMD_OTHER; i++)
+        if (strlen(ftp_cmd_names[i]) == len && strncmp(cmd, ftp_cmd_names[i], len) == 0)
+            return i;
+    return FTP_CMD_OTHER;
+}
+
+const char* ftp_stats_cmd_name(int cmd) {
+    return ftp_cmd_names[cmd];
+}
+
+s64 ftp_stats_time(struct ftp_hist *hist, ktime_t start) {
+    s64 us = ktime_us_delta(ktime_get(), start);
+    int bucket = us > 0 ? ilog2(us) + 1 : 0;
+    if (bucket >= FTP_HIST_BUCKETS)
+        bucket = FTP_HIST_BUCKETS - 1;
+    atomic64_inc(&hist->count[bucket]);
+    atomic64_add(us, &hist->sum);
+    return us;
+}
+
+/* Print a histogram as "<count> <sum> <bucket 0> ... <bucket n>", with the
+ * trailing empty buckets left out. */
+static void ftp_stats_show_hist(struct seq_file *m, const char *name, struct ftp_hist *hist) {
+    long long count = 0;
+    int i, last = -1;
+    for (i = 0; i < FTP_HIST_BUCKETS; i++)
+        if (atomic64_read(&hist->count[i]) > 0) {
+            count += atomic64_read(&hist->count[i]);
+            last = i;
+        }
+    seq_printf(m, "%-8s %lld %lld", name, count, (long long)atomic64_read(&hist->sum));
+    for (i = 0; i <= last; i++)
+        seq_printf(m, " %lld", (long long)atomic64_read(&hist->count[i]));
+    seq_putc(m, '\n');
+}
+
+static int ftp_stats_show(struct seq_file *m, void *v) {
+    struct ftp_stats *stats = m->private;
+    int i;
+    for (i = 0; i < FTP_STAT_MAX; i++)
+        seq_printf(m, "%s %lld\n", ftp_event_names[i], (long long)atomic64_read(&stats->events[i]));
+    seq_puts(m, "\n# name count total_us histogram (bucket i below 2^i us)\n");
+    ftp_stats_show_hist(m, "wait", &stats->wait);
+    for (i = 0; i < FTP_CMD_MAX; i++)
+        if (atomic64_read(&stats->cmds[i]) > 0) {
+            /* commands may be counted without a reply, e.g. pipelined ones */
+            seq_printf(m, "%-8s sent %lld\n", ftp_cmd_names[i], (long long)atomic64_read(&stats->cmds[i]));
+            ftp_stats_show_hist(m, ftp_cmd_names[i], &stats->latency[i]);
+        }
+    return 0;
+}
+
+static int ftp_stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, ftp_stats_show, inode->i_private);
+}
+
+/* Any write resets the statistics. */
+static ssize_t ftp_stats_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos) {
+    struct ftp_stats *stats = ((struct seq_file*)file->private_data)->private;
+    struct dentry *dir = stats->dir;
+    ftp_stats_init(stats);
+    stats->dir = dir;
+    return len;
+}
+
+static const struct file_operations ftp_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = ftp_stats_open,
+    .read = seq_read,
+    .write = ftp_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void ftp_stats_register(struct ftp_stats *stats, const char *name) {
+    if (ftp_stats_root == NULL)
+        return;
+    stats->dir = debugfs_create_dir(name, ftp_stats_root);
+    if (IS_ERR_OR_NULL(stats->dir)) {
+        stats->dir = NULL;
+        return;
+    }
+    debugfs_create_file("stats", S_IRUSR | S_IWUSR, stats->dir, stats, &ftp_stats_fops);
+}
+
+void ftp_stats_unregister(struct ftp_stats *stats) {
+    debugfs_remove_recursive(stats->dir);
+    stats->dir = NULL;
+}
@@ -0,0 +1,83 @@
+/*
+ * Statistics of a mount: counts of FTP commands with their reply latencies,
+ * bytes transferred and events of the session pool. They are exported in
+ * debugfs as ftpfs/<device>/stats, and reset by writing to that file.
+ */
+#ifndef _STATS_H
+#define _STATS_H
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+
+/* FTP commands counted, see ftp_stats_cmd() */
+enum {
+    FTP_CMD_USER, FTP_CMD_PASS, FTP_CMD_TYPE, FTP_CMD_FEAT, FTP_CMD_EPSV,
+    FTP_CMD_PASV, FTP_CMD_REST, FTP_CMD_RETR, FTP_CMD_STOR, FTP_CMD_ABOR,
+    FTP_CMD_LIST, FTP_CMD_MLSD, FTP_CMD_MLST, FTP_CMD_SIZE, FTP_CMD_MDTM,
+    FTP_CMD_NOOP, FTP_CMD_RNFR, FTP_CMD_RNTO, FTP_CMD_DELE, FTP_CMD_MKD,
+    FTP_CMD_RMD, FTP_CMD_OTHER, FTP_CMD_MAX
+};
+
+/* Events counted */
+enum {
+    /* bytes received and sent on data connections */
+    FTP_STAT_RX_BYTES, FTP_STAT_TX_BYTES,
+    /* requests served by an open data transfer, and data transfers opened */
+    FTP_STAT_STREAM_HIT, FTP_STAT_STREAM_MISS,
+    /* data transfers aborted, of which closed as conflicting with a request
+     * on the same file or to free a session */
+    FTP_STAT_ABORT, FTP_STAT_CONFLICT, FTP_STAT_EVICT,
+    /* logins, failed ones, and sessions closed on error */
+    FTP_STAT_LOGIN, FTP_STAT_LOGIN_FAIL, FTP_STAT_DROP,
+    /* lookups, directory listings fetched or found in the cache, and files
+     * skipped by listings started over at a position */
+    FTP_STAT_LOOKUP, FTP_STAT_LISTING, FTP_STAT_LISTING_HIT, FTP_STAT_LISTING_SKIP,
+    FTP_STAT_MAX
+};
+
+/* Buckets of a latency histogram, bucket i counting latencies below 2^i
+ * microseconds (and at least 2^(i-1)), the last one all longer latencies */
+#define FTP_HIST_BUCKETS 24
+
+struct ftp_hist {
+    atomic64_t count[FTP_HIST_BUCKETS];
+    /* Sum of the latencies in microseconds */
+    atomic64_t sum;
+};
+
+struct ftp_stats {
+    atomic64_t events[FTP_STAT_MAX];
+    atomic64_t cmds[FTP_CMD_MAX];
+    /* Time from sending each command to its first reply */
+    struct ftp_hist latency[FTP_CMD_MAX];
+    /* Time waited for an idle session */
+    struct ftp_hist wait;
+    /* Directory in debugfs, NULL if not registered */
+    struct dentry *dir;
+};
+
+/* Create and remove the debugfs directory of the module. Failures are not
+ * fatal, statistics are only not exported then. */
+void ftp_stats_module_init(void);
+void ftp_stats_module_exit(void);
+
+void ftp_stats_init(struct ftp_stats *stats);
+/* Export <stats> in debugfs under <name>. */
+void ftp_stats_register(struct ftp_stats *stats, const char *name);
+void ftp_stats_unregister(struct ftp_stats *stats);
+
+/* Index of the command line <cmd> among FTP_CMD_*, and the name of one. */
+int ftp_stats_cmd(const char *cmd);
+const char* ftp_stats_cmd_name(int cmd);
+/* Add the time elapsed since <start> to the histogram and return it in
+ * microseconds. */
+s64 ftp_stats_time(struct ftp_hist *hist, ktime_t start);
+
+static inline void ftp_stats_add(struct ftp_stats *stats, int event, long n) {
+    atomic64_add(n, &stats->events[event]);
+}
+
+static inline void ftp_stats_inc(struct ftp_stats *stats, int event) {
+    atomic64_inc(&stats->events[event]);
+}
+
+#endif
@@ -4,16 +4,195 @@
 #include "sock.h"
 #include "ftp.h"
 
+#include <linux/seq_file.h>
+
+struct backing_dev_info ftp_fs_bdi;
+
+static int ftp_fs_remount(struct super_block *sb, int *flags, char *data);
+static int ftp_fs_show_options(struct seq_file *m, struct dentry *root);
+
 const struct super_operations ftp_fs_ops = {
+    .alloc_inode = ftp_fs_alloc_inode,
+    .destroy_inode = ftp_fs_destroy_inode,
     .statfs = simple_statfs,
-    .drop_inode = generic_delete_inode,
-    .show_options = generic_show_options,
+    .remount_fs = ftp_fs_remount,
+    .show_options = ftp_fs_show_options,
+};
+
+enum {
+    Opt_server, Opt_user, Opt_pass, Opt_sessions, Opt_rcvbuf, Opt_sndbuf,
+    Opt_attr_ttl, Opt_dir_ttl, Opt_ra_min, Opt_ra_max, Opt_stripes,
+    Opt_warm, Opt_keepalive, Opt_err
+};
+
+static const match_table_t ftp_fs_tokens = {
+    {Opt_server, "server=%s"},
+    {Opt_user, "user=%s"},
+    {Opt_pass, "pass=%s"},
+    {Opt_sessions, "sessions=%u"},
+    {Opt_rcvbuf, "rcvbuf=%u"},
+    {Opt_sndbuf, "sndbuf=%u"},
+    {Opt_attr_ttl, "attr_ttl=%u"},
+    {Opt_dir_ttl, "dir_ttl=%u"},
+    {Opt_ra_min, "ra_min=%u"},
+    {Opt_ra_max, "ra_max=%u"},
+    {Opt_stripes, "stripes=%u"},
+    {Opt_warm, "warm=%u"},
+    {Opt_keepalive, "keepalive=%u"},
+    {Opt_err, NULL}
 };
 
+/* Mount options parsed by ftp_fs_parse_options(). The strings are NULL if
+ * not given, and should later be freed by ftp_fs_free_options(). */
+struct ftp_fs_mount_opts {
+    struct sockaddr_in addr;
+    char *user, *pass;
+    int sessions;
+    struct ftp_options opts;
+};
+
+static void ftp_fs_free_options(struct ftp_fs_mount_opts *mo) {
+    kfree(mo->user);
+    kfree(mo->pass);
+}
+
+/* Parse the options string <data> of the form "server=ip[:port],user=...,
+ * pass=...,sessions=n,rcvbuf=bytes,sndbuf=bytes,attr_ttl=seconds,
+ * dir_ttl=seconds,ra_min=bytes,ra_max=bytes,stripes=n,warm=n,
+ * keepalive=seconds" into <mo>, on top of the values it holds. Return 0 for success and negative value for error. */
+static int ftp_fs_parse_options(char *data, struct ftp_fs_mount_opts *mo) {
+    substring_t args[MAX_OPT_ARGS];
+    char *p, *server, *sep;
+    unsigned int port;
+    int token, n, ret;
+    while (data != NULL && (p = strsep(&data, ",")) != NULL) {
+        if (*p == 0)
+            continue;
+        token = match_token(p, ftp_fs_tokens, args);
+        switch (token) {
+            case Opt_server:
+                if ((server = match_strdup(&args[0])) == NULL)
+                    return -ENOMEM;
+                /* the port is kept if not given */
+                port = ntohs(mo->addr.sin_port);
+                ret = 0;
+                if ((sep = strchr(server, ':')) != NULL) {
+                    *sep++ = 0;
+                    if (kstrtouint(sep, 10, &port) < 0 || port == 0 || port > 65535)
+                        ret = -EINVAL;
+                }
+                if (ret == 0)
+                    ret = cons_addr(server, port, &mo->addr);
+                kfree(server);
+                if (ret < 0)
+                    return ret;
+                break;
+            case Opt_user:
+                kfree(mo->user);
+                if ((mo->user = match_strdup(&args[0])) == NULL)
+                    return -ENOMEM;
+                break;
+            case Opt_pass:
+                kfree(mo->pass);
+                if ((mo->pass = match_strdup(&args[0])) == NULL)
+                    return -ENOMEM;
+                break;
+            case Opt_err:
+                pr_debug("unknown mount option %s\n", p);
+                return -EINVAL;
+            default:
+                /* the rest are all numbers */
+                if (match_int(&args[0], &n) < 0 || n < 0)
+                    return -EINVAL;
+                if ((token == Opt_attr_ttl || token == Opt_dir_ttl || token == Opt_keepalive) && n > MAX_TIME_OPTION)
+                    return -EINVAL;
+                switch (token) {
+                    case Opt_sessions: mo->sessions = n; break;
+                    case Opt_rcvbuf: mo->opts.rcvbuf = n; break;
+                    case Opt_sndbuf: mo->opts.sndbuf = n; break;
+                    case Opt_attr_ttl: mo->opts.attr_ttl = (unsigned long) n * HZ; break;
+                    case Opt_dir_ttl: mo->opts.dir_ttl = (unsigned long) n * HZ; break;
+                    case Opt_ra_min: mo->opts.ra_min = n; break;
+                    case Opt_ra_max: mo->opts.ra_max = n; break;
+                    case Opt_stripes: mo->opts.stripes = n; break;
+                    case Opt_warm: mo->opts.warm = n; break;
+                    case Opt_keepalive: mo->opts.keepalive = (unsigned long) n * HZ; break;
+                }
+                break;
+        }
+    }
+    if (mo->sessions < 1 || mo->opts.stripes < 1 || mo->opts.ra_min > mo->opts.ra_max)
+        return -EINVAL;
+    return 0;
+}
+
+static int ftp_fs_remount(struct super_block *sb, int *flags, char *data) {
+    struct ftp_info *info = sb->s_fs_info;
+    /* remounts are serialized, so the tunables are only changed here */
+    struct ftp_fs_mount_opts mo = {
+        .addr = info->addr,
+        .sessions = info->max_sock,
+        .opts = info->opts,
+    };
+    int ret;
+
+    if ((ret = ftp_fs_parse_options(data, &mo)) < 0)
+        goto out;
+    /* the sessions are kept, so only the tunables may change */
+    ret = -EINVAL;
+    if (mo.sessions != info->max_sock || (mo.user != NULL && strcmp(mo.user, info->user) != 0)
+            || (mo.pass != NULL && strcmp(mo.pass, info->pass) != 0)
+            || mo.addr.sin_addr.s_addr != info->addr.sin_addr.s_addr || mo.addr.sin_port != info->addr.sin_port)
+        goto out;
+    ftp_info_set_options(info, &mo.opts);
+    ret = 0;
+
+out:
+    if (ret == -EINVAL)
+        pr_debug("bad options on remount, only tunables can be changed\n");
+    ftp_fs_free_options(&mo);
+    return ret;
+}
+
+static int ftp_fs_show_options(struct seq_file *m, struct dentry *root) {
+    struct ftp_info *info = root->d_sb->s_fs_info;
+    struct ftp_options opts;
+    ftp_info_options(info, &opts);
+    /* the password is not shown */
+    seq_printf(m, ",server=%pI4:%u,user=%s,sessions=%d", &info->addr.sin_addr,
+            ntohs(info->addr.sin_port), info->user, info->max_sock);
+    if (opts.rcvbuf > 0)
+        seq_printf(m, ",rcvbuf=%d", opts.rcvbuf);
+    if (opts.sndbuf > 0)
+        seq_printf(m, ",sndbuf=%d", opts.sndbuf);
+    seq_printf(m, ",attr_ttl=%lu,dir_ttl=%lu,ra_min=%lu,ra_max=%lu,stripes=%d",
+            opts.attr_ttl / HZ, opts.dir_ttl / HZ,
+            opts.ra_min, opts.ra_max, opts.stripes);
+    seq_printf(m, ",warm=%d,keepalive=%lu", opts.warm, opts.keepalive / HZ);
+    return 0;
+}
+
 int ftp_fs_fill_super(struct super_block *sb, void *data, int silent) {
     struct inode* inode;
+    struct ftp_fs_mount_opts mo = {
+        .sessions = MAX_SOCK,
+        .opts = {
+            .attr_ttl = ATTR_CACHE_TIMEOUT * HZ,
+            .dir_ttl = DIR_CACHE_TTL * HZ,
+            .ra_min = READAHEAD_MIN,
+            .ra_max = READAHEAD_MAX,
+            .stripes = STRIPE_COUNT,
+            .warm = WARM_SOCK,
+            .keepalive = KEEPALIVE_INTERVAL * HZ,
+        },
+    };
+    struct ftp_info *ftp_info;
+    char name[16];
+    int ret;
 
     pr_debug("begin ftp_fs_fill_super\n");
+    if ((ret = cons_addr(FTP_IP, FTP_PORT, &mo.addr)) < 0 || (ret = ftp_fs_parse_options(data, &mo)) < 0)
+        goto out;
 
     /* set init infomation for the super block */
     sb->s_maxbytes = MAX_LFS_FILESIZE;
@@ -21,28 +200,35 @@ int ftp_fs_fill_super(struct super_block *sb, void *data, int silent) {
     sb->s_blocksize_bits = PAGE_CACHE_SHIFT;
     sb->s_magic = FTP_FS_MAGIC;
     sb->s_op = &ftp_fs_ops;
+    sb->s_d_op = &ftp_fs_dentry_operations;
+    sb->s_bdi = &ftp_fs_bdi;
     sb->s_time_gran = 1;
 
     /* initialize the gloabl ftp_info including the socket informations
      * and point the sb->s_fs_info to it */
-
-    struct sockaddr_in *addr = cons_addr(FTP_IP);
-    if (addr == NULL) return -1;
-    struct ftp_info *ftp_info;
-    if (ftp_info_init(&ftp_info, *addr, FTP_USERNAME, FTP_PASSWORD, MAX_SOCK) == -1) {
-        kfree(addr);
-        return -1;
-    }
+    ret = ftp_info_init(&ftp_info, mo.addr, mo.user != NULL ? mo.user : FTP_USERNAME,
+            mo.pass != NULL ? mo.pass : FTP_PASSWORD, mo.sessions, &mo.opts);
+    if (ret < 0)
+        goto out;
 
     sb->s_fs_info = ftp_info;
+    snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+    ftp_stats_register(&ftp_info->stats, name);
+    /* log in before the first request, failing early on a wrong server or
+     * credentials */
+    if ((ret = ftp_info_connect(ftp_info)) < 0)
+        goto out;
 
     /* get a inode ref for the super block */
     pr_debug("try to fetch a inode to store super block\n");
-    inode = ftp_fs_get_inode(sb, NULL, S_IFDIR, 0);
+    struct ftp_fs_key root = { .key = FTP_FS_ROOT_INO, .ino = FTP_FS_ROOT_INO, .mode = S_IFDIR, .by_path = 0 };
+    inode = ftp_fs_get_inode(sb, NULL, S_IFDIR, 0, &root);
     sb->s_root = d_make_root(inode);
-    if (!sb->s_root) return -ENOMEM;
+    ret = sb->s_root ? 0 : -ENOMEM;
 
-    return 0;
+out:
+    ftp_fs_free_options(&mo);
+    return ret;
 }
 
 struct dentry* ftp_fs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
@@ -50,14 +236,18 @@ struct dentry* ftp_fs_mount(struct file_system_type *fs_type, int flags, const c
 }
 
 void ftp_fs_umount(struct super_block *sb) {
-    /* free the ftp_info struct */
-    if (sb->s_fs_info) kfree(sb->s_fs_info);
-    kill_litter_super(sb);
+    struct ftp_info *info = sb->s_fs_info;
+    /* no dentry is pinned, the server keeps the files */
+    kill_anon_super(sb);
+    /* close the sessions and free the ftp_info struct */
+    if (info) ftp_info_destroy(info);
 }
 
 struct file_system_type ftp_fs_type = {
     .name = "ftpfs",
     .mount = ftp_fs_mount,
     .kill_sb = ftp_fs_umount,
+    /* ftp_fs_rename() moves the dentry under ftp_info.rename_seq */
+    .fs_flags = FS_RENAME_DOES_D_MOVE,
 };
 
@@ -0,0 +1,191 @@
+/*
+ * Tracepoints of FTP commands, sessions, data transfers and VFS entry points,
+ * under events/ftpfs in tracefs. Sessions are identified by the address of
+ * their ftp_conn_info, and latencies are in microseconds.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ftpfs
+
+#if !defined(_FTPFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FTPFS_TRACE_H
+#include <linux/tracepoint.h>
+
+/* Commands sent at once on a control connection, the password hidden */
+TRACE_EVENT(ftpfs_cmd,
+    TP_PROTO(const void *conn, const char *cmd),
+    TP_ARGS(conn, cmd),
+    TP_STRUCT__entry(
+        __field(const void*, conn)
+        __string(cmd, strncmp(cmd, "PASS ", 5) == 0 ? "PASS" : cmd)
+    ),
+    TP_fast_assign(
+        __entry->conn = conn;
+        __assign_str(cmd, strncmp(cmd, "PASS ", 5) == 0 ? "PASS" : cmd);
+    ),
+    TP_printk("session=%p cmd=%s", __entry->conn, __get_str(cmd))
+);
+
+/* A reply, with the command it is the first reply to and the time since the
+ * command was sent, or an empty command for unsolicited replies */
+TRACE_EVENT(ftpfs_reply,
+    TP_PROTO(const void *conn, const char *cmd, int code, s64 latency),
+    TP_ARGS(conn, cmd, code, latency),
+    TP_STRUCT__entry(
+        __field(const void*, conn)
+        __string(cmd, cmd)
+        __field(int, code)
+        __field(s64, latency)
+    ),
+    TP_fast_assign(
+        __entry->conn = conn;
+        __assign_str(cmd, cmd);
+        __entry->code = code;
+        __entry->latency = latency;
+    ),
+    TP_printk("session=%p cmd=%s code=%d latency=%lld", __entry->conn,
+        __get_str(cmd), __entry->code, __entry->latency)
+);
+
+/* A session taken from the pool for a request, <hit> if its data transfer
+ * was reused, and the time waited for it */
+TRACE_EVENT(ftpfs_session_acquire,
+    TP_PROTO(const void *conn, const char *cmd, unsigned long offset, int hit, s64 wait),
+    TP_ARGS(conn, cmd, offset, hit, wait),
+    TP_STRUCT__entry(
+        __field(const void*, conn)
+        __string(cmd, cmd != NULL ? cmd : "")
+        __field(unsigned long, offset)
+        __field(int, hit)
+        __field(s64, wait)
+    ),
+    TP_fast_assign(
+        __entry->conn = conn;
+        __assign_str(cmd, cmd != NULL ? cmd : "");
+        __entry->offset = offset;
+        __entry->hit = hit;
+        __entry->wait = wait;
+    ),
+    TP_printk("session=%p cmd=%s offset=%lu hit=%d wait=%lld", __entry->conn,
+        __get_str(cmd), __entry->offset, __entry->hit, __entry->wait)
+);
+
+/* A session returned to the pool, with its data transfer if any */
+TRACE_EVENT(ftpfs_session_release,
+    TP_PROTO(const void *conn, const char *cmd, unsigned long offset),
+    TP_ARGS(conn, cmd, offset),
+    TP_STRUCT__entry(
+        __field(const void*, conn)
+        __string(cmd, cmd != NULL ? cmd : "")
+        __field(unsigned long, offset)
+    ),
+    TP_fast_assign(
+        __entry->conn = conn;
+        __assign_str(cmd, cmd != NULL ? cmd : "");
+        __entry->offset = offset;
+    ),
+    TP_printk("session=%p cmd=%s offset=%lu", __entry->conn, __get_str(cmd), __entry->offset)
+);
+
+DECLARE_EVENT_CLASS(ftpfs_data_class,
+    TP_PROTO(const void *conn, const char *cmd, unsigned long offset, int ret),
+    TP_ARGS(conn, cmd, offset, ret),
+    TP_STRUCT__entry(
+        __field(const void*, conn)
+        __string(cmd, cmd != NULL ? cmd : "")
+        __field(unsigned long, offset)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->conn = conn;
+        __assign_str(cmd, cmd != NULL ? cmd : "");
+        __entry->offset = offset;
+        __entry->ret = ret;
+    ),
+    TP_printk("session=%p cmd=%s offset=%lu ret=%d", __entry->conn,
+        __get_str(cmd), __entry->offset, __entry->ret)
+);
+
+/* A data transfer opened at <offset>, and one closed at its current offset,
+ * by ABOR or by waiting for its completion */
+DEFINE_EVENT(ftpfs_data_class, ftpfs_data_open,
+    TP_PROTO(const void *conn, const char *cmd, unsigned long offset, int ret),
+    TP_ARGS(conn, cmd, offset, ret));
+DEFINE_EVENT(ftpfs_data_class, ftpfs_data_abort,
+    TP_PROTO(const void *conn, const char *cmd, unsigned long offset, int ret),
+    TP_ARGS(conn, cmd, offset, ret));
+DEFINE_EVENT(ftpfs_data_class, ftpfs_data_finish,
+    TP_PROTO(const void *conn, const char *cmd, unsigned long offset, int ret),
+    TP_ARGS(conn, cmd, offset, ret));
+
+DECLARE_EVENT_CLASS(ftpfs_io_class,
+    TP_PROTO(const char *path, unsigned long offset, unsigned long len, int ret),
+    TP_ARGS(path, offset, len, ret),
+    TP_STRUCT__entry(
+        __string(path, path)
+        __field(unsigned long, offset)
+        __field(unsigned long, len)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __assign_str(path, path);
+        __entry->offset = offset;
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+    TP_printk("path=%s offset=%lu len=%lu ret=%d", __get_str(path),
+        __entry->offset, __entry->len, __entry->ret)
+);
+
+/* Data read from or written to a file on the server */
+DEFINE_EVENT(ftpfs_io_class, ftpfs_read,
+    TP_PROTO(const char *path, unsigned long offset, unsigned long len, int ret),
+    TP_ARGS(path, offset, len, ret));
+DEFINE_EVENT(ftpfs_io_class, ftpfs_write,
+    TP_PROTO(const char *path, unsigned long offset, unsigned long len, int ret),
+    TP_ARGS(path, offset, len, ret));
+
+/* Entry to and return from a VFS operation <op> on inode <ino>; <pos> and
+ * <count> are the range of I/O operations, 0 for others */
+TRACE_EVENT(ftpfs_vfs_enter,
+    TP_PROTO(const char *op, unsigned long ino, loff_t pos, size_t count),
+    TP_ARGS(op, ino, pos, count),
+    TP_STRUCT__entry(
+        __string(op, op)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __assign_str(op, op);
+        __entry->ino = ino;
+        __entry->pos = pos;
+        __entry->count = count;
+    ),
+    TP_printk("op=%s ino=%lu pos=%lld count=%zu", __get_str(op), __entry->ino,
+        __entry->pos, __entry->count)
+);
+
+TRACE_EVENT(ftpfs_vfs_exit,
+    TP_PROTO(const char *op, unsigned long ino, long ret),
+    TP_ARGS(op, ino, ret),
+    TP_STRUCT__entry(
+        __string(op, op)
+        __field(unsigned long, ino)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __assign_str(op, op);
+        __entry->ino = ino;
+        __entry->ret = ret;
+    ),
+    TP_printk("op=%s ino=%lu ret=%ld", __get_str(op), __entry->ino, __entry->ret)
+);
+
+#endif
+
+/* the header is found in the module directory, see the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
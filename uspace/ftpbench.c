@@ -0,0 +1,374 @@
+/*
+ * Microbenchmarks of the protocol core in user space:
+ *
+ *   ftpbench list [lines]              LIST (ls and DOS formats) and MLSD lines
+ *                                      parsed per second
+ *   ftpbench lookup [files]            names found and missed per second in a
+ *                                      cached listing
+ *   ftpbench reply [replies]           cost of receiving a reply
+ *   ftpbench pool [threads] [sessions] [stream]
+ *                                      acquire and release of pool sessions
+ *   ftpbench fetch host port file      read a file from a server, e.g.
+ *                                      bench/ftpd.py, end to end
+ *   ftpbench readdir host port dir [batch]
+ *                                      read a directory from a server in
+ *                                      batches of entries, as readdir does
+ *
+ * Results are printed one per line as "<name> <ops> <ns/op> <ops/s>". The
+ * static functions of ftp.c are reached by including it.
+ */
+#include "../ftp.c"
+#include "../ftpfs.h"
+
+static ktime_t bench_start;
+
+static void bench_begin(void) {
+    bench_start = ktime_get();
+}
+
+static void bench_end(const char *name, unsigned long ops) {
+    s64 ns = ktime_get() - bench_start;
+    printf("%-16s %10lu %10.1f ns/op %12.0f ops/s\n", name, ops,
+            (double)ns / ops, ops * 1e9 / (ns > 0 ? ns : 1));
+}
+
+/* Formats of the synthetic listings */
+enum { BENCH_LS, BENCH_LS_NOGROUP, BENCH_DOS, BENCH_MLSD, BENCH_FORMATS };
+static const char *bench_formats[] = {"list_ls", "list_ls_nogroup", "list_dos", "list_mlsd"};
+
+/* A listing of <n> files in <format>, whose lines are separated by '\0' as
+ * the socket reader returns them. */
+static char* bench_listing(unsigned long n, int format) {
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    char *buf = malloc(n * 128), *ptr = buf;
+    unsigned long i;
+    if (buf == NULL)
+        return NULL;
+    for (i = 0; i < n; i++)
+        switch (format) {
+            case BENCH_LS:
+            case BENCH_LS_NOGROUP:
+                ptr += sprintf(ptr, "%s   1 ftp%s %12lu %s %2lu %s file%07lu",
+                        i % 8 == 0 ? "drwxr-xr-x" : "-rw-r--r--", format == BENCH_LS ? "      ftp     " : "",
+                        i * 977, months[i % 12], i % 28 + 1, i % 2 ? "12:34" : " 2015", i) + 1;
+                break;
+            case BENCH_DOS:
+                if (i % 8 == 0)
+                    ptr += sprintf(ptr, "%02lu-%02lu-16  %02lu:%02lu%s       <DIR>          dir%07lu",
+                            i % 12 + 1, i % 28 + 1, i % 12 + 1, i % 60, i % 2 ? "AM" : "PM", i) + 1;
+                else
+                    ptr += sprintf(ptr, "%02lu-%02lu-16  %02lu:%02lu%s %19lu file%07lu",
+                            i % 12 + 1, i % 28 + 1, i % 12 + 1, i % 60, i % 2 ? "AM" : "PM", i * 977, i) + 1;
+                break;
+            case BENCH_MLSD:
+                ptr += sprintf(ptr, "type=%s;size=%lu;modify=2016%02lu%02lu%02lu%02lu%02lu;unique=803g%lx; file%07lu",
+                        i % 8 == 0 ? "dir" : "file", i * 977, i % 12 + 1, i % 28 + 1, i % 24, i % 60, i % 60, i, i) + 1;
+                break;
+        }
+    return buf;
+}
+
+/* Parse listings of <n> lines in each format as ftp_list_dir() does, with the
+ * names copied into chunks. */
+static int bench_list(unsigned long n) {
+    struct ftp_file_info *files = malloc(n * sizeof(struct ftp_file_info));
+    struct ftp_names *names;
+    unsigned long i;
+    char *lines, *line, *fact_name;
+    const char *name;
+    int format, name_len, ret;
+    if (files == NULL)
+        return -ENOMEM;
+    /* fault the array in before timing */
+    memset(files, 0, n * sizeof(struct ftp_file_info));
+    for (format = 0; format < BENCH_FORMATS; format++) {
+        if ((lines = bench_listing(n, format)) == NULL)
+            return -ENOMEM;
+        names = NULL;
+        bench_begin();
+        for (line = lines, i = 0; i < n; i++, line += strlen(line) + 1) {
+            if (format == BENCH_MLSD) {
+                ret = ftp_parse_facts(line, &files[i], &fact_name);
+                name = fact_name;
+                name_len = strlen(name);
+            } else
+                ret = ftp_parse_list_line(line, 2016, 1500000000, &files[i], &name, &name_len);
+            if (ret != 0 || (files[i].name = ftp_names_add(&names, name, name_len)) == NULL) {
+                fprintf(stderr, "cannot parse: %s\n", line);
+                return -EIO;
+            }
+        }
+        bench_end(bench_formats[format], n);
+        ftp_names_free(names);
+        free(lines);
+    }
+    free(files);
+    return 0;
+}
+
+/* Look up each of the <n> files of a cached listing by name, then as many
+ * names missing from it, as ftp_stat() does. */
+static int bench_lookup(unsigned long n) {
+    struct ftp_file_info *files = calloc(n, sizeof(struct ftp_file_info));
+    struct ftp_names *names = NULL;
+    struct ftp_dir_info *dir;
+    unsigned long i, found;
+    char name[32];
+    int len;
+    if (files == NULL)
+        return -ENOMEM;
+    for (i = 0; i < n; i++) {
+        len = sprintf(name, "file%07lu.o", i);
+        if ((files[i].name = ftp_names_add(&names, name, len)) == NULL)
+            return -ENOMEM;
+    }
+    bench_begin();
+    if ((dir = ftp_dir_alloc("/bench", n, files, names)) == NULL)
+        return -ENOMEM;
+    bench_end("lookup_index", n);
+    for (found = 0; found < 2; found++) {
+        bench_begin();
+        for (i = 0; i < n; i++) {
+            len = sprintf(name, found ? "file%07lu.o" : "file%07lu.c", (i * 7919) % n);
+            if ((ftp_dir_find(dir, name, len) != NULL) != found) {
+                fprintf(stderr, "lookup of %s is wrong\n", name);
+                return -EIO;
+            }
+        }
+        bench_end(found ? "lookup_hit" : "lookup_miss", n);
+    }
+    ftp_dir_put(dir);
+    return 0;
+}
+
+static int bench_reply(unsigned long n) {
+    static const char *replies[] = {
+        "150 Opening BINARY mode data connection\r\n",
+        "226 Transfer complete\r\n",
+        "229 Entering Extended Passive Mode (|||50123|)\r\n",
+        "350 Restarting at 1048576. Send STORE or RETRIEVE to initiate transfer\r\n",
+        "211-Features:\r\n MDTM\r\n MLST type*;size*;modify*;unique*;\r\n SIZE\r\n EPSV\r\n REST STREAM\r\n211 End\r\n",
+    };
+    struct ftp_stats stats;
+    struct ftp_conn_info conn;
+    unsigned long i, round, rounds = 10, size = 0;
+    char *pristine, *ptr;
+    int ret;
+    for (i = 0; i < n; i++)
+        size += strlen(replies[i % ARRAY_SIZE(replies)]);
+    if ((pristine = malloc(size)) == NULL)
+        return -ENOMEM;
+    for (ptr = pristine, i = 0; i < n; i++)
+        ptr = stpcpy(ptr, replies[i % ARRAY_SIZE(replies)]);
+    memset(&conn, 0, sizeof(conn));
+    ftp_stats_init(&stats);
+    conn.stats = &stats;
+    /* all replies are buffered, the socket is never read */
+    if ((conn.control_rd.buf = malloc(size)) == NULL)
+        return -ENOMEM;
+    conn.control_rd.size = size;
+    bench_begin();
+    for (round = 0; round < rounds; round++) {
+        memcpy(conn.control_rd.buf, pristine, size);
+        conn.control_rd.start = 0;
+        conn.control_rd.end = size;
+        for (i = 0; i < n; i++)
+            if ((ret = ftp_conn_recv(&conn, NULL)) < 0) {
+                fprintf(stderr, "cannot parse reply %lu: %d\n", i, ret);
+                return ret;
+            }
+    }
+    bench_end("reply", n * rounds);
+    sock_reader_destroy(&conn.control_rd);
+    free(pristine);
+    return 0;
+}
+
+struct bench_thread {
+    pthread_t thread;
+    struct ftp_info *info;
+    /* file of the data transfer asked for, NULL for none */
+    const char *file;
+    unsigned long ops;
+};
+
+static void* bench_pool_thread(void *data) {
+    struct bench_thread *t = data;
+    struct ftp_conn_info *conn;
+    unsigned long i;
+    for (i = 0; i < t->ops; i++) {
+        ftp_find_conn(t->info, t->file != NULL ? "RETR" : NULL, t->file, 0, &conn);
+        ftp_release_conn(t->info, conn);
+    }
+    return NULL;
+}
+
+static int bench_pool(int threads, int sessions, int stream) {
+    struct ftp_options opts = { .dir_ttl = DIR_CACHE_TTL * HZ, .stripes = 1 };
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    struct bench_thread *t = calloc(threads, sizeof(struct bench_thread));
+    struct ftp_conn_info *conn;
+    struct ftp_info *info;
+    char name[48];
+    int i, ret;
+    if (t == NULL || (ret = ftp_info_init(&info, addr, "bench", "bench", sessions, &opts)) < 0)
+        return -ENOMEM;
+    /* with <stream>, each session gets an idle data transfer (never read)
+     * of a file of its own, which the threads ask for */
+    for (i = 0; stream && i < sessions; i++) {
+        conn = ftp_pool_take(info);
+        conn->data_sock = (struct socket*)conn;
+        sprintf(name, "bench%d", i);
+        ftp_conn_cmd(conn, "RETR", name);
+        conn->hash = ftp_stream_hash(name);
+        conn->offset = 0;
+        ftp_release_conn(info, conn);
+    }
+    for (i = 0; i < threads; i++) {
+        t[i].info = info;
+        t[i].ops = 1000000 / threads;
+        /* the file name follows "RETR ./" in the command */
+        t[i].file = stream ? info->conn_list[i % sessions].cmd + 7 : NULL;
+    }
+    bench_begin();
+    for (i = 0; i < threads; i++)
+        pthread_create(&t[i].thread, NULL, bench_pool_thread, &t[i]);
+    for (i = 0; i < threads; i++)
+        pthread_join(t[i].thread, NULL);
+    sprintf(name, "pool%s_%dx%d", stream ? "_stream" : "", threads, sessions);
+    bench_end(name, t[0].ops * threads);
+    printf("%-16s hit %lld miss %lld evict %lld\n", name,
+            (long long)atomic64_read(&info->stats.events[FTP_STAT_STREAM_HIT]),
+            (long long)atomic64_read(&info->stats.events[FTP_STAT_STREAM_MISS]),
+            (long long)atomic64_read(&info->stats.events[FTP_STAT_EVICT]));
+    for (i = 0; i < sessions; i++)
+        info->conn_list[i].data_sock = NULL;
+    ftp_info_destroy(info);
+    free(t);
+    return 0;
+}
+
+/* Set up a pool of sessions with the server at <host>:<port>. */
+static int bench_connect(const char *host, int port, struct ftp_info **info) {
+    struct ftp_options opts = {
+        .attr_ttl = ATTR_CACHE_TIMEOUT * HZ, .dir_ttl = DIR_CACHE_TTL * HZ,
+        .ra_min = READAHEAD_MIN, .ra_max = READAHEAD_MAX, .stripes = 1, .warm = 1,
+    };
+    struct sockaddr_in addr;
+    int ret;
+    if ((ret = cons_addr(host, port, &addr)) < 0)
+        return ret;
+    if ((ret = ftp_info_init(info, addr, "bench", "bench", MAX_SOCK, &opts)) < 0)
+        return ret;
+    if ((ret = ftp_info_connect(*info)) < 0)
+        ftp_info_destroy(*info);
+    return ret;
+}
+
+static int bench_fetch(const char *host, int port, const char *file) {
+    struct ftp_info *info;
+    unsigned long offset = 0, len = 1 << 20;
+    char *buf = malloc(len);
+    int ret;
+    if (buf == NULL)
+        return -ENOMEM;
+    if ((ret = bench_connect(host, port, &info)) < 0)
+        goto out;
+    bench_begin();
+    while ((ret = ftp_read_file(info, file, offset, buf, len, READAHEAD_MAX)) > 0)
+        offset += ret;
+    if (ret == 0) {
+        bench_end("fetch_MiB", offset >> 20 ? offset >> 20 : 1);
+        printf("%-16s %lu bytes\n", "fetch", offset);
+    }
+    ftp_close_file(info, file);
+    ftp_info_destroy(info);
+
+out:
+    free(buf);
+    return ret;
+}
+
+/* Batch of entries of a directory read, as one getdents() call */
+struct bench_batch {
+    unsigned long left;
+    /* FNV-1a of the names in order, which tells a lost or repeated entry */
+    u64 hash;
+};
+
+static int bench_emit(void *data, const struct ftp_file_info *file, const char *name, int len) {
+    struct bench_batch *batch = data;
+    int i;
+    if (batch->left == 0)
+        return 1;
+    batch->left--;
+    for (i = 0; i < len; i++)
+        batch->hash = (batch->hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    batch->hash = (batch->hash ^ '/') * 0x100000001b3ULL;
+    return 0;
+}
+
+/* Read the directory <dir> in batches of <size> entries, as readdir does
+ * with a getdents() buffer, then again from the listing cache if it is small
+ * enough to be cached. */
+static int bench_readdir(const char *host, int port, const char *dir, unsigned long size) {
+    struct bench_batch batch = { .hash = 0xcbf29ce484222325ULL };
+    struct ftp_info *info;
+    unsigned long pos, round;
+    u64 hash = 0;
+    int ret;
+    if ((ret = bench_connect(host, port, &info)) < 0)
+        return ret;
+    for (round = 0; round < 2; round++) {
+        bench_begin();
+        for (pos = 0; ; pos += ret) {
+            batch.left = size;
+            if ((ret = ftp_iterate_dir(info, dir, pos, bench_emit, &batch)) <= 0)
+                break;
+            if (pos == 0)
+                bench_end(round ? "readdir_cached_first" : "readdir_first", ret);
+        }
+        if (ret < 0)
+            break;
+        bench_end(round ? "readdir_cached" : "readdir", pos ? pos : 1);
+        printf("%-16s %lu entries hash %016llx\n", "readdir", pos, (unsigned long long)batch.hash);
+        if (round > 0 && batch.hash != hash)
+            fprintf(stderr, "readdir: entries differ between rounds\n");
+        hash = batch.hash;
+        batch.hash = 0xcbf29ce484222325ULL;
+    }
+    ftp_info_destroy(info);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int ret;
+    if (argc >= 2 && strcmp(argv[1], "list") == 0)
+        ret = bench_list(argc > 2 ? strtoul(argv[2], NULL, 0) : 2000000);
+    else if (argc >= 2 && strcmp(argv[1], "lookup") == 0)
+        ret = bench_lookup(argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000);
+    else if (argc >= 2 && strcmp(argv[1], "reply") == 0)
+        ret = bench_reply(argc > 2 ? strtoul(argv[2], NULL, 0) : 100000);
+    else if (argc >= 2 && strcmp(argv[1], "pool") == 0) {
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        int sessions = argc > 3 ? atoi(argv[3]) : threads;
+        int stream = argc > 4 && strcmp(argv[4], "stream") == 0;
+        /* a stream missed would be evicted, whose socket is not real */
+        if (threads <= 0 || sessions <= 0 || (stream && threads > sessions))
+            goto usage;
+        ret = bench_pool(threads, sessions, stream);
+    } else if (argc >= 5 && strcmp(argv[1], "fetch") == 0)
+        ret = bench_fetch(argv[2], atoi(argv[3]), argv[4]);
+    else if (argc >= 5 && strcmp(argv[1], "readdir") == 0)
+        ret = bench_readdir(argv[2], atoi(argv[3]), argv[4], argc > 5 ? strtoul(argv[5], NULL, 0) : 1000);
+    else
+        goto usage;
+    if (ret < 0)
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(-ret));
+    return ret < 0;
+
+usage:
+    fprintf(stderr, "usage: %s list [lines] | lookup [files] | reply [replies] | pool [threads] [sessions] [stream]"
+            " | fetch host port file | readdir host port dir [batch]\n", argv[0]);
+    return 2;
+}
@@ -0,0 +1,319 @@
+/*
+ * Kernel API used by the protocol core (ftp.c, sock.c, dircache.c, stats.c)
+ * on top of libc and pthreads, so that it is built in user space. Every
+ * <linux/...> header of these files includes this one. Only what they use is
+ * provided, see kshim.c for the functions.
+ */
+#ifndef _KSHIM_H
+#define _KSHIM_H
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+typedef uint8_t u8;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+
+#define __user
+#define __init
+#define __exit
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define ACCESS_ONCE(x) (*(volatile __typeof__(x)*)&(x))
+#define THIS_MODULE NULL
+
+#ifdef DEBUG
+#define pr_debug(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define pr_debug(...) do { if (0) fprintf(stderr, __VA_ARGS__); } while (0)
+#endif
+#define pr_info(...) fprintf(stderr, __VA_ARGS__)
+#define pr_warn(...) fprintf(stderr, __VA_ARGS__)
+#define pr_err(...) fprintf(stderr, __VA_ARGS__)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(p, t, m) ((t*)((char*)(p) - offsetof(t, m)))
+#define ilog2(n) (63 - __builtin_clzll(n))
+#define BUG_ON(x) do { if (x) abort(); } while (0)
+
+#define ERR_PTR(e) ((void*)(long)(e))
+#define PTR_ERR(p) ((long)(p))
+#define IS_ERR(p) ((unsigned long)(p) >= (unsigned long)-4095)
+#define IS_ERR_OR_NULL(p) ((p) == NULL || IS_ERR(p))
+
+/* file modes, <sys/stat.h> would include the uapi <linux/stat.h> */
+#define S_IFMT 00170000
+#define S_IFLNK 0120000
+#define S_IFREG 0100000
+#define S_IFDIR 0040000
+#define S_IRWXU 00700
+#define S_IRUSR 00400
+#define S_IWUSR 00200
+#define S_IXUSR 00100
+#define S_IRGRP 00040
+#define S_IWGRP 00020
+#define S_IXGRP 00010
+#define S_IROTH 00004
+#define S_IWOTH 00002
+#define S_IXOTH 00001
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#define S_ISLNK(m) (((m) & S_IFMT) == S_IFLNK)
+
+/* memory */
+#define GFP_KERNEL 0
+#define GFP_NOFS 0
+#define kmalloc(s, f) malloc(s)
+#define kzalloc(s, f) calloc(1, s)
+#define kcalloc(n, s, f) calloc(n, s)
+#define kfree(p) free((void*)(p))
+#define kstrdup(s, f) strdup(s)
+#define vmalloc(s) malloc(s)
+#define vfree(p) free(p)
+#define simple_strtoul strtoul
+#define simple_strtoull strtoull
+
+/* time, jiffies are milliseconds of the monotonic clock */
+#define HZ 1000
+unsigned long jiffies_now(void);
+#define jiffies jiffies_now()
+#define time_before(a, b) ((long)((a) - (b)) < 0)
+#define time_after(a, b) time_before(b, a)
+#define time_after_eq(a, b) ((long)((a) - (b)) >= 0)
+#define msecs_to_jiffies(m) ((unsigned long)(m))
+/* mktime() of the kernel takes the broken down time, not a struct tm */
+#define mktime kshim_mktime
+unsigned long mktime(unsigned int year, unsigned int mon, unsigned int day,
+        unsigned int hour, unsigned int min, unsigned int sec);
+void do_gettimeofday(struct timeval *tv);
+void time_to_tm(time_t t, int offset, struct tm *res);
+typedef s64 ktime_t;
+ktime_t ktime_get(void);
+#define ktime_to_ns(k) (k)
+#define ktime_sub(a, b) ((a) - (b))
+#define ktime_us_delta(a, b) (((a) - (b)) / 1000)
+
+/* spinlocks are mutexes, which valgrind and perf see through */
+typedef struct { pthread_mutex_t m; } spinlock_t;
+#define spin_lock_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l) pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->m)
+
+/* seqcounts, written under a lock */
+typedef struct { unsigned sequence; } seqcount_t;
+#define seqcount_init(s) ((s)->sequence = 0)
+static inline unsigned read_seqcount_begin(const seqcount_t *s) {
+    unsigned ret;
+    while ((ret = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return ret;
+}
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+static inline void write_seqcount_begin(seqcount_t *s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+static inline void write_seqcount_end(seqcount_t *s) {
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/* atomics */
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+#define atomic_set(a, v) __atomic_store_n(&(a)->counter, v, __ATOMIC_SEQ_CST)
+#define atomic_read(a) __atomic_load_n(&(a)->counter, __ATOMIC_SEQ_CST)
+#define atomic_inc(a) ((void)__atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec_and_test(a) (__atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+#define atomic64_set(a, v) __atomic_store_n(&(a)->counter, v, __ATOMIC_SEQ_CST)
+#define atomic64_read(a) __atomic_load_n(&(a)->counter, __ATOMIC_SEQ_CST)
+#define atomic64_add(v, a) ((void)__atomic_add_fetch(&(a)->counter, v, __ATOMIC_SEQ_CST))
+#define atomic64_inc(a) atomic64_add(1, a)
+
+/* lists */
+struct list_head { struct list_head *next, *prev; };
+static inline void INIT_LIST_HEAD(struct list_head *h) { h->next = h->prev = h; }
+static inline void __list_add(struct list_head *n, struct list_head *prev, struct list_head *next) {
+    next->prev = n;
+    n->next = next;
+    n->prev = prev;
+    prev->next = n;
+}
+static inline void list_add(struct list_head *n, struct list_head *h) { __list_add(n, h, h->next); }
+static inline void list_add_tail(struct list_head *n, struct list_head *h) { __list_add(n, h->prev, h); }
+static inline void list_del(struct list_head *e) {
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+}
+static inline void list_del_init(struct list_head *e) { list_del(e); INIT_LIST_HEAD(e); }
+static inline void list_move(struct list_head *e, struct list_head *h) { list_del(e); list_add(e, h); }
+static inline void list_move_tail(struct list_head *e, struct list_head *h) { list_del(e); list_add_tail(e, h); }
+static inline int list_empty(const struct list_head *h) { return h->next == h; }
+#define list_entry(p, t, m) container_of(p, t, m)
+#define list_first_entry(h, t, m) list_entry((h)->next, t, m)
+#define list_last_entry(h, t, m) list_entry((h)->prev, t, m)
+#define list_for_each_entry(p, h, m) \
+    for (p = list_entry((h)->next, __typeof__(*p), m); &p->m != (h); \
+            p = list_entry(p->m.next, __typeof__(*p), m))
+#define list_for_each_entry_safe(p, n, h, m) \
+    for (p = list_entry((h)->next, __typeof__(*p), m), n = list_entry(p->m.next, __typeof__(*p), m); \
+            &p->m != (h); p = n, n = list_entry(n->m.next, __typeof__(*n), m))
+
+struct hlist_node { struct hlist_node *next, **pprev; };
+struct hlist_head { struct hlist_node *first; };
+#define INIT_HLIST_HEAD(h) ((h)->first = NULL)
+static inline void INIT_HLIST_NODE(struct hlist_node *n) { n->next = NULL; n->pprev = NULL; }
+static inline int hlist_unhashed(const struct hlist_node *n) { return n->pprev == NULL; }
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h) {
+    n->next = h->first;
+    if (h->first != NULL)
+        h->first->pprev = &n->next;
+    h->first = n;
+    n->pprev = &h->first;
+}
+static inline void hlist_del(struct hlist_node *n) {
+    *n->pprev = n->next;
+    if (n->next != NULL)
+        n->next->pprev = n->pprev;
+}
+static inline void hlist_del_init(struct hlist_node *n) {
+    if (!hlist_unhashed(n)) {
+        hlist_del(n);
+        INIT_HLIST_NODE(n);
+    }
+}
+#define hlist_entry(p, t, m) container_of(p, t, m)
+#define hlist_entry_safe(p, t, m) ({ __typeof__(p) ____p = (p); ____p ? hlist_entry(____p, t, m) : NULL; })
+#define hlist_for_each_entry(p, h, m) \
+    for (p = hlist_entry_safe((h)->first, __typeof__(*p), m); p; \
+            p = hlist_entry_safe(p->m.next, __typeof__(*p), m))
+#define hlist_for_each_entry_safe(p, n, h, m) \
+    for (p = hlist_entry_safe((h)->first, __typeof__(*p), m); p && ({ n = p->m.next; 1; }); \
+            p = hlist_entry_safe(n, __typeof__(*p), m))
+
+unsigned int full_name_hash(const unsigned char *name, unsigned int len);
+#define GOLDEN_RATIO_PRIME_32 0x9e370001UL
+static inline u32 hash_32(u32 val, unsigned int bits) { return (u32)(val * GOLDEN_RATIO_PRIME_32) >> (32 - bits); }
+
+/* kref */
+struct kref { atomic_t refcount; };
+#define kref_init(k) atomic_set(&(k)->refcount, 1)
+#define kref_get(k) atomic_inc(&(k)->refcount)
+#define kref_put(k, release) (atomic_dec_and_test(&(k)->refcount) ? ((release)(k), 1) : 0)
+
+/* completions and wait queues. The condition of wait_event() is evaluated
+ * with the mutex of the queue held, and wake_up() takes it, so that a wake up
+ * after the condition was found false is not lost. */
+struct completion { pthread_mutex_t m; pthread_cond_t c; int done; };
+void init_completion(struct completion *x);
+void complete(struct completion *x);
+void wait_for_completion(struct completion *x);
+typedef struct { pthread_mutex_t m; pthread_cond_t c; } wait_queue_head_t;
+void init_waitqueue_head(wait_queue_head_t *q);
+void wake_up(wait_queue_head_t *q);
+#define wait_event(q, cond) do { \
+    pthread_mutex_lock(&(q).m); \
+    while (!(cond)) \
+        pthread_cond_wait(&(q).c, &(q).m); \
+    pthread_mutex_unlock(&(q).m); \
+} while (0)
+
+/* workqueues, each work item queued runs on a thread of its own */
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+struct work_struct {
+    work_func_t func;
+    /* queued but not started, running, and cancelled while delayed */
+    int pending, running, cancel;
+    unsigned long delay;
+};
+struct delayed_work { struct work_struct work; };
+struct workqueue_struct;
+#define INIT_WORK(w, f) do { memset(w, 0, sizeof(struct work_struct)); (w)->func = (f); } while (0)
+#define INIT_DELAYED_WORK(d, f) INIT_WORK(&(d)->work, f)
+#define to_delayed_work(w) container_of(w, struct delayed_work, work)
+#define WQ_UNBOUND 0
+#define WQ_MEM_RECLAIM 0
+struct workqueue_struct* alloc_workqueue(const char *fmt, unsigned int flags, int max_active, ...);
+void destroy_workqueue(struct workqueue_struct *wq);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay);
+bool mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay);
+bool flush_work(struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
+bool cancel_delayed_work_sync(struct delayed_work *dwork);
+extern struct workqueue_struct *system_wq, *system_unbound_wq;
+
+/* sockets, backed by file descriptors */
+struct socket;
+struct proto_ops {
+    int (*connect)(struct socket *sock, struct sockaddr *addr, int len, int flags);
+};
+struct socket {
+    int fd;
+    const struct proto_ops *ops;
+};
+struct kvec { void *iov_base; size_t iov_len; };
+/* a page is a buffer of the caller, only sent from */
+struct page { void *addr; };
+int sock_create(int family, int type, int proto, struct socket **res);
+void sock_release(struct socket *sock);
+int kernel_sendmsg(struct socket *sock, struct msghdr *msg, struct kvec *vec, size_t num, size_t len);
+int kernel_recvmsg(struct socket *sock, struct msghdr *msg, struct kvec *vec, size_t num, size_t len, int flags);
+int kernel_sendpage(struct socket *sock, struct page *page, int offset, size_t size, int flags);
+int kernel_setsockopt(struct socket *sock, int level, int optname, char *optval, unsigned int optlen);
+/* the whole of <src> is parsed, <delim> and <end> are not supported */
+int in4_pton(const char *src, int srclen, u8 *dst, int delim, const char **end);
+
+/* debugfs and seq_file, for stats.c: nothing is exported in user space */
+struct dentry;
+struct inode { void *i_private; };
+struct file { void *private_data; };
+struct seq_file { void *private; };
+struct file_operations {
+    void *owner;
+    int (*open)(struct inode *inode, struct file *file);
+    ssize_t (*read)(struct file *file, char __user *buf, size_t len, loff_t *pos);
+    ssize_t (*write)(struct file *file, const char __user *buf, size_t len, loff_t *pos);
+    loff_t (*llseek)(struct file *file, loff_t off, int whence);
+    int (*release)(struct inode *inode, struct file *file);
+};
+struct dentry* debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry* debugfs_create_file(const char *name, umode_t mode, struct dentry *parent,
+        void *data, const struct file_operations *fops);
+void debugfs_remove_recursive(struct dentry *dentry);
+int single_open(struct file *file, int (*show)(struct seq_file *m, void *v), void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t len, loff_t *pos);
+loff_t seq_lseek(struct file *file, loff_t off, int whence);
+int seq_printf(struct seq_file *m, const char *fmt, ...);
+int seq_puts(struct seq_file *m, const char *s);
+int seq_putc(struct seq_file *m, char c);
+
+#endif
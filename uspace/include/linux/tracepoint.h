@@ -0,0 +1,11 @@
+/* Tracepoints compile to empty functions in user space */
+#ifndef _KSHIM_TRACEPOINT_H
+#define _KSHIM_TRACEPOINT_H
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) {}
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+    static inline void trace_##name(proto) {}
+#endif
@@ -0,0 +1 @@
+/* tracepoints are not defined in user space */
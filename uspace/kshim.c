@@ -0,0 +1,331 @@
+/*
+ * Functions of the kernel API emulated in user space, see kshim.h.
+ */
+#include "kshim.h"
+#include <stdarg.h>
+#include <unistd.h>
+
+unsigned long jiffies_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+ktime_t ktime_get(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#undef mktime
+unsigned long kshim_mktime(unsigned int year, unsigned int mon, unsigned int day,
+        unsigned int hour, unsigned int min, unsigned int sec) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = mon - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = hour;
+    tm.tm_min = min;
+    tm.tm_sec = sec;
+    return timegm(&tm);
+}
+
+void do_gettimeofday(struct timeval *tv) {
+    gettimeofday(tv, NULL);
+}
+
+void time_to_tm(time_t t, int offset, struct tm *res) {
+    t += offset;
+    gmtime_r(&t, res);
+}
+
+/* the partial_name_hash() of the kernel */
+unsigned int full_name_hash(const unsigned char *name, unsigned int len) {
+    unsigned long hash = 0;
+    unsigned char c;
+    while (len--) {
+        c = *name++;
+        hash = (hash + (c << 4) + (c >> 4)) * 11;
+    }
+    return (unsigned int)hash;
+}
+
+void init_completion(struct completion *x) {
+    pthread_mutex_init(&x->m, NULL);
+    pthread_cond_init(&x->c, NULL);
+    x->done = 0;
+}
+
+void complete(struct completion *x) {
+    pthread_mutex_lock(&x->m);
+    x->done++;
+    pthread_cond_signal(&x->c);
+    pthread_mutex_unlock(&x->m);
+}
+
+void wait_for_completion(struct completion *x) {
+    pthread_mutex_lock(&x->m);
+    while (x->done == 0)
+        pthread_cond_wait(&x->c, &x->m);
+    x->done--;
+    pthread_mutex_unlock(&x->m);
+}
+
+void init_waitqueue_head(wait_queue_head_t *q) {
+    pthread_mutex_init(&q->m, NULL);
+    pthread_cond_init(&q->c, NULL);
+}
+
+void wake_up(wait_queue_head_t *q) {
+    pthread_mutex_lock(&q->m);
+    pthread_cond_broadcast(&q->c);
+    pthread_mutex_unlock(&q->m);
+}
+
+/* Workqueues. A thread is started for each work item queued, and listed in
+ * kshim_works until it is done, which is what flush and cancel wait for. The
+ * work item itself is not touched once its function is called, since the
+ * function may free it. */
+struct workqueue_struct {
+    /* Number of threads started for the queue and not done */
+    int active;
+};
+
+struct kshim_work {
+    struct work_struct *work;
+    struct workqueue_struct *wq;
+    unsigned long delay;
+    struct kshim_work *next;
+};
+
+static pthread_mutex_t kshim_work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kshim_work_cond = PTHREAD_COND_INITIALIZER;
+static struct kshim_work *kshim_works;
+static struct workqueue_struct kshim_system_wq, kshim_system_unbound_wq;
+struct workqueue_struct *system_wq = &kshim_system_wq, *system_unbound_wq = &kshim_system_unbound_wq;
+
+static int kshim_work_busy(struct work_struct *work) {
+    struct kshim_work *w;
+    for (w = kshim_works; w != NULL; w = w->next)
+        if (w->work == work)
+            return 1;
+    return 0;
+}
+
+static void* kshim_work_run(void *data) {
+    struct kshim_work *w = data, **p;
+    struct work_struct *work = w->work;
+    struct timespec until;
+    pthread_mutex_lock(&kshim_work_lock);
+    if (w->delay > 0) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += w->delay / 1000;
+        until.tv_nsec += (w->delay % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        while (!work->cancel && pthread_cond_timedwait(&kshim_work_cond, &kshim_work_lock, &until) != ETIMEDOUT);
+    }
+    work->pending = 0;
+    if (!work->cancel) {
+        pthread_mutex_unlock(&kshim_work_lock);
+        work->func(work);
+        pthread_mutex_lock(&kshim_work_lock);
+    }
+    for (p = &kshim_works; *p != w; p = &(*p)->next);
+    *p = w->next;
+    w->wq->active--;
+    pthread_cond_broadcast(&kshim_work_cond);
+    pthread_mutex_unlock(&kshim_work_lock);
+    free(w);
+    return NULL;
+}
+
+static bool kshim_queue(struct workqueue_struct *wq, struct work_struct *work, unsigned long delay) {
+    struct kshim_work *w;
+    pthread_t thread;
+    pthread_mutex_lock(&kshim_work_lock);
+    if (work->pending || (w = malloc(sizeof(struct kshim_work))) == NULL) {
+        pthread_mutex_unlock(&kshim_work_lock);
+        return false;
+    }
+    work->pending = 1;
+    work->cancel = 0;
+    w->work = work;
+    w->wq = wq;
+    w->delay = delay;
+    w->next = kshim_works;
+    kshim_works = w;
+    wq->active++;
+    if (pthread_create(&thread, NULL, kshim_work_run, w) != 0)
+        abort();
+    pthread_detach(thread);
+    pthread_mutex_unlock(&kshim_work_lock);
+    return true;
+}
+
+struct workqueue_struct* alloc_workqueue(const char *fmt, unsigned int flags, int max_active, ...) {
+    return calloc(1, sizeof(struct workqueue_struct));
+}
+
+void destroy_workqueue(struct workqueue_struct *wq) {
+    pthread_mutex_lock(&kshim_work_lock);
+    while (wq->active > 0)
+        pthread_cond_wait(&kshim_work_cond, &kshim_work_lock);
+    pthread_mutex_unlock(&kshim_work_lock);
+    free(wq);
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work) {
+    return kshim_queue(wq, work, 0);
+}
+
+bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay) {
+    return kshim_queue(wq, &dwork->work, delay);
+}
+
+bool mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork, unsigned long delay) {
+    bool ret = cancel_delayed_work_sync(dwork);
+    kshim_queue(wq, &dwork->work, delay);
+    return ret;
+}
+
+bool flush_work(struct work_struct *work) {
+    bool ret = false;
+    pthread_mutex_lock(&kshim_work_lock);
+    while (kshim_work_busy(work)) {
+        ret = true;
+        pthread_cond_wait(&kshim_work_cond, &kshim_work_lock);
+    }
+    pthread_mutex_unlock(&kshim_work_lock);
+    return ret;
+}
+
+bool cancel_work_sync(struct work_struct *work) {
+    bool ret;
+    pthread_mutex_lock(&kshim_work_lock);
+    ret = work->pending;
+    if (work->pending) {
+        work->cancel = 1;
+        pthread_cond_broadcast(&kshim_work_cond);
+    }
+    while (kshim_work_busy(work))
+        pthread_cond_wait(&kshim_work_cond, &kshim_work_lock);
+    pthread_mutex_unlock(&kshim_work_lock);
+    return ret;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dwork) {
+    return cancel_work_sync(&dwork->work);
+}
+
+/* Sockets */
+static int kshim_connect(struct socket *sock, struct sockaddr *addr, int len, int flags) {
+    return connect(sock->fd, addr, len) < 0 ? -errno : 0;
+}
+
+static const struct proto_ops kshim_proto_ops = {
+    .connect = kshim_connect,
+};
+
+int sock_create(int family, int type, int proto, struct socket **res) {
+    struct socket *sock = malloc(sizeof(struct socket));
+    if (sock == NULL)
+        return -ENOMEM;
+    if ((sock->fd = socket(family, type, proto)) < 0) {
+        free(sock);
+        return -errno;
+    }
+    sock->ops = &kshim_proto_ops;
+    *res = sock;
+    return 0;
+}
+
+void sock_release(struct socket *sock) {
+    close(sock->fd);
+    free(sock);
+}
+
+int kernel_sendmsg(struct socket *sock, struct msghdr *msg, struct kvec *vec, size_t num, size_t len) {
+    ssize_t ret;
+    msg->msg_iov = (struct iovec*)vec;
+    msg->msg_iovlen = num;
+    ret = sendmsg(sock->fd, msg, msg->msg_flags | MSG_NOSIGNAL);
+    return ret < 0 ? -errno : ret;
+}
+
+int kernel_recvmsg(struct socket *sock, struct msghdr *msg, struct kvec *vec, size_t num, size_t len, int flags) {
+    ssize_t ret;
+    msg->msg_iov = (struct iovec*)vec;
+    msg->msg_iovlen = num;
+    ret = recvmsg(sock->fd, msg, flags);
+    return ret < 0 ? -errno : ret;
+}
+
+int in4_pton(const char *src, int srclen, u8 *dst, int delim, const char **end) {
+    char buf[INET_ADDRSTRLEN];
+    if (srclen < 0)
+        srclen = strlen(src);
+    if (srclen >= sizeof(buf))
+        return 0;
+    memcpy(buf, src, srclen);
+    buf[srclen] = 0;
+    return inet_pton(AF_INET, buf, dst) == 1;
+}
+
+int kernel_sendpage(struct socket *sock, struct page *page, int offset, size_t size, int flags) {
+    ssize_t ret = send(sock->fd, (char*)page->addr + offset, size, flags | MSG_NOSIGNAL);
+    return ret < 0 ? -errno : ret;
+}
+
+int kernel_setsockopt(struct socket *sock, int level, int optname, char *optval, unsigned int optlen) {
+    return setsockopt(sock->fd, level, optname, optval, optlen) < 0 ? -errno : 0;
+}
+
+/* debugfs, whose files are never created */
+struct dentry* debugfs_create_dir(const char *name, struct dentry *parent) {
+    return NULL;
+}
+
+struct dentry* debugfs_create_file(const char *name, umode_t mode, struct dentry *parent,
+        void *data, const struct file_operations *fops) {
+    return NULL;
+}
+
+void debugfs_remove_recursive(struct dentry *dentry) {
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *m, void *v), void *data) {
+    return -ENOSYS;
+}
+
+int single_release(struct inode *inode, struct file *file) {
+    return 0;
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t len, loff_t *pos) {
+    return -ENOSYS;
+}
+
+loff_t seq_lseek(struct file *file, loff_t off, int whence) {
+    return -ENOSYS;
+}
+
+/* seq_file output goes to stdout */
+int seq_printf(struct seq_file *m, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    return 0;
+}
+
+int seq_puts(struct seq_file *m, const char *s) {
+    return fputs(s, stdout) < 0 ? -EIO : 0;
+}
+
+int seq_putc(struct seq_file *m, char c) {
+    return putchar(c) < 0 ? -EIO : 0;
+}